@@ -1,37 +1,144 @@
 #include <stdlib.h>
+#include <string.h>
 #include "Bnuuy_chunk.h"
 #include "Bnuuy_memory.h"
 #include "Bnuuy_value.h"
+#include "vm.h"
 
 void startChunk(Chunk* chunk){
     chunk->count        = 0;
     chunk->capacity     = 0;
+    chunk->finalized    = false;
     chunk->code         = NULL;
-    chunk->line         = 0;
-    initValueArray(&chunk->constants);
+    initValueArray(&chunk->constants, MEM_CONSTANTS);
+    chunk->cacheCount    = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches        = NULL;
+    chunk->lineCount     = 0;
+    chunk->lineCapacity  = 0;
+    chunk->lines         = NULL;
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte){
+// Start a new run if the code about to be written comes from a different line than the last.
+static void markLine(Chunk* chunk, int line){
+    if(chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+    if(chunk->lineCapacity < chunk->lineCount + 1){
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(MEM_CODE, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount++] = (LineStart){ chunk->count, line };
+}
+
+void writeChunk(Chunk* chunk, uint8_t byte, int line){
+    markLine(chunk, line);
     if(chunk->capacity < chunk->count + 1){
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY (oldCapacity);
-        chunk->code     = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->code     = GROW_ARRAY(MEM_CODE, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
     chunk->count++;
 }
 
+void reserveChunk(Chunk* chunk, int capacity){
+    if(chunk->capacity >= capacity) return;
+    chunk->code     = GROW_ARRAY(MEM_CODE, uint8_t, chunk->code, chunk->capacity, capacity);
+    chunk->capacity = capacity;
+}
+
+// One capacity check for the whole instruction instead of one per byte.
+void writeChunkBytes(Chunk* chunk, const uint8_t* bytes, int length, int line){
+    markLine(chunk, line);
+    if(chunk->capacity < chunk->count + length){
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        if(capacity < chunk->count + length) capacity = chunk->count + length;
+        reserveChunk(chunk, capacity);
+    }
+    memcpy(chunk->code + chunk->count, bytes, length);
+    chunk->count += length;
+}
+
+/// @brief Called once the compiler is done with the chunk. Trims the constants and caches to what was used,
+/// and copies the code into an aligned block of its own, which is made read-only when READ_ONLY_CODE is set.
+/// @param chunk 
+void finalizeChunk(Chunk* chunk){
+    if(chunk->finalized) return;
+
+    uint8_t* code = allocateCode(chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    FREE_ARRAY(MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+    protectCode(code, chunk->count);
+    chunk->code      = code;
+    chunk->capacity  = chunk->count;
+    chunk->finalized = true;
+
+    if(chunk->lineCapacity > chunk->lineCount){
+        chunk->lines = GROW_ARRAY(MEM_CODE, LineStart, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+        chunk->lineCapacity = chunk->lineCount;
+    }
+    if(chunk->cacheCapacity > chunk->cacheCount){
+        chunk->caches = GROW_ARRAY(MEM_CACHES, InlineCache, chunk->caches, chunk->cacheCapacity, chunk->cacheCount);
+        chunk->cacheCapacity = chunk->cacheCount;
+    }
+    ValueArray* constants = &chunk->constants;
+    if(constants->capacity > constants->count){
+        constants->values = GROW_ARRAY(MEM_CONSTANTS, Value, constants->values, constants->capacity, constants->count);
+        constants->capacity = constants->count;
+    }
+}
+
 /// @brief Returns the int index of the constant in the constants array.
 /// @param chunk 
 /// @param value 
 /// @return The integer address of the location of the constant in the value array.
 int addConstant(Chunk* chunk, Value value){
+    //Growing the array can set off a collection, so keep the value where the GC can see it.
+    //Compile workers can't collect, so they skip this.
+    if(localHeap == NULL) push(value);
     writeValueArray(&chunk->constants, value);
+    if(localHeap == NULL) pop();
     return chunk->constants.count - 1;
 }
 
+int addInlineCache(Chunk* chunk){
+    if(chunk->cacheCapacity < chunk->cacheCount + 1){
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(MEM_CACHES, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->count  = 0;
+    cache->hits   = 0;
+    cache->misses = 0;
+    return chunk->cacheCount++;
+}
+
+/// @brief Binary search the runs for the last one starting at or before offset.
+/// @return The line, or 0 if the chunk has no lines to go on.
+int getLine(Chunk* chunk, int offset){
+    if(chunk->lineCount == 0) return 0;
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while(low < high){
+        int middle = (low + high + 1) / 2;
+        if(chunk->lines[middle].offset <= offset){
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
 void freeChunk(Chunk* chunk){
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if(chunk->finalized){
+        freeCode(chunk->code, chunk->count);
+    } else {
+        FREE_ARRAY(MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+    }
+    FREE_ARRAY(MEM_CACHES, InlineCache, chunk->caches, chunk->cacheCapacity);
+    FREE_ARRAY(MEM_CODE, LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     startChunk(chunk);
 }
\ No newline at end of file
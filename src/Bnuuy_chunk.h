@@ -12,28 +12,116 @@ typedef enum {
     OP_DIVIDE,
     OP_MULTIPLY,
     OP_NEGATE,
+    //Logic
+    OP_NOT,
+    OP_EQUAL,
+    OP_GREATER,
+    OP_LESS,
     //Line feed
     OP_UPDATE_LINE,
     //Variables
     OP_CONSTANT,
+    OP_DEFINE_GLOBAL,       // Operand is the global's slot.
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_DEFINE_GLOBAL_NAME,  // Operand is a constant holding the name, for late-bound globals.
+    OP_GET_GLOBAL_NAME,
+    OP_SET_GLOBAL_NAME,
+    OP_GET_LOCAL,           // Operand is the slot in the current frame.
+    OP_SET_LOCAL,
+    OP_GET_PROPERTY,        // Operands are the name constant and a 16 bit inline cache index.
+    OP_SET_PROPERTY,
+    //Literals
+    OP_NIL,
+    OP_TRUE,
+    OP_FALSE,
+    //Vectors
+    OP_VECTOR,              // Operand is the element count, the elements are on the stack.
+    OP_INDEX,               // Vector and index on the stack.
+    //Statements
+    OP_PRINT,
+    OP_POP,
+    OP_DUP,                 // Push a copy of the top value. Only the optimizer emits it.
+    //Control flow, operands are a 16 bit offset
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_LOOP,
+    //Functions
+    OP_CALL,                // Operand is the argument count.
+    //Fibers
+    OP_YIELD,
+    //Parallel for. Operand is the Reduction, the stack holds start, end and the body function.
+    OP_PARALLEL_FOR,
+    //Classes
+    OP_CLASS,               // Operand is the name constant.
+    OP_METHOD,
     //AUX
     OP_RETURN,
+    OP_COUNT,               // Not an instruction, the number of opcodes.
 } OpCode;
 
+// How a parallel for combines the values its iterations produce.
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_COUNT,           // Not a reduction, the number of them.
+} Reduction;
+
+// INLINE CACHES
+// Every property get/set in the bytecode owns one of these. It remembers the shapes it has seen
+// and where the field was for each, so a repeat visit is a shape compare and an indexed load.
+// One entry is monomorphic, up to IC_POLY_MAX is polymorphic, past that the site is megamorphic
+// and we stop caching and always do the slow lookup.
+#define IC_POLY_MAX 4
+
+typedef struct {
+    ObjShape* shape;        // Receiver shape this entry applies to.
+    int offset;             // Field index, or -1 for a method.
+    Obj* target;            // Gets: the method for offset -1. Sets: the shape after adding the field, or NULL.
+} ICEntry;
+
+typedef struct {
+    int count;              // Entries in use, IC_POLY_MAX + 1 once megamorphic.
+    ICEntry entries[IC_POLY_MAX];
+    uint32_t hits;
+    uint32_t misses;
+} InlineCache;
+
+// Where a run of code compiled from one source line starts. The runs are in order and cover the whole chunk,
+// so a line only costs an entry when it changes.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 // Chunk
 // Dynmaically growing array of bytes.
+// While the compiler is writing it, code is an ordinary growing array. finalizeChunk() then moves it
+// into an aligned block sized to fit, after which it is never written again.
 typedef struct {
     int count;              // Number of elements currently stored.
     int capacity;           // Number of elements drafted in space.
-    int line;               // The current "line" of code the interpreter is parsing
+    bool finalized;         // code lives in an allocateCode() block of count bytes.
     uint8_t* code;          // 1 byte unsigned integer.
     ValueArray constants;   // We take the constants with the chunk
+    int cacheCount;         // Inline caches, one per property access site.
+    int cacheCapacity;
+    InlineCache* caches;
+    int lineCount;          // Runs in lines. Only read when something goes wrong, to say where.
+    int lineCapacity;
+    LineStart* lines;
 } Chunk;
 
 void startChunk(Chunk* chunk);                  // Initialise a new chunk.
-void writeChunk(Chunk* chunk, uint8_t byte);    // Write a single byte to the chunk
+void writeChunk(Chunk* chunk, uint8_t byte, int line);     // Write a single byte to the chunk
+void writeChunkBytes(Chunk* chunk, const uint8_t* bytes, int length, int line);  // Write a whole instruction at once.
+void reserveChunk(Chunk* chunk, int capacity);  // Make room for at least capacity bytes up front.
+void finalizeChunk(Chunk* chunk);               // Shrink everything to fit and seal the code.
 void freeChunk(Chunk* chunk);                   // Requests the freeing of chunk memory
 int  addConstant(Chunk* chunk, Value value);    // This writes a constant Value to the chunk.
+int  addInlineCache(Chunk* chunk);              // Reserve an empty inline cache for a property access site.
+int  getLine(Chunk* chunk, int offset);         // The source line the byte at offset was compiled from.
    
 
 #endif
\ No newline at end of file
@@ -1,12 +1,72 @@
 #ifndef bnuuy_common_h
 #define bnuuy_common_h
 
-//#define DEBUG_TRACE_EXECUTION
-// asd
-#define DEBUG_PRINT_CODE
+// Tracing, profiling, single stepping and code listings are switched on at runtime now, see vm.h.
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
+// Finished bytecode is mapped onto its own pages and made read-only. POSIX only.
+//#define READ_ONLY_CODE
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// What an allocation is for. Every call to reallocate() says, so the memory stats can break usage down.
+// Lives here rather than in Bnuuy_memory.h because value arrays carry one.
+typedef enum {
+    MEM_OBJECTS,            // Object bodies, apart from the ones below.
+    MEM_STRINGS,            // String objects, characters included.
+    MEM_VECTORS,            // Vector objects, elements included.
+    MEM_CODE,               // Bytecode, while it is written and once finished.
+    MEM_CONSTANTS,          // Constant pools.
+    MEM_CACHES,             // Inline caches.
+    MEM_STACKS,             // Fiber stacks and call frames.
+    MEM_FIELDS,             // Instance fields that outgrew the room inside the instance.
+    MEM_TABLES,             // Hash tables: interned strings, global names, methods, shape transitions.
+    MEM_GLOBALS,            // Global values.
+    MEM_COMPILER,           // Scratch space for the verifier and optimizer.
+    MEM_HOST,               // Handles given out through the embedding API.
+    MEM_SITE_COUNT,         // Not a site, the number of them.
+} MemSite;
+
+// run() jumps from one instruction straight to the next through a table of label addresses,
+// a GNU extension. Anything else gets a switch.
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+// Tell the compiler a branch can never be taken, so it can drop the check leading to it.
+#if defined(__GNUC__)
+#define UNREACHABLE() __builtin_unreachable()
+#else
+#define UNREACHABLE() ((void)0)
+#endif
+
+// 64 bit integer arithmetic that says whether it overflowed instead of wrapping.
+// Each stores the result and is true if it did not fit.
+#if defined(__GNUC__)
+#define ADD_OVERFLOWS(a, b, result) __builtin_add_overflow(a, b, result)
+#define SUB_OVERFLOWS(a, b, result) __builtin_sub_overflow(a, b, result)
+#define MUL_OVERFLOWS(a, b, result) __builtin_mul_overflow(a, b, result)
+#else
+static inline bool ADD_OVERFLOWS(int64_t a, int64_t b, int64_t* result){
+    if((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return true;
+    *result = a + b;
+    return false;
+}
+static inline bool SUB_OVERFLOWS(int64_t a, int64_t b, int64_t* result){
+    if((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return true;
+    *result = a - b;
+    return false;
+}
+static inline bool MUL_OVERFLOWS(int64_t a, int64_t b, int64_t* result){
+    if(a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+             : (b > 0 ? a < INT64_MIN / b : a != 0 && b < INT64_MAX / a)) return true;
+    *result = a * b;
+    return false;
+}
+#endif
+
 #endif
\ No newline at end of file
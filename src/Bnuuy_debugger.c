@@ -3,6 +3,7 @@
 
 #include "Bnuuy_debugger.h"
 #include "Bnuuy_value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name){
     printf("Chunk: %s\n", name);
@@ -27,20 +28,101 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset){
     return offset + 2;
 }
 
+// Name constant plus the inline cache, showing what the cache has learned so far.
+static int propertyInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t index = (uint16_t)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    InlineCache* cache = &chunk->caches[index];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    if(cache->count == 0)               printf("' ic %d empty\n", index);
+    else if(cache->count == 1)          printf("' ic %d mono %u/%u\n", index, cache->hits, cache->hits + cache->misses);
+    else if(cache->count <= IC_POLY_MAX) printf("' ic %d poly(%d) %u/%u\n", index, cache->count, cache->hits, cache->hits + cache->misses);
+    else                                printf("' ic %d mega %u/%u\n", index, cache->hits, cache->hits + cache->misses);
+    return offset + 4;
+}
+
+// Local slots are just a number.
+static int byteInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+// Print where the jump lands. sign is -1 for loops which jump backwards.
+static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset){
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+// Globals resolved to a slot, print the slot and the name it belongs to.
+static int globalInstruction(const char* name, Chunk* chunk, int offset){
+    uint8_t slot = chunk->code[offset + 1];
+    ObjString* global = globalName(slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 2;
+}
+
 // With this implementation, clox only allows up to 0xFF lines of code
 static int updateLineInstruction(const char* name, Chunk* chunk, int offset ){
     //Grab the next byte of code which is the line number.
     uint8_t line = chunk->code[offset + 1];
-    chunk->line = line;
     printf("%-16s %4d ", name, line);
     printf("%u", line);
     printf("\n");
     return offset + 2;
 }
 
+static const char* const opcodeNames[OP_COUNT] = {
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_UPDATE_LINE] = "OP_UPDATE_LINE",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_DEFINE_GLOBAL_NAME] = "OP_DEFINE_GLOBAL_NAME",
+    [OP_GET_GLOBAL_NAME] = "OP_GET_GLOBAL_NAME",
+    [OP_SET_GLOBAL_NAME] = "OP_SET_GLOBAL_NAME",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_VECTOR] = "OP_VECTOR",
+    [OP_INDEX] = "OP_INDEX",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DUP] = "OP_DUP",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_YIELD] = "OP_YIELD",
+    [OP_PARALLEL_FOR] = "OP_PARALLEL_FOR",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char* opcodeName(uint8_t instruction){
+    return instruction < OP_COUNT ? opcodeNames[instruction] : "OP_UNKNOWN";
+}
+
 int disassembleInstruction(Chunk* chunk, int offset){
     printf("%04d ", offset);
-    printf("%03u ", chunk->line);
+    printf("%03d ", getLine(chunk, offset));
     uint8_t instruction = chunk->code[offset];
     switch(instruction){
         case OP_ADD:
@@ -53,10 +135,70 @@ int disassembleInstruction(Chunk* chunk, int offset){
             return simpleInstruction("OP_DIVIDE", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+        case OP_NOT:
+            return simpleInstruction("OP_NOT", offset);
+        case OP_EQUAL:
+            return simpleInstruction("OP_EQUAL", offset);
+        case OP_GREATER:
+            return simpleInstruction("OP_GREATER", offset);
+        case OP_LESS:
+            return simpleInstruction("OP_LESS", offset);
         case OP_UPDATE_LINE:
             return updateLineInstruction("OP_UPDATE_LINE", chunk, offset);
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_NIL:
+            return simpleInstruction("OP_NIL", offset);
+        case OP_TRUE:
+            return simpleInstruction("OP_TRUE", offset);
+        case OP_FALSE:
+            return simpleInstruction("OP_FALSE", offset);
+        case OP_DEFINE_GLOBAL:
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL:
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_NAME:
+            return constantInstruction("OP_DEFINE_GLOBAL_NAME", chunk, offset);
+        case OP_GET_GLOBAL_NAME:
+            return constantInstruction("OP_GET_GLOBAL_NAME", chunk, offset);
+        case OP_SET_GLOBAL_NAME:
+            return constantInstruction("OP_SET_GLOBAL_NAME", chunk, offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_PROPERTY:
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_JUMP:
+            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_LOOP:
+            return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_VECTOR:
+            return byteInstruction("OP_VECTOR", chunk, offset);
+        case OP_INDEX:
+            return simpleInstruction("OP_INDEX", offset);
+        case OP_CLASS:
+            return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_METHOD:
+            return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_PRINT:
+            return simpleInstruction("OP_PRINT", offset);
+        case OP_POP:
+            return simpleInstruction("OP_POP", offset);
+        case OP_DUP:
+            return simpleInstruction("OP_DUP", offset);
+        case OP_PARALLEL_FOR:
+            return byteInstruction("OP_PARALLEL_FOR", chunk, offset);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         default:
@@ -5,5 +5,6 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);  // Read the chunk to end.
 int disassembleInstruction(Chunk* chunk, int offset);  // Read instruction n bytes in/
+const char* opcodeName(uint8_t instruction);            // Just the name, for the profiler.
 
 #endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "Bnuuy_embed.h"
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "compiler.h"
+
+struct Expression {
+    ObjFunction* function;
+    ObjFiber* fiber;        // Reused for every evaluation, it is only ever this function running on it.
+    Value* inputs;          // One per parameter of function.
+    struct Expression* next;
+    struct Expression* previous;
+};
+
+// Every live expression, they are roots until freed.
+static Expression* expressions = NULL;
+
+Expression* newExpression(const char* source, int inputCount, const char* const* inputs){
+    ObjFunction* function = compileExpression(source, inputCount, inputs);
+    if(function == NULL) return NULL;
+    //Keep the function from the GC until the expression is in the list.
+    push(OBJ_VAL(function));
+
+    ObjFiber* fiber = newFiber();
+    push(OBJ_VAL(fiber));
+    int capacity = function->maxStack + STACK_SLACK;
+    fiber->stack = GROW_ARRAY(MEM_STACKS, Value, NULL, 0, capacity);
+    fiber->stackCapacity = capacity;
+    fiber->frames = GROW_ARRAY(MEM_STACKS, CallFrame, NULL, 0, GROW_CAPACITY(0));
+    fiber->frameCapacity = GROW_CAPACITY(0);
+    fiber->state = FIBER_DONE;
+
+    Expression* expression = ALLOCATE(MEM_HOST, Expression, 1);
+    expression->function = function;
+    expression->fiber = fiber;
+    expression->inputs = ALLOCATE(MEM_HOST, Value, inputCount);
+    for(int i = 0; i < inputCount; i++){
+        expression->inputs[i] = NIL_VAL;
+    }
+    expression->previous = NULL;
+    expression->next = expressions;
+    if(expressions != NULL) expressions->previous = expression;
+    expressions = expression;
+
+    pop();
+    pop();
+    return expression;
+}
+
+void freeExpression(Expression* expression){
+    if(expression->previous != NULL){
+        expression->previous->next = expression->next;
+    } else {
+        expressions = expression->next;
+    }
+    if(expression->next != NULL) expression->next->previous = expression->previous;
+    //The function and fiber go with the next GC cycle.
+    FREE_ARRAY(MEM_HOST, Value, expression->inputs, expression->function->arity);
+    FREE(MEM_HOST, Expression, expression);
+}
+
+void bindInput(Expression* expression, int input, Value value){
+    expression->inputs[input] = value;
+}
+
+InterpretResult evaluate(Expression* expression, Value* result){
+    ObjFiber* fiber = expression->fiber;
+    ObjFunction* function = expression->function;
+    restartFiber(fiber, function, OBJ_VAL(function), function->arity, expression->inputs);
+    //Anything the expression spawned runs to completion too, it would never get another turn otherwise.
+    runFibers();
+    if(fiber->state == FIBER_FAILED) return INTERPRET_RUNTIME_ERROR;
+    *result = fiber->result;
+    return INTERPRET_OK;
+}
+
+Value stringValue(const char* chars, int length){
+    return OBJ_VAL(copyString(chars, length));
+}
+
+// A rope is flattened here, the flat string lives as long as the rope does.
+const char* valueChars(Value value){
+    if(IS_ROPE(value)) return flattenRope(AS_ROPE(value))->chars;
+    return IS_STRING(value) ? AS_CSTRING(value) : NULL;
+}
+
+MemStats memoryStats(){
+    return vm.memStats;
+}
+
+GCStats gcStats(){
+    return vm.gcStats;
+}
+
+// Bound inputs live outside the heap and change without a barrier. The collector marks the roots
+// again before it finishes, which picks up whatever they hold by then.
+void markEmbedRoots(){
+    for(Expression* expression = expressions; expression != NULL; expression = expression->next){
+        markObject((Obj*)expression->function);
+        markObject((Obj*)expression->fiber);
+        for(int i = 0; i < expression->function->arity; i++){
+            markValue(expression->inputs[i]);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef bnuuy_embed_h
+#define bnuuy_embed_h
+
+#include "Bnuuy_common.h"
+#include "Bnuuy_value.h"
+#include "vm.h"
+
+// EMBEDDING
+// For a host program that links the VM in as a library and calls into it without any text going through
+// stdin or stdout. Set up with initVM(), run any scripts the expressions rely on with interpret(), then
+// compile each expression once and evaluate it as often as needed. Results come back as Values, read
+// them with the macros in Bnuuy_value.h.
+//
+// An expression is compiled into a function whose parameters are its inputs, and it keeps its own fiber
+// to run on. Evaluating just copies the bound inputs into that fiber and runs it, nothing is compiled,
+// allocated or looked up by name. Expressions can read globals and call functions the scripts defined.
+//
+// The VM is single threaded, only call these from the thread that called initVM(), and never from a native.
+// Free every expression before freeVM().
+
+typedef struct Expression Expression;
+
+// Inputs are named in the order they are bound in, by index. NULL if the source does not compile.
+Expression* newExpression(const char* source, int inputCount, const char* const* inputs);
+void freeExpression(Expression* expression);
+
+// Inputs start as nil and keep their value between evaluations.
+void bindInput(Expression* expression, int input, Value value);
+// The result stays valid until the next evaluation of this expression.
+InterpretResult evaluate(Expression* expression, Value* result);
+
+// Strings go through the VM's heap. One made here is only kept alive once it is bound to an input,
+// bind it before calling anything else.
+Value stringValue(const char* chars, int length);
+const char* valueChars(Value value);    // NULL unless value is a string. The VM owns the characters.
+
+// Everything the VM has allocated so far, by what it was for. See MemStats in Bnuuy_memory.h.
+MemStats memoryStats();
+// Collector cycles so far, with the pauses and heap sizes of the last one. See GCStats in Bnuuy_memory.h.
+GCStats gcStats();
+
+void markEmbedRoots();
+
+#endif
@@ -1,18 +1,617 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef READ_ONLY_CODE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "Bnuuy_embed.h"
 #include "Bnuuy_memory.h"
+#include "Bnuuy_parallel.h"
+#include "Bnuuy_server.h"
+#include "Bnuuy_table.h"
+#include "compiler.h"
+#include "vm.h"
+
+// A slice always does at least this much work, even if the clock says it is over budget,
+// otherwise a slow machine could starve the collector and the heap would never shrink.
+#define GC_MIN_SLICE_WORK   64
+// Checking the clock costs more than marking a string, so only look at it every so often.
+#define GC_CLOCK_INTERVAL   32
+
+static void gcAllocationStep(size_t size);
+
+_Thread_local LocalHeap* localHeap = NULL;
+
+static const char* siteNames[MEM_SITE_COUNT] = {
+    "objects", "strings", "vectors", "code", "constants", "caches", "stacks",
+    "fields", "tables", "globals", "compiler", "host",
+};
+
+// MEMORY STATS
+
+static int sizeClass(size_t size){
+    int sizeClass = 0;
+    for(size_t limit = 16; size > limit && sizeClass < MEM_SIZE_CLASSES - 1; limit *= 2) sizeClass++;
+    return sizeClass;
+}
+
+// Count one call to the allocator. wasNull says whether there was a block before, moved whether a resize
+// had to put it somewhere else.
+static void countAllocation(MemSite site, bool wasNull, bool moved, size_t oldSize, size_t newSize){
+    if(wasNull && newSize == 0) return;
+    MemStats* stats = localHeap != NULL ? &localHeap->memStats : &vm.memStats;
+    SiteStats* counts = &stats->sites[site];
+    if(newSize == 0){
+        counts->frees++;
+    } else {
+        stats->sizeClasses[sizeClass(newSize)]++;
+        if(wasNull){
+            counts->allocations++;
+        } else {
+            counts->resizes++;
+            if(moved) counts->bytesCopied += oldSize < newSize ? oldSize : newSize;
+        }
+    }
+    if(newSize > oldSize) counts->bytesAllocated += newSize - oldSize;
+    int64_t change = (int64_t) newSize - (int64_t) oldSize;
+    counts->liveBytes += change;
+    stats->liveBytes += change;
+    if(stats->liveBytes > stats->peakBytes) stats->peakBytes = stats->liveBytes;
+}
+
+void* reallocate (MemSite site, void* pointer, size_t oldSize, size_t newSize){
+    if(localHeap != NULL){
+        localHeap->bytesAllocated += newSize - oldSize;
+    } else {
+        vm.bytesAllocated += newSize - oldSize;
+
+        //Only growing the heap can pay for collector work.
+        if(newSize > oldSize){
+            gcAllocationStep(newSize - oldSize);
+        }
+    }
 
-void* reallocate (void* pointer, size_t oldSize, size_t newSize){
     //Deallocate if we want to request 0 size.
     if (newSize == 0){
+        countAllocation(site, pointer == NULL, false, oldSize, 0);
         free(pointer);
+        return NULL;
     }
 
     // Call realloc otherwise.1
+    //The old pointer can't be looked at once realloc() has it, keep its address as a number to compare.
+    uintptr_t before = (uintptr_t) pointer;
     void* result = realloc(pointer, newSize);
     //Crash ungracefully if we cannot allocate memory.
     if (result == NULL){
         exit(1);
     }
-    
+    countAllocation(site, before == 0, before != 0 && before != (uintptr_t) result, oldSize, newSize);
+
     return result;
-}
\ No newline at end of file
+}
+
+// FINISHED CODE
+// These go around reallocate() because the block needs an alignment realloc() can't promise,
+// but they still count towards the heap so the collector paces itself on the real footprint.
+
+size_t codeBlockSize(size_t size){
+#ifdef READ_ONLY_CODE
+    size_t alignment = (size_t) sysconf(_SC_PAGESIZE);
+#else
+    size_t alignment = CODE_ALIGNMENT;
+#endif
+    //aligned_alloc() wants a multiple of the alignment.
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+void* allocateCode(size_t size){
+    size_t blockSize = codeBlockSize(size);
+    if(localHeap != NULL){
+        localHeap->bytesAllocated += blockSize;
+    } else {
+        vm.bytesAllocated += blockSize;
+        gcAllocationStep(blockSize);
+    }
+#ifdef READ_ONLY_CODE
+    void* result = mmap(NULL, blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(result == MAP_FAILED) exit(1);
+#elif defined(_WIN32)
+    void* result = _aligned_malloc(blockSize, CODE_ALIGNMENT);
+    if(result == NULL) exit(1);
+#else
+    void* result = aligned_alloc(CODE_ALIGNMENT, blockSize);
+    if(result == NULL) exit(1);
+#endif
+    countAllocation(MEM_CODE, true, false, 0, blockSize);
+    return result;
+}
+
+void freeCode(void* pointer, size_t size){
+    if(pointer == NULL) return;
+    size_t blockSize = codeBlockSize(size);
+    countAllocation(MEM_CODE, false, false, blockSize, 0);
+    if(localHeap != NULL){
+        localHeap->bytesAllocated -= blockSize;
+    } else {
+        vm.bytesAllocated -= blockSize;
+    }
+#ifdef READ_ONLY_CODE
+    munmap(pointer, blockSize);
+#elif defined(_WIN32)
+    _aligned_free(pointer);
+#else
+    free(pointer);
+#endif
+}
+
+void protectCode(void* pointer, size_t size){
+#ifdef READ_ONLY_CODE
+    mprotect(pointer, codeBlockSize(size), PROT_READ);
+#else
+    (void) pointer;
+    (void) size;
+#endif
+}
+
+void initLocalHeap(LocalHeap* heap){
+    heap->objects = NULL;
+    heap->bytesAllocated = 0;
+    memset(&heap->memStats, 0, sizeof(heap->memStats));
+}
+
+// Splice a worker's objects onto the front of the VM's list. Only call this once the worker has finished.
+// Workers fill their objects in without barriers, so any born black while we are marking is traced again.
+void adoptLocalHeap(LocalHeap* heap){
+    if(heap->objects != NULL){
+        Obj* tail = heap->objects;
+        gcRescan(tail);
+        while(tail->next != NULL){
+            tail = tail->next;
+            gcRescan(tail);
+        }
+        tail->next = vm.objects;
+        vm.objects = heap->objects;
+    }
+    vm.bytesAllocated += heap->bytesAllocated;
+
+    MemStats* from = &heap->memStats;
+    MemStats* to = &vm.memStats;
+    for(int i = 0; i < MEM_SITE_COUNT; i++){
+        to->sites[i].allocations    += from->sites[i].allocations;
+        to->sites[i].resizes        += from->sites[i].resizes;
+        to->sites[i].frees          += from->sites[i].frees;
+        to->sites[i].bytesAllocated += from->sites[i].bytesAllocated;
+        to->sites[i].bytesCopied    += from->sites[i].bytesCopied;
+        to->sites[i].liveBytes      += from->sites[i].liveBytes;
+    }
+    for(int i = 0; i < MEM_SIZE_CLASSES; i++){
+        to->sizeClasses[i] += from->sizeClasses[i];
+    }
+    //The worker's own peak was on top of whatever the VM held at the time, which we don't know.
+    to->liveBytes += from->liveBytes;
+    if(to->liveBytes > to->peakBytes) to->peakBytes = to->liveBytes;
+    initLocalHeap(heap);
+}
+
+// Monotonic, so the clock being set while we collect can't blow the pause budget or make a pause negative.
+static uint64_t nowNs(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+// MARKING
+
+void markObject(Obj* object){
+    if(object == NULL) return;
+    if(object->isMarked) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = true;
+
+    //The grey stack is owned by the collector, so it uses the system allocator
+    //and does not recurse back into reallocate().
+    if(vm.grayCapacity < vm.grayCount + 1){
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        Obj** grayStack = (Obj**) realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        if(grayStack == NULL) exit(1);
+        vm.grayStack = grayStack;
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value){
+    if(IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array){
+    for(int i = 0; i < array->count; i++){
+        markValue(array->values[i]);
+    }
+}
+
+// Insertion barrier. Anything that writes a reference into a heap object must call this,
+// otherwise a white object stored into an object we have already traced would be swept.
+// That includes a constructor filling in a new object: objects born while we are marking are black
+// (see allocateObject()) and the collector never traces them, so every reference they start out with
+// needs a barrier too. Code that fills an object in bulk without barriers calls gcRescan() when done.
+// Workers leave the grey stack alone, adoptLocalHeap() traces their objects again instead.
+void gcWriteBarrier(Obj* holder, Value value){
+    if(localHeap != NULL) return;
+    if(vm.gcPhase == GC_MARK && holder->isMarked) markValue(value);
+}
+
+// For objects written too often to barrier every store, like a fiber's stack. If it has already
+// been traced this cycle, put it back on the grey stack so it is traced again.
+void gcRescan(Obj* object){
+    if(localHeap != NULL || vm.gcPhase != GC_MARK || !object->isMarked) return;
+    object->isMarked = false;
+    markObject(object);
+}
+
+// Trace an object's references. Strings, natives and vectors do not hold any.
+static void blackenObject(Obj* object){
+    switch(object->type){
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            markValue(bound->receiver);
+            markObject((Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            markObject((Obj*)klass->name);
+            markTable(&klass->methods);
+            markObject((Obj*)klass->rootShape);
+            break;
+        }
+        case OBJ_FIBER: {
+            //The running fiber's stack is a root and is scanned there, its saved top is stale anyway.
+            ObjFiber* fiber = (ObjFiber*)object;
+            if(fiber != exec.fiber){
+                for(Value* slot = fiber->stack; slot < fiber->stackTop; slot++){
+                    markValue(*slot);
+                }
+                for(int i = 0; i < fiber->frameCount; i++){
+                    markObject((Obj*)fiber->frames[i].function);
+                }
+            }
+            markValue(fiber->result);
+            markObject((Obj*)fiber->nextReady);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject((Obj*)function->name);
+            markObject((Obj*)function->source);
+            markArray(&function->chunk.constants);
+            //A cached shape must stay alive, or a new shape could reuse its address and hit the cache.
+            for(int i = 0; i < function->chunk.cacheCount; i++){
+                InlineCache* cache = &function->chunk.caches[i];
+                for(int j = 0; j < cache->count && j < IC_POLY_MAX; j++){
+                    markObject((Obj*)cache->entries[j].shape);
+                    markObject(cache->entries[j].target);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            markObject((Obj*)instance->klass);
+            markObject((Obj*)instance->shape);
+            for(int i = 0; i < instance->shape->fieldCount; i++){
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->transitions);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_VECTOR:
+            break;
+    }
+}
+
+static void markRoots(){
+    for(Value* slot = exec.stack; slot < exec.stackTop; slot++){
+        markValue(*slot);
+    }
+    //The running functions are also in slot zero of their frames, but be explicit about it.
+    for(int i = 0; i < exec.frameCount; i++){
+        markObject((Obj*)exec.frames[i].function);
+    }
+    //The queue is linked through the fibers, marking the head reaches the rest.
+    markObject((Obj*)exec.fiber);
+    markObject((Obj*)vm.rootFiber);
+    markObject((Obj*)vm.readyHead);
+    markTable(&vm.globalNames);
+    markObject((Obj*)vm.initString);
+    markArray(&vm.globalValues);
+    markCompilerRoots();
+    markParallelRoots();
+    markEmbedRoots();
+    markServerRoots();
+}
+
+// Blacken grey objects until there are none left or we are past the pause budget.
+static void traceSome(uint64_t start){
+    size_t work = 0;
+    while(vm.grayCount > 0){
+        blackenObject(vm.grayStack[--vm.grayCount]);
+        work++;
+        if(work >= GC_MIN_SLICE_WORK && work % GC_CLOCK_INTERVAL == 0 &&
+           nowNs() - start >= vm.gcConfig.pauseBudgetNs) break;
+    }
+}
+
+// Marking is done. The roots may have changed since the cycle started so trace them again,
+// then drop any interned strings nobody reached and hand the whole object list to the sweeper.
+static void finishMark(){
+    markRoots();
+    while(vm.grayCount > 0){
+        blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+    tableRemoveWhite(&vm.strings);
+
+    vm.sweepList = vm.objects;
+    vm.objects = NULL;
+    vm.gcPhase = GC_SWEEP;
+}
+
+// SWEEPING
+
+static void freeObject(Obj* object){
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+    switch(object->type){
+        case OBJ_BOUND_METHOD:
+            FREE(MEM_OBJECTS, ObjBoundMethod, object);
+            break;
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            freeTable(&klass->methods);
+            FREE(MEM_OBJECTS, ObjClass, object);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(MEM_STACKS, Value, fiber->stack, fiber->stackCapacity);
+            FREE_ARRAY(MEM_STACKS, CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE(MEM_OBJECTS, ObjFiber, object);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(&function->chunk);
+            FREE(MEM_OBJECTS, ObjFunction, object);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            if(instance->fields != instance->inlineFields){
+                FREE_ARRAY(MEM_FIELDS, Value, instance->fields, instance->capacity);
+            }
+            reallocate(MEM_OBJECTS, object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->transitions);
+            FREE(MEM_OBJECTS, ObjShape, object);
+            break;
+        }
+        case OBJ_NATIVE:
+            FREE(MEM_OBJECTS, ObjNative, object);
+            break;
+        case OBJ_STRING: {
+            //The characters are part of the same allocation.
+            ObjString* string = (ObjString*)object;
+            reallocate(MEM_STRINGS, object, sizeof(ObjString) + string->length + 1, 0);
+            break;
+        }
+        case OBJ_VECTOR:
+            reallocate(MEM_VECTORS, object, VECTOR_SIZE(((ObjVector*)object)->length), 0);
+            break;
+        case OBJ_ROPE:
+            FREE(MEM_STRINGS, ObjRope, object);
+            break;
+    }
+}
+
+// Objects allocated while we sweep go on to vm.objects and are never looked at here.
+// Survivors are whitened and moved back on to vm.objects for the next cycle.
+static bool sweepSome(uint64_t start){
+    size_t work = 0;
+    while(vm.sweepList != NULL){
+        if(work >= GC_MIN_SLICE_WORK && work % GC_CLOCK_INTERVAL == 0 &&
+           nowNs() - start >= vm.gcConfig.pauseBudgetNs) return false;
+
+        Obj* object = vm.sweepList;
+        vm.sweepList = object->next;
+        if(object->isMarked){
+            object->isMarked = false;
+            object->next = vm.objects;
+            vm.objects = object;
+        } else {
+            freeObject(object);
+            vm.gcStats.objectsFreed++;
+        }
+        work++;
+    }
+    return true;
+}
+
+// CYCLES
+
+static void startCycle(){
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin (%zu bytes)\n", vm.bytesAllocated);
+#endif
+    vm.gcPhase = GC_MARK;
+    vm.gcDebt = 0;
+    vm.gcCyclePauseNs = 0;
+    vm.gcCycleMaxPauseNs = 0;
+    vm.gcStats.heapBeforeLastCycle = vm.bytesAllocated;
+    markRoots();
+}
+
+static void finishCycle(){
+    vm.gcPhase = GC_IDLE;
+    vm.nextGC = vm.bytesAllocated / 100 * vm.gcConfig.heapGrowPercent;
+    if(vm.nextGC < vm.gcConfig.minHeapBytes) vm.nextGC = vm.gcConfig.minHeapBytes;
+
+    vm.gcStats.cycles++;
+    vm.gcStats.heapAfterLastCycle = vm.bytesAllocated;
+    vm.gcStats.lastCyclePauseNs = vm.gcCyclePauseNs;
+    vm.gcStats.lastMaxPauseNs = vm.gcCycleMaxPauseNs;
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end %zu -> %zu bytes, next at %zu\n",
+        vm.gcStats.heapBeforeLastCycle, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+// One bounded slice of work on the current cycle.
+static void gcSlice(){
+    uint64_t start = nowNs();
+
+    if(vm.gcPhase == GC_MARK){
+        traceSome(start);
+        if(vm.grayCount == 0) finishMark();
+    } else if(vm.gcPhase == GC_SWEEP){
+        if(sweepSome(start)) finishCycle();
+    }
+
+    uint64_t pause = nowNs() - start;
+    vm.gcStats.slices++;
+    vm.gcStats.totalPauseNs += pause;
+    vm.gcCyclePauseNs += pause;
+    if(pause > vm.gcCycleMaxPauseNs) vm.gcCycleMaxPauseNs = pause;
+    if(pause > vm.gcStats.maxPauseNs) vm.gcStats.maxPauseNs = pause;
+}
+
+// Called for every allocation that grows the heap. Between cycles we only watch the heap size.
+// During a cycle the work is paced by the allocation rate: the faster the program allocates,
+// the more often it pays for a slice, so marking finishes before the heap runs away from us.
+static void gcAllocationStep(size_t size){
+#ifdef DEBUG_STRESS_GC
+    //Run a whole cycle on every allocation to shake out missing roots.
+    collectGarbage();
+    return;
+#endif
+    if(vm.gcPhase == GC_IDLE){
+        if(vm.bytesAllocated <= vm.nextGC) return;
+        startCycle();
+        gcSlice();
+        return;
+    }
+
+    vm.gcDebt += size;
+    if(vm.gcDebt < vm.gcConfig.stepBytes) return;
+    vm.gcDebt = 0;
+    gcSlice();
+}
+
+void configureGC(GCConfig config){
+    vm.gcConfig = config;
+    if(vm.nextGC < config.minHeapBytes) vm.nextGC = config.minHeapBytes;
+}
+
+// Run a full cycle to completion, finishing the one in progress if there is one.
+void collectGarbage(){
+    if(vm.gcPhase == GC_IDLE) startCycle();
+    while(vm.gcPhase != GC_IDLE){
+        gcSlice();
+    }
+}
+
+const char* memSiteName(MemSite site){
+    return siteNames[site];
+}
+
+void printMemStats(){
+    MemStats* stats = &vm.memStats;
+    uint64_t allocations = 0, resizes = 0, copied = 0, total = 0;
+    for(int i = 0; i < MEM_SITE_COUNT; i++){
+        allocations += stats->sites[i].allocations;
+        resizes += stats->sites[i].resizes;
+        copied += stats->sites[i].bytesCopied;
+        total += stats->sites[i].bytesAllocated;
+    }
+    printf("== memory ==\n");
+    printf("live             %lld bytes, peak %lld\n", (long long) stats->liveBytes, (long long) stats->peakBytes);
+    printf("total            %llu bytes, %llu allocations, %llu resizes, %llu bytes copied moving blocks\n",
+        (unsigned long long) total, (unsigned long long) allocations,
+        (unsigned long long) resizes, (unsigned long long) copied);
+    printf("%-16s %12s %10s %10s %10s %14s %12s\n", "site", "live", "allocs", "resizes", "frees", "total", "copied");
+    for(int i = 0; i < MEM_SITE_COUNT; i++){
+        SiteStats* site = &stats->sites[i];
+        if(site->allocations == 0 && site->resizes == 0 && site->frees == 0) continue;
+        printf("%-16s %12lld %10llu %10llu %10llu %14llu %12llu\n", siteNames[i], (long long) site->liveBytes,
+            (unsigned long long) site->allocations, (unsigned long long) site->resizes,
+            (unsigned long long) site->frees, (unsigned long long) site->bytesAllocated,
+            (unsigned long long) site->bytesCopied);
+    }
+    printf("size classes    ");
+    size_t limit = 16;
+    for(int i = 0; i < MEM_SIZE_CLASSES; i++, limit *= 2){
+        if(stats->sizeClasses[i] == 0) continue;
+        if(i == MEM_SIZE_CLASSES - 1) printf(" >%zu:%llu", limit / 2, (unsigned long long) stats->sizeClasses[i]);
+        else printf(" <=%zu:%llu", limit, (unsigned long long) stats->sizeClasses[i]);
+    }
+    printf("\n");
+}
+
+void printGCStats(){
+    printf("gc cycles        %llu (%llu slices)\n",
+        (unsigned long long) vm.gcStats.cycles, (unsigned long long) vm.gcStats.slices);
+    printf("gc last cycle    %llu ns paused, longest slice %llu ns\n",
+        (unsigned long long) vm.gcStats.lastCyclePauseNs, (unsigned long long) vm.gcStats.lastMaxPauseNs);
+    printf("gc longest slice %llu ns, total %llu ns\n",
+        (unsigned long long) vm.gcStats.maxPauseNs, (unsigned long long) vm.gcStats.totalPauseNs);
+    printf("gc heap          %zu -> %zu bytes last cycle, %zu now, next at %zu\n",
+        vm.gcStats.heapBeforeLastCycle, vm.gcStats.heapAfterLastCycle, vm.bytesAllocated, vm.nextGC);
+    printf("gc objects freed %zu\n", vm.gcStats.objectsFreed);
+}
+
+// Walk the VM's list of every object and free them all.
+void freeObjects(){
+    //A cycle may have been part way through its sweep.
+    Obj* lists[] = { vm.objects, vm.sweepList };
+    for(int i = 0; i < 2; i++){
+        Obj* object = lists[i];
+        while(object != NULL){
+            Obj* next = object->next;
+            freeObject(object);
+            object = next;
+        }
+    }
+    vm.objects = NULL;
+    vm.sweepList = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.grayCount = 0;
+
+    free(vm.grayStack);
+    vm.grayStack = NULL;
+    vm.grayCapacity = 0;
+}
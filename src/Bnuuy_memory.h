@@ -2,16 +2,108 @@
 #define Bnuuy_memory_h
 
 #include "Bnuuy_common.h"
+#include "Bnuuy_object.h"
 
-//If 
+//Allocate a single object, or an array of count objects. site is the MemSite it counts towards.
+#define ALLOCATE(site, type, count)                     (type*) reallocate(site, NULL, 0, sizeof(type) * (count))
+
+#define FREE(site, type, pointer)                       reallocate(site, pointer, sizeof(type), 0)
+
+//If
 //  <8, := 8
-//  x   := 2x 
+//  x   := 2x
 #define GROW_CAPACITY(capacity)                         ((capacity)) < 8 ? 8 : (capacity) * 2
 
 //
-#define GROW_ARRAY(type, pointer, oldCount, newCount)   (type*) reallocate (pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+#define GROW_ARRAY(site, type, pointer, oldCount, newCount)   (type*) reallocate (site, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+#define FREE_ARRAY(site, type, pointer, oldCount)       reallocate (site, pointer, sizeof(type)* (oldCount), 0)
+
+// MEMORY STATS
+// reallocate() and the code block allocator count everything they do, by MemSite and by size.
+// A request is counted in the size class of the power of two at or above it, from 16 bytes up,
+// and the last class takes everything bigger.
+#define MEM_SIZE_CLASSES 14
+
+typedef struct {
+    uint64_t allocations;   // New blocks.
+    uint64_t resizes;       // Blocks grown or shrunk.
+    uint64_t frees;
+    uint64_t bytesAllocated;// Every byte ever asked for, counting only the growth of a resize.
+    uint64_t bytesCopied;   // Moved by realloc() because a block could not be resized where it was.
+    int64_t liveBytes;      // Signed, a worker can free memory the VM's thread allocated.
+} SiteStats;
+
+typedef struct {
+    SiteStats sites[MEM_SITE_COUNT];
+    uint64_t sizeClasses[MEM_SIZE_CLASSES];     // Allocations and resizes, by the size asked for.
+    int64_t liveBytes;
+    int64_t peakBytes;      // Only kept up to date on the VM's own thread.
+} MemStats;
+
+// GARBAGE COLLECTOR
+// Incremental mark and sweep. A cycle is started once the heap grows past nextGC, and from
+// then on every gcStepBytes of new allocation buys a slice of collector work. A slice stops
+// once it has used up its pause budget, so no single allocation waits on the whole heap.
+typedef enum {
+    GC_IDLE,                // No cycle running.
+    GC_MARK,                // Tracing from the roots, objects are grey until blackened.
+    GC_SWEEP,               // Freeing whatever was left white.
+} GCPhase;
+
+typedef struct {
+    uint64_t pauseBudgetNs; // A slice stops once it has run this long (after doing a minimum of work).
+    size_t stepBytes;       // Allocate this many bytes during a cycle and the collector gets a slice.
+    int heapGrowPercent;    // The next cycle starts when the heap reaches this % of what survived.
+    size_t minHeapBytes;    // Never start a cycle below this.
+} GCConfig;
+
+typedef struct {
+    uint64_t cycles;        // Completed cycles.
+    uint64_t slices;        // Slices across all cycles.
+    uint64_t lastCyclePauseNs;  // Sum of the slices in the last completed cycle.
+    uint64_t lastMaxPauseNs;    // Longest slice in the last completed cycle.
+    uint64_t maxPauseNs;        // Longest slice ever.
+    uint64_t totalPauseNs;
+    size_t heapBeforeLastCycle; // Heap size when the last cycle started.
+    size_t heapAfterLastCycle;  // Heap size when the last cycle finished.
+    size_t objectsFreed;
+} GCStats;
+
+// LOCAL HEAPS
+// A compile worker thread allocates into one of these instead of the VM's heap. The collector never runs
+// while workers are busy, so nothing needs protecting from it. Once they are done the objects and bytes
+// are handed over to the VM with adoptLocalHeap().
+typedef struct {
+    Obj* objects;
+    size_t bytesAllocated;
+    MemStats memStats;      // Added to the VM's when it adopts the heap.
+} LocalHeap;
+
+extern _Thread_local LocalHeap* localHeap;     // NULL on the VM's own thread.
+
+void* reallocate (MemSite site, void* pointer, size_t oldSize, size_t newSize);
+void initLocalHeap(LocalHeap* heap);
+void adoptLocalHeap(LocalHeap* heap);
+const char* memSiteName(MemSite site);
+void printMemStats();
 
-#define FREE_ARRAY(type, pointer, oldCount)             reallocate (pointer, sizeof(type)* (oldCount), 0)
+// FINISHED CODE
+// Bytecode that will not change again is copied into a block of its own that starts on a cache line,
+// so the hot loop of a function never straddles a line it shares with some other allocation.
+// With READ_ONLY_CODE the block is page aligned instead and can be locked once written.
+#define CODE_ALIGNMENT 64
 
-void* reallocate (void* pointer, size_t oldSize, size_t newSize);
-#endif
\ No newline at end of file
+size_t codeBlockSize(size_t size);              // How many bytes allocateCode() really takes for size.
+void* allocateCode(size_t size);
+void  freeCode(void* pointer, size_t size);
+void  protectCode(void* pointer, size_t size);  // Make the block read-only, a no-op without READ_ONLY_CODE.
+void markObject(Obj* object);
+void markValue(Value value);
+void gcWriteBarrier(Obj* holder, Value value);
+void gcRescan(Obj* object);
+void configureGC(GCConfig config);
+void collectGarbage();
+void printGCStats();
+void freeObjects();
+#endif
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_table.h"
+#include "Bnuuy_value.h"
+#include "vm.h"
+
+// FNV-1a, 32 bit.
+#define FNV_OFFSET_BASIS    2166136261u
+#define FNV_PRIME           16777619u
+
+#define ALLOCATE_OBJ(type, size, objectType) (type*) allocateObject(size, objectType)
+
+static Obj* allocateObject(size_t size, ObjType type){
+    MemSite site = type == OBJ_STRING || type == OBJ_ROPE ? MEM_STRINGS : type == OBJ_VECTOR ? MEM_VECTORS : MEM_OBJECTS;
+    Obj* object = (Obj*) reallocate(site, NULL, 0, size);
+    object->type = type;
+    //Objects born while we are marking are black, the collector has already finished with them this cycle.
+    //So the constructors below barrier every reference they store, see gcWriteBarrier().
+    object->isMarked = vm.gcPhase == GC_MARK;
+
+    //Push it on the front of the VM's object list, or the worker's while compiling in parallel.
+    if(localHeap != NULL){
+        object->next = localHeap->objects;
+        localHeap->objects = object;
+        return object;
+    }
+    object->next = vm.objects;
+    vm.objects = object;
+    return object;
+}
+
+ObjBoundMethod* newBoundMethod(Value receiver, ObjFunction* method){
+    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    //Born black while marking, so nothing else would mark what it holds.
+    gcWriteBarrier((Obj*)bound, receiver);
+    gcWriteBarrier((Obj*)bound, OBJ_VAL(method));
+    return bound;
+}
+
+static ObjShape* newShape(ObjShape* parent, ObjString* name){
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, sizeof(ObjShape), OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(parent));
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(name));
+    return shape;
+}
+
+ObjClass* newClass(ObjString* name){
+    ObjClass* klass = ALLOCATE_OBJ(ObjClass, sizeof(ObjClass), OBJ_CLASS);
+    klass->name = name;
+    klass->rootShape = NULL;
+    klass->fieldHint = 0;
+    initTable(&klass->methods);
+    gcWriteBarrier((Obj*)klass, OBJ_VAL(name));
+
+    //The class is not reachable from anywhere yet.
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    gcWriteBarrier((Obj*)klass, OBJ_VAL(klass->rootShape));
+    pop();
+    return klass;
+}
+
+// An empty fiber, the VM fills in its stack and frames. See spawnFiber().
+ObjFiber* newFiber(){
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, sizeof(ObjFiber), OBJ_FIBER);
+    fiber->state = FIBER_READY;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->result = NIL_VAL;
+    fiber->nextReady = NULL;
+    return fiber;
+}
+
+ObjFunction* newFunction(){
+    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, sizeof(ObjFunction), OBJ_FUNCTION);
+    function->arity = 0;
+    function->verified = false;
+    function->maxStack = 0;
+    function->name = NULL;
+    function->source = NULL;
+    function->sourceLine = 0;
+    function->profileCount = 0;
+    startChunk(&function->chunk);
+    return function;
+}
+
+ObjNative* newNative(NativeFn function){
+    ObjNative* native = ALLOCATE_OBJ(ObjNative, sizeof(ObjNative), OBJ_NATIVE);
+    native->function = function;
+    return native;
+}
+
+// New instances get as much inline room as other instances of their class ended up needing.
+ObjInstance* newInstance(ObjClass* klass){
+    int inlineCapacity = klass->fieldHint;
+    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance,
+        sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
+    instance->klass = klass;
+    instance->shape = klass->rootShape;
+    instance->capacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    instance->fields = instance->inlineFields;
+    gcWriteBarrier((Obj*)instance, OBJ_VAL(klass));
+    gcWriteBarrier((Obj*)instance, OBJ_VAL(klass->rootShape));
+    return instance;
+}
+
+/// @brief The shape we get by adding the field name to shape. Made on first use and shared afterwards.
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name){
+    Value child;
+    if(tableGet(&shape->transitions, name, &child)) return (ObjShape*)AS_OBJ(child);
+
+    ObjShape* next = newShape(shape, name);
+    push(OBJ_VAL(next));
+    tableSet(&shape->transitions, name, OBJ_VAL(next));
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(next));
+    gcWriteBarrier((Obj*)shape, OBJ_VAL(name));
+    pop();
+    return next;
+}
+
+/// @brief Where the field name lives in instances of this shape.
+/// @return The offset into the fields array, or -1 if the shape has no such field.
+int shapeFieldOffset(ObjShape* shape, ObjString* name){
+    //Names are interned, so this is a pointer walk up the transition chain.
+    for(; shape->parent != NULL; shape = shape->parent){
+        if(shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+// Move the instance to shape, which is its current shape plus one field, and store that field.
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value){
+    int offset = shape->fieldCount - 1;
+    if(offset >= instance->capacity){
+        int oldCapacity = instance->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if(instance->fields == instance->inlineFields){
+            //Outgrew the inline room, move everything out to its own array.
+            Value* fields = ALLOCATE(MEM_FIELDS, Value, capacity);
+            for(int i = 0; i < instance->shape->fieldCount; i++) fields[i] = instance->fields[i];
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(MEM_FIELDS, Value, instance->fields, oldCapacity, capacity);
+        }
+        instance->capacity = capacity;
+    }
+    if(shape->fieldCount > instance->klass->fieldHint) instance->klass->fieldHint = shape->fieldCount;
+
+    instance->fields[offset] = value;
+    instance->shape = shape;
+    gcWriteBarrier((Obj*)instance, value);
+    gcWriteBarrier((Obj*)instance, OBJ_VAL(shape));
+}
+
+// The hash is a running value so a string can be hashed in pieces (see concatenateStrings).
+static uint32_t hashBytes(uint32_t hash, const char* key, int length){
+    for(int i = 0; i < length; i++){
+        hash ^= (uint8_t) key[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Make a new string with room for length characters and register it in the intern table.
+// The caller fills in the characters before anything else can look at it.
+static ObjString* allocateString(int length, uint32_t hash){
+    ObjString* string = ALLOCATE_OBJ(ObjString, sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->hash = hash;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Growing the table can set off a collection, keep the new string on the stack until it is in.
+static void internString(ObjString* string){
+    //Workers never collect, and the VM stack is not theirs to touch.
+    if(localHeap == NULL) push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    if(localHeap == NULL) pop();
+}
+
+ObjString* copyString(const char* chars, int length){
+    uint32_t hash = hashBytes(FNV_OFFSET_BASIS, chars, length);
+
+    //Compile workers share the table, the lookup and the insert have to happen as one.
+    LOCK_SHARED();
+    vm.internLookups++;
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if(interned != NULL){
+        vm.internHits++;
+        UNLOCK_SHARED();
+        return interned;
+    }
+
+    ObjString* string = allocateString(length, hash);
+    memcpy(string->chars, chars, length);
+    internString(string);
+    UNLOCK_SHARED();
+    return string;
+}
+
+// a + b. We hash the two halves in place and check the intern table first,
+// so building a string that already exists costs no allocation and no copy.
+// Otherwise the result is allocated once at its final size.
+ObjString* concatenateStrings(ObjString* a, ObjString* b){
+    uint32_t hash = hashBytes(hashBytes(FNV_OFFSET_BASIS, a->chars, a->length), b->chars, b->length);
+
+    LOCK_SHARED();
+    vm.internLookups++;
+    ObjString* interned = tableFindConcatenated(&vm.strings, a, b, hash);
+    if(interned != NULL){
+        vm.internHits++;
+        UNLOCK_SHARED();
+        return interned;
+    }
+
+    ObjString* string = allocateString(a->length + b->length, hash);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    internString(string);
+    UNLOCK_SHARED();
+    return string;
+}
+
+// A flattened rope stands in for its string, so nothing new ever points at a rope that has let go of its halves.
+static Obj* ropePiece(Obj* piece){
+    if(piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat != NULL) return (Obj*)((ObjRope*)piece)->flat;
+    return piece;
+}
+
+static int pieceLength(Obj* piece){
+    return piece->type == OBJ_ROPE ? ((ObjRope*)piece)->length : ((ObjString*)piece)->length;
+}
+
+static int pieceDepth(Obj* piece){
+    return piece->type == OBJ_ROPE ? ((ObjRope*)piece)->depth : 0;
+}
+
+ObjRope* newRope(Obj* left, Obj* right){
+    left = ropePiece(left);
+    right = ropePiece(right);
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, sizeof(ObjRope), OBJ_ROPE);
+    rope->length = pieceLength(left) + pieceLength(right);
+    rope->depth = 1 + (pieceDepth(left) > pieceDepth(right) ? pieceDepth(left) : pieceDepth(right));
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    //Born black while marking, so the collector will not trace it. The halves have to be marked now.
+    gcWriteBarrier((Obj*)rope, OBJ_VAL(left));
+    gcWriteBarrier((Obj*)rope, OBJ_VAL(right));
+    return rope;
+}
+
+// Right to left, with the left halves still to do on a stack. Only one of those is waiting at each level
+// of the path we are on, so depth + 1 slots are enough. A loop adding on the end builds a rope that leans
+// left, and then the stack never holds more than two.
+void copyRopeChars(ObjRope* rope, char* out){
+    if(rope->flat != NULL){
+        memcpy(out, rope->flat->chars, rope->length);
+        return;
+    }
+    Obj** pending = malloc(sizeof(Obj*) * (rope->depth + 1));
+    if(pending == NULL) exit(1);
+    int count = 0;
+    int end = rope->length;
+    pending[count++] = (Obj*)rope;
+    while(count > 0){
+        Obj* piece = ropePiece(pending[--count]);
+        if(piece->type == OBJ_ROPE){
+            pending[count++] = ((ObjRope*)piece)->left;
+            pending[count++] = ((ObjRope*)piece)->right;
+            continue;
+        }
+        ObjString* string = (ObjString*)piece;
+        end -= string->length;
+        memcpy(out + end, string->chars, string->length);
+    }
+    free(pending);
+}
+
+// The characters go straight into the new string. If the intern table already has them, that string is
+// used instead and the new one is left for the collector.
+ObjString* flattenRope(ObjRope* rope){
+    if(rope->flat != NULL) return rope->flat;
+    ObjString* string = allocateString(rope->length, 0);
+    copyRopeChars(rope, string->chars);
+    string->hash = hashBytes(FNV_OFFSET_BASIS, string->chars, string->length);
+
+    LOCK_SHARED();
+    vm.internLookups++;
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+    if(interned != NULL){
+        vm.internHits++;
+        string = interned;
+    } else {
+        internString(string);
+    }
+    UNLOCK_SHARED();
+
+    //Parallel for workers can see the main heap's ropes but must not change them.
+    if(localHeap == NULL){
+        rope->flat = string;
+        rope->left = NULL;
+        rope->right = NULL;
+        gcWriteBarrier((Obj*)rope, OBJ_VAL(string));
+    }
+    return string;
+}
+
+ObjVector* newVector(int length){
+    ObjVector* vector = ALLOCATE_OBJ(ObjVector, VECTOR_SIZE(length), OBJ_VECTOR);
+    uintptr_t storage = (uintptr_t)(vector + 1);
+    vector->length = length;
+    vector->elements = (double*)((storage + VECTOR_ALIGN - 1) & ~(uintptr_t)(VECTOR_ALIGN - 1));
+    return vector;
+}
+
+static void printFunction(FILE* stream, ObjFunction* function){
+    if(function->name == NULL){
+        fprintf(stream, "<script>");
+        return;
+    }
+    fprintf(stream, "<fn %s>", function->name->chars);
+}
+
+void printObject(FILE* stream, Value value){
+    switch(OBJ_TYPE(value)){
+        case OBJ_BOUND_METHOD:
+            printFunction(stream, AS_BOUND_METHOD(value)->method);
+            break;
+        case OBJ_CLASS:
+            fprintf(stream, "%s", AS_CLASS(value)->name->chars);
+            break;
+        case OBJ_FIBER:
+            fprintf(stream, "<fiber>");
+            break;
+        case OBJ_FUNCTION:
+            printFunction(stream, AS_FUNCTION(value));
+            break;
+        case OBJ_INSTANCE:
+            fprintf(stream, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+            break;
+        case OBJ_SHAPE:
+            fprintf(stream, "<shape %d>", ((ObjShape*)AS_OBJ(value))->fieldCount);
+            break;
+        case OBJ_NATIVE:
+            fprintf(stream, "<native fn>");
+            break;
+        case OBJ_ROPE: {
+            //Printing needs the characters but not an interned string, so the rope is left as it is.
+            ObjRope* rope = AS_ROPE(value);
+            if(rope->flat != NULL){
+                fprintf(stream, "%s", rope->flat->chars);
+                break;
+            }
+            char* chars = malloc(rope->length);
+            if(chars == NULL) exit(1);
+            copyRopeChars(rope, chars);
+            fwrite(chars, 1, rope->length, stream);
+            free(chars);
+            break;
+        }
+        case OBJ_STRING:
+            fprintf(stream, "%s", AS_CSTRING(value));
+            break;
+        case OBJ_VECTOR: {
+            ObjVector* vector = AS_VECTOR(value);
+            fprintf(stream, "[");
+            for(int i = 0; i < vector->length; i++){
+                if(i > 0) fprintf(stream, ", ");
+                fprintValue(stream, NUMBER_VAL(vector->elements[i]));
+            }
+            fprintf(stream, "]");
+            break;
+        }
+    }
+}
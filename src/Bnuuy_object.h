@@ -0,0 +1,216 @@
+#ifndef bnuuy_object_h
+#define bnuuy_object_h
+
+#include <stdatomic.h>
+
+#include "Bnuuy_common.h"
+#include "Bnuuy_chunk.h"
+#include "Bnuuy_table.h"
+#include "Bnuuy_value.h"
+#include "Bnuuy_vector.h"
+
+#define OBJ_TYPE(value)         (AS_OBJ(value)->type)
+
+//Type checks
+#define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
+#define IS_FIBER(value)         isObjType(value, OBJ_FIBER)
+#define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
+#define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
+#define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_VECTOR(value)        isObjType(value, OBJ_VECTOR)
+// Either kind of string, ropes are strings to a script.
+#define IS_TEXT(value)          (IS_STRING(value) || IS_ROPE(value))
+
+//Default recasts/casts
+#define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CLASS(value)         ((ObjClass*)AS_OBJ(value))
+#define AS_FIBER(value)         ((ObjFiber*)AS_OBJ(value))
+#define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
+#define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJ(value))
+#define AS_NATIVE(value)        (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+#define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
+#define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_VECTOR(value)        ((ObjVector*)AS_OBJ(value))
+
+typedef enum {
+    OBJ_BOUND_METHOD,
+    OBJ_CLASS,
+    OBJ_FIBER,
+    OBJ_FUNCTION,
+    OBJ_INSTANCE,
+    OBJ_NATIVE,
+    OBJ_SHAPE,
+    OBJ_STRING,
+    OBJ_VECTOR,
+    OBJ_ROPE,               // Last so the numbers of the others, which images store, stay the same.
+} ObjType;
+
+// Every heap object starts with this header so a pointer to any object can be treated as an Obj*.
+struct Obj {
+    ObjType type;
+    bool isMarked;          // Reached by the garbage collector this cycle.
+    struct Obj* next;       // Intrusive list of every object the VM owns, so nothing leaks at freeVM().
+};
+
+// Strings are immutable and interned. The characters live in the same allocation as the header
+// so reading a string never chases a second pointer.
+struct ObjString {
+    Obj obj;
+    int length;
+    uint32_t hash;          // Computed once when the string is created.
+    char chars[];           // length + 1 bytes, always null terminated.
+};
+
+// ROPES
+// + on long strings doesn't copy them. It makes a rope, a node that just points at the two halves, so
+// building a string in a loop costs a node per step rather than a copy of everything so far.
+// The characters are put together once, when something needs the string itself: comparing it, hashing
+// it or handing it to C. flattenRope() makes the interned ObjString, keeps it and lets go of the halves.
+// Printing and len() don't need to flatten. Short results are still made as plain strings.
+#define ROPE_MIN_LENGTH 64
+
+typedef struct {
+    Obj obj;
+    int length;
+    int depth;              // Nodes on the longest path down to a string, which bounds the walk in flattenRope().
+    Obj* left;              // Strings or ropes, both NULL once flattened.
+    Obj* right;
+    ObjString* flat;        // NULL until flattened.
+} ObjRope;
+
+// Vectors are a fixed run of doubles, made by [a, b, c] literals and vector(). Arithmetic on them works
+// element by element and always makes a new vector, so like strings they can be shared freely.
+// The elements are in the same allocation as the header, moved up to a VECTOR_ALIGN boundary for the
+// kernels in Bnuuy_vector.h.
+typedef struct {
+    Obj obj;
+    int length;
+    double* elements;
+} ObjVector;
+
+#define VECTOR_SIZE(length) (sizeof(ObjVector) + VECTOR_ALIGN + sizeof(double) * (size_t)(length))
+
+// A compiled function. Top level code is a function too, with no name.
+// In lazy mode a function starts out as just its source, and is compiled the first time it is called.
+// Parallel for workers can make that call at the same time, so verified is what they check.
+typedef struct {
+    Obj obj;
+    int arity;
+    atomic_bool verified;   // Passed the verifier, see Bnuuy_verifier.h. Only verified functions are run.
+    int maxStack;           // Stack slots the frame can use, worked out by the verifier.
+    Chunk chunk;
+    ObjString* name;
+    ObjString* source;      // Lazy functions only. The parameter list and body, from '(' to the closing '}'.
+    int sourceLine;         // The line source starts on.
+    _Atomic uint64_t profileCount;  // Instructions run in this function while profiling, see printProfile().
+} ObjFunction;
+
+// Functions implemented in C. args points at the arguments where they sit on the stack.
+typedef Value (*NativeFn)(int argCount, Value* args);
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+} ObjNative;
+
+// SHAPES (hidden classes)
+// Instances do not carry a table of field names. Instead every instance points at a shape that
+// says which fields it has and in which order, and the values sit in a plain array in that order.
+// Adding a field moves the instance to a child shape, and instances that gain the same fields
+// in the same order end up sharing a shape. Each class has its own root shape, so a shape also
+// pins down the class, and so the methods, of an instance.
+struct ObjShape {
+    Obj obj;
+    ObjShape* parent;       // NULL for a class's root shape.
+    ObjString* name;        // The field this shape added to its parent.
+    int fieldCount;         // The new field lives at offset fieldCount - 1.
+    Table transitions;      // Field name -> child shape.
+};
+
+typedef struct {
+    Obj obj;
+    ObjString* name;
+    Table methods;
+    ObjShape* rootShape;    // The shape of a brand new instance.
+    int fieldHint;          // Most fields we have seen an instance of this class grow to.
+} ObjClass;
+
+// Fields live in the instance's own allocation while they fit (inlineFields),
+// and only move out to a separate array if an instance outgrows what its class usually needs.
+typedef struct {
+    Obj obj;
+    ObjClass* klass;
+    ObjShape* shape;
+    int capacity;           // Room in fields.
+    int inlineCapacity;     // Room in inlineFields.
+    Value* fields;          // Either inlineFields or a separately allocated array.
+    Value inlineFields[];
+} ObjInstance;
+
+// One function call in progress. Its locals are a window onto the fiber's stack starting at slots,
+// slot zero is the function itself and the arguments follow it.
+typedef struct {
+    ObjFunction* function;
+    uint8_t* ip;            //Instruction pointer into function->chunk, saved while we call something else
+    Value* slots;
+} CallFrame;
+
+// FIBERS
+// A script running on its own stack and frames, which can be put down at a yield and picked up again
+// later. The VM works on one fiber at a time and the scheduler in vm.c takes turns between the ready ones.
+// Stacks start small and grow at calls, the verifier tells us how much a function can use.
+typedef enum {
+    FIBER_READY,            // Waiting for its turn, either new or suspended.
+    FIBER_RUNNING,
+    FIBER_DONE,             // Returned from its function, the value is in result.
+    FIBER_FAILED,           // Stopped by a runtime error.
+} FiberState;
+
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    Value* stack;
+    Value* stackTop;        // Only up to date while the fiber is not the one running.
+    int stackCapacity;
+    CallFrame* frames;
+    int frameCount;         // Same.
+    int frameCapacity;
+    Value result;
+    struct ObjFiber* nextReady;     // Run queue link.
+} ObjFiber;
+
+// A method pulled off an instance, remembers the receiver for when it is called.
+typedef struct {
+    Obj obj;
+    Value receiver;
+    ObjFunction* method;
+} ObjBoundMethod;
+
+ObjBoundMethod* newBoundMethod(Value receiver, ObjFunction* method);
+ObjClass* newClass(ObjString* name);
+ObjFiber* newFiber();
+ObjFunction* newFunction();
+ObjInstance* newInstance(ObjClass* klass);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+int shapeFieldOffset(ObjShape* shape, ObjString* name);
+void instanceAddField(ObjInstance* instance, ObjShape* shape, Value value);
+ObjNative* newNative(NativeFn function);
+ObjString* copyString(const char* chars, int length);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+ObjRope* newRope(Obj* left, Obj* right);       // Both are strings or ropes.
+// The rope has to be reachable while this runs, it allocates.
+ObjString* flattenRope(ObjRope* rope);
+// Fill out with the rope's length characters, without flattening it or allocating on the heap.
+void copyRopeChars(ObjRope* rope, char* out);
+ObjVector* newVector(int length);       // The elements are left for the caller to fill in.
+void printObject(FILE* stream, Value value);
+
+static inline bool isObjType(Value value, ObjType type){
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_optimizer.h"
+#include "Bnuuy_verifier.h"
+#include "vm.h"
+
+// The passes work on the code decoded into one of these per instruction, so they can drop and rewrite
+// instructions without shuffling bytes about. Jumps point at the instruction they land on rather than
+// an offset, and get their offsets back when the code is written out again.
+typedef struct {
+    uint8_t bytes[4];       // Opcode and operands.
+    int length;
+    int line;               // Source line, kept so errors still point at the right place.
+    int target;             // Index of the instruction a jump lands on, -1 for everything else.
+    bool removed;
+    bool isTarget;          // A live jump lands here, so control can arrive from somewhere other than just above.
+} Instruction;
+
+typedef struct {
+    Chunk* chunk;
+    Instruction* code;
+    int count;
+} Program;
+
+typedef struct {
+    int removed;            // Instructions dropped.
+    int rewritten;          // Instructions replaced by cheaper ones.
+} PassStats;
+
+typedef void (*PassFn)(Program* program, PassStats* stats);
+
+static int enabledPasses = PASSES_ALL;   // Set before compiling starts, workers only read it.
+static const char* passNames[PASS_COUNT] = { "negate", "identity", "strength", "dead" };
+// Totals across every function optimized so far. Compile workers add to them under the shared lock.
+static uint64_t instructionsSeen = 0;
+static uint64_t removedTotal[PASS_COUNT];
+static uint64_t rewrittenTotal[PASS_COUNT];
+
+void setOptimizerPasses(int passes){
+    enabledPasses = passes;
+}
+
+bool parseOptimizerPasses(const char* list, int* passes){
+    if(strcmp(list, "all") == 0){
+        *passes = PASSES_ALL;
+        return true;
+    }
+    *passes = 0;
+    if(strcmp(list, "none") == 0) return true;
+    while(*list != '\0'){
+        int length = (int) strcspn(list, ",");
+        int pass = 0;
+        while(pass < PASS_COUNT && !(strncmp(list, passNames[pass], length) == 0 && passNames[pass][length] == '\0')) pass++;
+        if(pass == PASS_COUNT) return false;
+        *passes |= 1 << pass;
+        list += length;
+        if(*list == ',') list++;
+    }
+    return true;
+}
+
+// DECODING
+
+static bool isJump(uint8_t instruction){
+    return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP;
+}
+
+/// @brief Split the chunk into instructions and resolve where every jump lands.
+/// @return false if the code is not something the compiler would have made, in which case it is left alone.
+static bool decode(Chunk* chunk, Program* program){
+    int* indexAt = ALLOCATE(MEM_COMPILER, int, chunk->count);     // Instruction starting at each offset, -1 mid instruction.
+    program->chunk = chunk;
+    program->code = ALLOCATE(MEM_COMPILER, Instruction, chunk->count);
+    program->count = 0;
+    bool ok = true;
+
+    for(int offset = 0; offset < chunk->count; offset++) indexAt[offset] = -1;
+    int offset = 0;
+    while(ok && offset < chunk->count){
+        int length = instructionLength(chunk->code[offset]);
+        if(chunk->code[offset] >= OP_COUNT || offset + length > chunk->count){
+            ok = false;
+            break;
+        }
+        Instruction* instruction = &program->code[program->count];
+        //Zeroed first, so reading an operand a short instruction doesn't have gives 0 and not garbage.
+        memset(instruction->bytes, 0, sizeof(instruction->bytes));
+        memcpy(instruction->bytes, chunk->code + offset, length);
+        instruction->length = length;
+        instruction->line = getLine(chunk, offset);
+        instruction->target = -1;
+        instruction->removed = false;
+        instruction->isTarget = false;
+        indexAt[offset] = program->count++;
+        offset += length;
+    }
+
+    //Now every instruction has an index, turn the jump offsets into them.
+    offset = 0;
+    for(int i = 0; ok && i < program->count; offset += program->code[i].length, i++){
+        Instruction* instruction = &program->code[i];
+        if(!isJump(instruction->bytes[0])) continue;
+        int jump = (instruction->bytes[1] << 8) | instruction->bytes[2];
+        int target = instruction->bytes[0] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+        if(target < 0 || target >= chunk->count || indexAt[target] == -1){
+            ok = false;
+            break;
+        }
+        instruction->target = indexAt[target];
+    }
+
+    FREE_ARRAY(MEM_COMPILER, int, indexAt, chunk->count);
+    if(!ok) FREE_ARRAY(MEM_COMPILER, Instruction, program->code, chunk->count);
+    return ok;
+}
+
+static int nextLive(Program* program, int i){
+    for(i++; i < program->count && program->code[i].removed; i++);
+    return i;
+}
+
+static int previousLive(Program* program, int i){
+    for(i--; i >= 0 && program->code[i].removed; i--);
+    return i;
+}
+
+// Mark where the live jumps land. A jump whose instruction was dropped lands on the next one that is left.
+static void findTargets(Program* program){
+    for(int i = 0; i < program->count; i++){
+        program->code[i].isTarget = false;
+    }
+    for(int i = 0; i < program->count; i++){
+        Instruction* instruction = &program->code[i];
+        if(instruction->removed || instruction->target == -1) continue;
+        if(program->code[instruction->target].removed){
+            instruction->target = nextLive(program, instruction->target);
+        }
+        program->code[instruction->target].isTarget = true;
+    }
+}
+
+// WHAT WE KNOW ABOUT VALUES
+
+static Value constantOf(Program* program, Instruction* instruction){
+    return program->chunk->constants.values[instruction->bytes[1]];
+}
+
+static bool isIntConstant(Program* program, Instruction* instruction, int64_t value){
+    if(instruction->bytes[0] != OP_CONSTANT) return false;
+    Value constant = constantOf(program, instruction);
+    return IS_INT(constant) && AS_INT(constant) == value;
+}
+
+// The value the instruction leaves on top of the stack is a number whenever execution gets past it.
+// Or a vector, for the operators. Every rewrite below works element by element just the same.
+static bool pushesNumber(Program* program, Instruction* instruction){
+    switch(instruction->bytes[0]){
+        case OP_CONSTANT:   return IS_NUMERIC(constantOf(program, instruction));
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:     return true;
+        default:            return false;   //Not OP_ADD, strings add too.
+    }
+}
+
+/// @brief For the pattern <number> CONSTANT op, where the constant is at i.
+/// @return The index of op, or -1 if the stack under the constant is not known to hold a number, or control
+/// can get to the constant or op other than straight down from the instruction before.
+static int numberOperation(Program* program, int i, uint8_t op){
+    Instruction* constant = &program->code[i];
+    if(constant->removed || constant->bytes[0] != OP_CONSTANT || constant->isTarget) return -1;
+    int next = nextLive(program, i);
+    int previous = previousLive(program, i);
+    if(next == program->count || previous < 0) return -1;
+    if(program->code[next].bytes[0] != op || program->code[next].isTarget) return -1;
+    if(!pushesNumber(program, &program->code[previous])) return -1;
+    return next;
+}
+
+// The index of a constant holding exactly value, adding it if need be. -1 if the chunk has no room left.
+static int numberConstant(Program* program, Value value){
+    ValueArray* constants = &program->chunk->constants;
+    for(int i = 0; i < constants->count; i++){
+        Value constant = constants->values[i];
+        if(IS_INT(value) && IS_INT(constant) && AS_INT(constant) == AS_INT(value)) return i;
+        //Compare the bits, 0.0 and -0.0 are equal but print differently.
+        if(IS_NUMBER(value) && IS_NUMBER(constant)){
+            double a = AS_NUMBER(constant);
+            double b = AS_NUMBER(value);
+            if(memcmp(&a, &b, sizeof(double)) == 0) return i;
+        }
+    }
+    if(constants->count >= UINT8_COUNT) return -1;
+    return addConstant(program->chunk, value);
+}
+
+// PASSES
+
+// CONSTANT NEGATE -> CONSTANT, with the constant negated just as OP_NEGATE would have.
+static void foldNegation(Program* program, PassStats* stats){
+    for(int i = 0; i < program->count; i++){
+        Instruction* constant = &program->code[i];
+        if(constant->removed || constant->bytes[0] != OP_CONSTANT) continue;
+        //Keep going while there are more negations to fold into the same constant.
+        for(;;){
+            int next = nextLive(program, i);
+            if(next == program->count) break;
+            Instruction* negate = &program->code[next];
+            if(negate->bytes[0] != OP_NEGATE || negate->isTarget) break;
+            Value value = constantOf(program, constant);
+            if(!IS_NUMERIC(value)) break;
+
+            Value negated;
+            if(IS_INT(value)){
+                int64_t integer = AS_INT(value);
+                negated = integer == INT64_MIN ? NUMBER_VAL(-(double) integer) : INT_VAL(-integer);
+            } else {
+                negated = NUMBER_VAL(-AS_NUMBER(value));
+            }
+            int index = numberConstant(program, negated);
+            if(index == -1) break;
+            constant->bytes[1] = (uint8_t) index;
+            negate->removed = true;
+            stats->removed++;
+        }
+    }
+}
+
+static void foldIdentities(Program* program, PassStats* stats){
+    for(int i = 0; i < program->count; i++){
+        Instruction* constant = &program->code[i];
+        int op = -1;
+        if(isIntConstant(program, constant, 1)){
+            op = numberOperation(program, i, OP_MULTIPLY);
+            if(op == -1) op = numberOperation(program, i, OP_DIVIDE);
+        } else if(isIntConstant(program, constant, 0)){
+            op = numberOperation(program, i, OP_SUBTRACT);
+            //-0.0 + 0 is 0.0, so adding zero only leaves integers alone. The only push we know
+            //makes an integer is an integer constant, the operators can all make -0.0.
+            if(op == -1 && (op = numberOperation(program, i, OP_ADD)) != -1){
+                Instruction* previous = &program->code[previousLive(program, i)];
+                if(previous->bytes[0] != OP_CONSTANT || !IS_INT(constantOf(program, previous))) op = -1;
+            }
+        }
+        if(op == -1) continue;
+        constant->removed = true;
+        program->code[op].removed = true;
+        stats->removed += 2;
+    }
+}
+
+// Doubling is the same as adding to itself for every number, overflow included. OP_DUP saves loading the 2.
+static void reduceStrength(Program* program, PassStats* stats){
+    for(int i = 0; i < program->count; i++){
+        Instruction* constant = &program->code[i];
+        if(!isIntConstant(program, constant, 2)) continue;
+        int op = numberOperation(program, i, OP_MULTIPLY);
+        if(op == -1) continue;
+        constant->bytes[0] = OP_DUP;
+        constant->length = 1;
+        program->code[op].bytes[0] = OP_ADD;
+        stats->rewritten += 2;
+    }
+}
+
+// A push with no side effects followed by a pop does nothing. Where control arrives at the push does not
+// matter, but something jumping to the pop expects to pop a value of its own.
+static bool isPlainPush(uint8_t instruction){
+    switch(instruction){
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_DUP:        return true;
+        default:            return false;
+    }
+}
+
+static void removeDeadCode(Program* program, PassStats* stats){
+    for(int i = 0; i < program->count; i++){
+        Instruction* push = &program->code[i];
+        if(push->removed || !isPlainPush(push->bytes[0])) continue;
+        int next = nextLive(program, i);
+        if(next == program->count) continue;
+        Instruction* pop = &program->code[next];
+        if(pop->bytes[0] != OP_POP || pop->isTarget) continue;
+        push->removed = true;
+        pop->removed = true;
+        stats->removed += 2;
+    }
+    findTargets(program);
+
+    //Follow every path from the entry, anything not reached can go. The implicit return after an
+    //explicit one at the end of a function is the usual find.
+    bool* reached = ALLOCATE(MEM_COMPILER, bool, program->count);
+    int* worklist = ALLOCATE(MEM_COMPILER, int, program->count);
+    int pending = 0;
+    for(int i = 0; i < program->count; i++) reached[i] = false;
+    int entry = nextLive(program, -1);
+    if(entry < program->count){
+        reached[entry] = true;
+        worklist[pending++] = entry;
+    }
+    while(pending > 0){
+        int i = worklist[--pending];
+        Instruction* instruction = &program->code[i];
+        int successors[2];
+        int successorCount = 0;
+        if(instruction->target != -1) successors[successorCount++] = instruction->target;
+        uint8_t op = instruction->bytes[0];
+        if(op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) successors[successorCount++] = nextLive(program, i);
+        for(int s = 0; s < successorCount; s++){
+            int successor = successors[s];
+            if(successor >= program->count || reached[successor]) continue;
+            reached[successor] = true;
+            worklist[pending++] = successor;
+        }
+    }
+    for(int i = 0; i < program->count; i++){
+        if(program->code[i].removed || reached[i]) continue;
+        program->code[i].removed = true;
+        stats->removed++;
+    }
+    FREE_ARRAY(MEM_COMPILER, bool, reached, program->count);
+    FREE_ARRAY(MEM_COMPILER, int, worklist, program->count);
+}
+
+static PassFn passes[PASS_COUNT] = { foldNegation, foldIdentities, reduceStrength, removeDeadCode };
+
+// ENCODING
+
+// Write the live instructions back over the chunk, and the line runs with them. Nothing ever grows, so
+// it fits where it came from and every jump still fits in 16 bits.
+static void encode(Program* program){
+    int* offsets = ALLOCATE(MEM_COMPILER, int, program->count);
+    int offset = 0;
+    for(int i = 0; i < program->count; i++){
+        offsets[i] = offset;
+        if(!program->code[i].removed) offset += program->code[i].length;
+    }
+
+    Chunk* chunk = program->chunk;
+    chunk->count = 0;
+    chunk->lineCount = 0;
+    for(int i = 0; i < program->count; i++){
+        Instruction* instruction = &program->code[i];
+        if(instruction->removed) continue;
+        if(instruction->target != -1){
+            int from = offsets[i] + instruction->length;
+            int jump = instruction->bytes[0] == OP_LOOP ? from - offsets[instruction->target] : offsets[instruction->target] - from;
+            instruction->bytes[1] = (jump >> 8) & 0xff;
+            instruction->bytes[2] = jump & 0xff;
+        }
+        writeChunkBytes(chunk, instruction->bytes, instruction->length, instruction->line);
+    }
+    FREE_ARRAY(MEM_COMPILER, int, offsets, program->count);
+}
+
+void optimizeChunk(Chunk* chunk){
+    if(enabledPasses == 0 || chunk->finalized || chunk->count == 0) return;
+    int codeSize = chunk->count;
+    Program program;
+    if(!decode(chunk, &program)) return;
+
+    PassStats stats[PASS_COUNT];
+    memset(stats, 0, sizeof(stats));
+    bool changed;
+    do {
+        changed = false;
+        for(int pass = 0; pass < PASS_COUNT; pass++){
+            if(!(enabledPasses & (1 << pass))) continue;
+            PassStats before = stats[pass];
+            findTargets(&program);
+            passes[pass](&program, &stats[pass]);
+            if(stats[pass].removed != before.removed || stats[pass].rewritten != before.rewritten) changed = true;
+        }
+    } while(changed);
+
+    encode(&program);
+    FREE_ARRAY(MEM_COMPILER, Instruction, program.code, codeSize);
+    LOCK_SHARED();
+    instructionsSeen += program.count;
+    for(int pass = 0; pass < PASS_COUNT; pass++){
+        removedTotal[pass] += stats[pass].removed;
+        rewrittenTotal[pass] += stats[pass].rewritten;
+    }
+    UNLOCK_SHARED();
+}
+
+void printOptimizerStats(){
+    printf("optimizer        %llu instructions compiled\n", (unsigned long long) instructionsSeen);
+    for(int pass = 0; pass < PASS_COUNT; pass++){
+        printf("  %-14s %llu removed, %llu rewritten%s\n", passNames[pass],
+            (unsigned long long) removedTotal[pass], (unsigned long long) rewrittenTotal[pass],
+            enabledPasses & (1 << pass) ? "" : " (off)");
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef bnuuy_optimizer_h
+#define bnuuy_optimizer_h
+
+#include "Bnuuy_chunk.h"
+
+// PEEPHOLE OPTIMIZER
+// Runs over each function's code once the compiler has finished it, before the verifier sees it, so
+// whatever the passes leave is checked like anything else. The passes run in order and the whole
+// pipeline repeats until none of them finds anything more to do.
+//
+// Values are dynamically typed, so a rewrite only happens where the result is exactly what the original
+// code gives, errors included. "a" * 1 has to fail, so x * 1 is only dropped when x is known to be a number:
+// it comes straight from a numeric constant or from -, * or /, which fail rather than give anything else.
+// Those can also give vectors, but every rewrite holds element by element and vectors compare by their elements.
+// The 1 has to be an integer too, 3 * 1.0 turns an integer into a double.
+typedef enum {
+    PASS_NEGATE,        // Negated constants become constants, so --5 goes away entirely.
+    PASS_IDENTITY,      // x * 1, x / 1 and x - 0 on known numbers, x + 0 on known integers.
+    PASS_STRENGTH,      // x * 2 on a known number becomes x + x.
+    PASS_DEAD,          // Pushes that are popped straight away, and code no path reaches.
+    PASS_COUNT,         // Not a pass, the number of them.
+} OptimizerPass;
+
+#define PASSES_ALL ((1 << PASS_COUNT) - 1)
+
+void setOptimizerPasses(int passes);    // A bit per OptimizerPass. Set before compiling starts, they are all on by default.
+bool parseOptimizerPasses(const char* list, int* passes);   // "all", "none" or pass names separated by commas.
+void optimizeChunk(Chunk* chunk);       // Only for code fresh from the compiler, before finalizeChunk().
+void printOptimizerStats();
+
+#endif
@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_parallel.h"
+#include "compiler.h"
+#include "vm.h"
+
+// Where one job's error report sits in its worker's error file.
+typedef struct {
+    int worker;
+    long start;
+    long end;
+} ErrorSpan;
+
+typedef struct {
+    pthread_t thread;
+    LocalHeap heap;
+    FILE* errors;           // Everything this worker reported, job after job.
+} Worker;
+
+typedef struct {
+    CompileJob* jobs;
+    ErrorSpan* spans;
+    int count;
+    atomic_int next;        // The next job nobody has taken yet.
+} Pool;
+
+// The jobs from the last call, kept alive until the caller is done with them.
+static CompileJob* rootedJobs = NULL;
+static int rootedCount = 0;
+
+typedef struct {
+    Pool* pool;
+    Worker* worker;
+    int index;
+} WorkerArgs;
+
+static void* workerMain(void* argument){
+    WorkerArgs* args = (WorkerArgs*) argument;
+    Pool* pool = args->pool;
+    Worker* worker = args->worker;
+    localHeap = &worker->heap;
+
+    for(;;){
+        int job = atomic_fetch_add(&pool->next, 1);
+        if(job >= pool->count) break;
+
+        ErrorSpan* span = &pool->spans[job];
+        span->worker = args->index;
+        span->start = ftell(worker->errors);
+        pool->jobs[job].function = compileReporting(pool->jobs[job].source, worker->errors);
+        span->end = ftell(worker->errors);
+    }
+
+    localHeap = NULL;
+    return NULL;
+}
+
+static int coreCount(){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : (int) cores;
+}
+
+// Copy one job's report from its worker's file to stderr.
+static void printErrors(CompileJob* job, ErrorSpan* span, Worker* workers){
+    if(span->end <= span->start) return;
+    FILE* errors = workers[span->worker].errors;
+    fprintf(stderr, "In %s:\n", job->name);
+    fseek(errors, span->start, SEEK_SET);
+    for(long i = span->start; i < span->end; i++){
+        fputc(fgetc(errors), stderr);
+    }
+}
+
+int compileParallel(CompileJob* jobs, int count, int threadCount){
+    releaseCompileJobs();
+    if(threadCount <= 0) threadCount = coreCount();
+    if(threadCount > count) threadCount = count;
+    if(count == 0) return 0;
+
+    //Workers can't run alongside a collection, so finish any cycle that is under way first.
+    //No new one starts until the pool is done, the workers don't pay into the VM's heap.
+    if(vm.gcPhase != GC_IDLE) collectGarbage();
+
+    //These belong to the driver rather than the heap, like the collector's grey stack.
+    Pool pool;
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.spans = malloc(sizeof(ErrorSpan) * count);
+    atomic_init(&pool.next, 0);
+    Worker* workers = malloc(sizeof(Worker) * threadCount);
+    WorkerArgs* args = malloc(sizeof(WorkerArgs) * threadCount);
+    if(pool.spans == NULL || workers == NULL || args == NULL) exit(1);
+
+    for(int i = 0; i < threadCount; i++){
+        initLocalHeap(&workers[i].heap);
+        workers[i].errors = tmpfile();
+        if(workers[i].errors == NULL) exit(1);
+        args[i] = (WorkerArgs){ &pool, &workers[i], i };
+    }
+
+    int started = 0;
+    while(started < threadCount){
+        if(pthread_create(&workers[started].thread, NULL, workerMain, &args[started]) != 0) break;
+        started++;
+    }
+    //If we couldn't start a single thread, compile on this one. The loop picks up whatever is left.
+    if(started == 0){
+        workerMain(&args[0]);
+    }
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    //Everything the workers made belongs to the VM from here on.
+    rootedJobs = jobs;
+    rootedCount = count;
+    for(int i = 0; i < threadCount; i++){
+        adoptLocalHeap(&workers[i].heap);
+    }
+
+    int failed = 0;
+    for(int i = 0; i < count; i++){
+        if(jobs[i].function == NULL) failed++;
+        printErrors(&jobs[i], &pool.spans[i], workers);
+    }
+
+    for(int i = 0; i < threadCount; i++){
+        fclose(workers[i].errors);
+    }
+    free(pool.spans);
+    free(workers);
+    free(args);
+    return failed;
+}
+
+void releaseCompileJobs(){
+    rootedJobs = NULL;
+    rootedCount = 0;
+}
+
+void markParallelRoots(){
+    for(int i = 0; i < rootedCount; i++){
+        markObject((Obj*) rootedJobs[i].function);
+    }
+}
+
+// WORK STEALING POOL
+
+// Split the range finer than one piece per participant so stealing has something to balance with.
+#define GRAINS_PER_PARTICIPANT 32
+
+// What is left of one participant's share. Padded so neighbours' locks don't share a cache line.
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t lo;
+    int64_t hi;
+    char padding[64];
+} RangeSlot;
+
+static struct {
+    bool started;
+    int threads;            // Pool threads, not counting the caller.
+    pthread_t* handles;
+    RangeSlot* slots;       // One per participant.
+    int slotCount;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // A new job is up, or we are shutting down.
+    pthread_cond_t done;    // The last pool thread finished the job.
+    uint64_t generation;    // Bumped for every job, so a thread knows it has not seen this one.
+    int active;             // Pool threads still working on the current job.
+    bool shutdown;
+    // The current job.
+    RangeFn fn;
+    void* data;
+    int64_t grain;
+    atomic_bool stop;
+} pool = { .started = false };
+
+static bool stealInto(int thief){
+    int participants = pool.threads + 1;
+    for(int k = 1; k < participants; k++){
+        RangeSlot* victim = &pool.slots[(thief + k) % participants];
+        pthread_mutex_lock(&victim->lock);
+        int64_t remaining = victim->hi - victim->lo;
+        if(remaining > 0){
+            //Take the back half, the owner keeps working from the front undisturbed.
+            int64_t mid = victim->lo + remaining / 2;
+            int64_t hi = victim->hi;
+            victim->hi = mid;
+            pthread_mutex_unlock(&victim->lock);
+
+            RangeSlot* own = &pool.slots[thief];
+            pthread_mutex_lock(&own->lock);
+            own->lo = mid;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
+
+static void participate(int participant){
+    RangeSlot* own = &pool.slots[participant];
+    while(!atomic_load(&pool.stop)){
+        pthread_mutex_lock(&own->lock);
+        if(own->lo < own->hi){
+            int64_t lo = own->lo;
+            int64_t hi = own->hi - lo > pool.grain ? lo + pool.grain : own->hi;
+            own->lo = hi;
+            pthread_mutex_unlock(&own->lock);
+            if(!pool.fn(participant, lo, hi, pool.data)) atomic_store(&pool.stop, true);
+            continue;
+        }
+        pthread_mutex_unlock(&own->lock);
+        if(!stealInto(participant)) break;
+    }
+}
+
+static void* poolThread(void* argument){
+    int participant = (int)(intptr_t) argument;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for(;;){
+        while(pool.generation == seen && !pool.shutdown){
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if(pool.shutdown) break;
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        participate(participant);
+
+        pthread_mutex_lock(&pool.lock);
+        if(--pool.active == 0) pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// The threads are made on first use and then sleep between jobs.
+static void startPool(){
+    if(pool.started) return;
+    pool.started = true;
+    pool.shutdown = false;
+    pool.generation = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    int wanted = coreCount() - 1;
+    pool.handles = malloc(sizeof(pthread_t) * (wanted > 0 ? wanted : 1));
+    pool.slots = malloc(sizeof(RangeSlot) * (wanted + 1));
+    if(pool.handles == NULL || pool.slots == NULL) exit(1);
+    pool.slotCount = wanted + 1;
+    for(int i = 0; i < pool.slotCount; i++){
+        pthread_mutex_init(&pool.slots[i].lock, NULL);
+    }
+    //If a thread won't start we just have fewer participants.
+    pool.threads = 0;
+    while(pool.threads < wanted){
+        void* participant = (void*)(intptr_t)(pool.threads + 1);
+        if(pthread_create(&pool.handles[pool.threads], NULL, poolThread, participant) != 0) break;
+        pool.threads++;
+    }
+}
+
+int parallelParticipants(){
+    startPool();
+    return pool.threads + 1;
+}
+
+void parallelRange(int64_t start, int64_t end, RangeFn fn, void* data){
+    if(end <= start) return;
+    startPool();
+    int participants = pool.threads + 1;
+    int64_t count = end - start;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.data = data;
+    pool.grain = count / ((int64_t) participants * GRAINS_PER_PARTICIPANT);
+    if(pool.grain < 1) pool.grain = 1;
+    atomic_store(&pool.stop, false);
+    //Divide first, count * i could overflow. The first count % participants shares get one extra.
+    int64_t share = count / participants;
+    int64_t extra = count % participants;
+    int64_t lo = start;
+    for(int i = 0; i < participants; i++){
+        pool.slots[i].lo = lo;
+        lo += share + (i < extra ? 1 : 0);
+        pool.slots[i].hi = lo;
+    }
+    pool.active = pool.threads;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    participate(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active > 0){
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void stopParallelPool(){
+    if(!pool.started) return;
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for(int i = 0; i < pool.threads; i++){
+        pthread_join(pool.handles[i], NULL);
+    }
+    for(int i = 0; i < pool.slotCount; i++){
+        pthread_mutex_destroy(&pool.slots[i].lock);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.wake);
+    pthread_cond_destroy(&pool.done);
+    free(pool.handles);
+    free(pool.slots);
+    pool.started = false;
+}
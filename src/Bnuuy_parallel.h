@@ -0,0 +1,36 @@
+#ifndef bnuuy_parallel_h
+#define bnuuy_parallel_h
+
+#include "Bnuuy_common.h"
+#include "Bnuuy_object.h"
+
+// PARALLEL COMPILE
+// Compiles many sources at once on a pool of worker threads. Every worker has its own scanner, parser
+// and compiler state, and allocates into a local heap that the VM adopts once the pool is done.
+// Jobs are handed out in order and results land back in the job they came from, and error reports are
+// printed job by job afterwards, so what comes out does not depend on how the threads were scheduled.
+typedef struct {
+    const char* source;     // In.
+    const char* name;       // In, labels the job's errors.
+    ObjFunction* function;  // Out, NULL if the source failed to compile.
+} CompileJob;
+
+// threadCount of 0 or less means one per core. Returns how many jobs failed.
+// The compiled functions stay alive until releaseCompileJobs() or the next call.
+int compileParallel(CompileJob* jobs, int count, int threadCount);
+void releaseCompileJobs();
+void markParallelRoots();
+
+// WORK STEALING POOL
+// Runs fn over [start, end) on every core. The calling thread joins in as participant 0 and the pool's
+// own threads are 1 and up. Each participant starts with an even share of the range and works through
+// it from the front a grain at a time. One that runs dry steals the back half of another's remainder.
+// fn returns false to stop everyone early. Returns once every participant is done.
+// end - start has to fit in an int64_t.
+typedef bool (*RangeFn)(int participant, int64_t lo, int64_t hi, void* data);
+
+int parallelParticipants();
+void parallelRange(int64_t start, int64_t end, RangeFn fn, void* data);
+void stopParallelPool();
+
+#endif
@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_server.h"
+#include "Bnuuy_table.h"
+#include "compiler.h"
+#include "vm.h"
+
+#define CACHE_MAX           1024            // Scripts kept compiled. The cache starts over once it is full.
+#define LATENCY_SAMPLES     65536           // The report covers this many of the most recent requests.
+#define OUTPUT_LIMIT        (1024 * 1024)   // Stop reading from a client while this much waits to go back to it.
+#define READ_CHUNK          65536
+
+// One connection. Requests are read into in and answered into out, neither has to line up with packets.
+typedef struct {
+    int fd;
+    bool closing;           // The client has stopped sending. Dropped once its answers are out.
+    uint8_t* in;
+    size_t inStart;         // Where the next request starts, everything before it has been answered.
+    size_t inCount;
+    size_t inCapacity;
+    uint8_t* out;
+    size_t outSent;
+    size_t outCount;
+    size_t outCapacity;
+} Client;
+
+static Table cache;                         // Source, as an interned string -> the compiled script.
+static volatile sig_atomic_t stopping = 0;
+
+// Service times in nanoseconds, from a whole request being in to its answer being queued.
+static uint64_t latencies[LATENCY_SAMPLES];
+static uint64_t requestCount = 0;
+static uint64_t cacheHits = 0;
+
+static uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void stopServer(int signal){
+    (void) signal;
+    stopping = 1;
+}
+
+void markServerRoots(){
+    markTable(&cache);
+}
+
+// BUFFERS
+
+static void reserve(uint8_t** bytes, size_t* capacity, size_t needed){
+    if(needed <= *capacity) return;
+    size_t grown = *capacity;
+    while(grown < needed) grown = GROW_CAPACITY(grown);
+    *bytes = GROW_ARRAY(MEM_HOST, uint8_t, *bytes, *capacity, grown);
+    *capacity = grown;
+}
+
+static void putBytes(Client* client, const void* bytes, size_t count){
+    reserve(&client->out, &client->outCapacity, client->outCount + count);
+    memcpy(client->out + client->outCount, bytes, count);
+    client->outCount += count;
+}
+
+static void putU32(Client* client, uint32_t value){
+    uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+    putBytes(client, bytes, sizeof(bytes));
+}
+
+static uint32_t readU32(const uint8_t* bytes){
+    return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+static size_t pending(Client* client){
+    return client->outCount - client->outSent;
+}
+
+// REQUESTS
+
+static int compareLatency(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void writeReport(FILE* stream){
+    size_t count = requestCount < LATENCY_SAMPLES ? requestCount : LATENCY_SAMPLES;
+    fprintf(stream, "== server ==\n");
+    fprintf(stream, "requests         %llu, %llu of them from the cache\n",
+        (unsigned long long) requestCount, (unsigned long long) cacheHits);
+    if(count == 0) return;
+
+    uint64_t* sorted = malloc(sizeof(uint64_t) * count);
+    if(sorted == NULL) exit(1);
+    memcpy(sorted, latencies, sizeof(uint64_t) * count);
+    qsort(sorted, count, sizeof(uint64_t), compareLatency);
+    //Nearest rank: the smallest sample with at least that share of the samples at or below it.
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    for(size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++){
+        size_t rank = (size_t)(percentiles[i] / 100 * count + 0.999999);
+        if(rank == 0) rank = 1;
+        fprintf(stream, "latency p%-6g  %.1f us\n", percentiles[i], sorted[rank - 1] / 1000.0);
+    }
+    fprintf(stream, "latency max      %.1f us\n", sorted[count - 1] / 1000.0);
+    free(sorted);
+}
+
+// Compile the source unless the cache already has it, then run it with its output going to the given streams.
+static InterpretResult evaluateSource(const uint8_t* source, uint32_t length, FILE* printed, FILE* errors){
+    //Interning gives a key to look the script up by, and a copy that ends in a null for the compiler.
+    ObjString* key = copyString((const char*) source, (int) length);
+    ObjFunction* function;
+    Value cached;
+    if(tableGet(&cache, key, &cached)){
+        cacheHits++;
+        function = AS_FUNCTION(cached);
+    } else {
+        push(OBJ_VAL(key));
+        function = compileReporting(key->chars, errors);
+        if(function != NULL){
+            push(OBJ_VAL(function));
+            if(cache.count >= CACHE_MAX){
+                freeTable(&cache);
+                initTable(&cache);
+            }
+            tableSet(&cache, key, OBJ_VAL(function));
+            pop();
+        }
+        pop();
+        if(function == NULL) return INTERPRET_COMPILE_ERROR;
+    }
+
+    FILE* printStream = vm.printStream;
+    FILE* errorStream = vm.errorStream;
+    vm.printStream = printed;
+    vm.errorStream = errors;
+    InterpretResult result = interpretFunction(function);
+    vm.printStream = printStream;
+    vm.errorStream = errorStream;
+    return result;
+}
+
+static void serveRequest(Client* client, const uint8_t* source, uint32_t length){
+    uint64_t start = nowNs();
+    char* printed = NULL;
+    char* errors = NULL;
+    size_t printedLength = 0;
+    size_t errorsLength = 0;
+    FILE* printStream = open_memstream(&printed, &printedLength);
+    FILE* errorStream = open_memstream(&errors, &errorsLength);
+    if(printStream == NULL || errorStream == NULL) exit(1);
+
+    InterpretResult result = INTERPRET_OK;
+    if(length == 0){
+        writeReport(printStream);
+    } else {
+        result = evaluateSource(source, length, printStream, errorStream);
+    }
+    fclose(printStream);
+    fclose(errorStream);
+
+    putU32(client, result);
+    putU32(client, (uint32_t) printedLength);
+    putBytes(client, printed, printedLength);
+    putU32(client, (uint32_t) errorsLength);
+    putBytes(client, errors, errorsLength);
+    free(printed);
+    free(errors);
+
+    if(length > 0){
+        latencies[requestCount % LATENCY_SAMPLES] = nowNs() - start;
+        requestCount++;
+    }
+}
+
+static bool hasWholeRequest(Client* client){
+    size_t available = client->inCount - client->inStart;
+    return available >= 4 && available - 4 >= readU32(client->in + client->inStart);
+}
+
+// Answer every whole request the client has sent, unless it is not reading its answers.
+static void serveClient(Client* client){
+    while(pending(client) < OUTPUT_LIMIT && client->inCount - client->inStart >= 4){
+        const uint8_t* request = client->in + client->inStart;
+        uint32_t length = readU32(request);
+        if(length > SERVER_MAX_REQUEST){
+            client->closing = true;
+            client->inStart = client->inCount;
+            break;
+        }
+        if(client->inCount - client->inStart - 4 < length) break;
+        serveRequest(client, request + 4, length);
+        client->inStart += 4 + (size_t) length;
+    }
+    //Keep whatever part of a request has come in so far at the front.
+    memmove(client->in, client->in + client->inStart, client->inCount - client->inStart);
+    client->inCount -= client->inStart;
+    client->inStart = 0;
+}
+
+// SOCKETS
+
+static bool setNonBlocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static int listenOn(const char* path){
+    struct sockaddr_un address;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "Can't serve on %s: The path is too long for a socket.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    //A socket left behind by a server that is gone would stop us binding. Anything else at the path stays.
+    struct stat info;
+    if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+       listen(fd, SOMAXCONN) != 0 || !setNonBlocking(fd)){
+        fprintf(stderr, "Can't serve on %s: %s\n", path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void acceptClients(int listener, Client* clients, int* clientCount){
+    while(*clientCount < SERVER_MAX_CLIENTS){
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) return;
+        if(!setNonBlocking(fd)){
+            close(fd);
+            continue;
+        }
+        clients[(*clientCount)++] = (Client){ fd, false, NULL, 0, 0, 0, NULL, 0, 0, 0 };
+    }
+}
+
+static void readClient(Client* client){
+    for(;;){
+        reserve(&client->in, &client->inCapacity, client->inCount + READ_CHUNK);
+        ssize_t count = recv(client->fd, client->in + client->inCount, client->inCapacity - client->inCount, 0);
+        if(count > 0){
+            client->inCount += count;
+            continue;
+        }
+        if(count < 0 && errno == EINTR) continue;
+        if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        //Closed, or broken. Either way nothing more is coming.
+        client->closing = true;
+        return;
+    }
+}
+
+static void flushClient(Client* client){
+    while(pending(client) > 0){
+        ssize_t count = send(client->fd, client->out + client->outSent, pending(client), 0);
+        if(count >= 0){
+            client->outSent += count;
+            continue;
+        }
+        if(errno == EINTR) continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+        //The client went away, its answers have nowhere to go.
+        client->closing = true;
+        client->outSent = client->outCount;
+    }
+    client->outSent = 0;
+    client->outCount = 0;
+}
+
+static void closeClient(Client* client){
+    close(client->fd);
+    FREE_ARRAY(MEM_HOST, uint8_t, client->in, client->inCapacity);
+    FREE_ARRAY(MEM_HOST, uint8_t, client->out, client->outCapacity);
+}
+
+bool runServer(const char* path){
+    int listener = listenOn(path);
+    if(listener < 0) return false;
+
+    //Signals interrupt poll() rather than restarting it, so the loop sees stopping straight away.
+    //A client hanging up mid answer shows up as an error from send(), not a SIGPIPE.
+    struct sigaction stop, ignore, oldInterrupt, oldTerminate, oldPipe;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = stopServer;
+    sigemptyset(&stop.sa_mask);
+    ignore = stop;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &stop, &oldInterrupt);
+    sigaction(SIGTERM, &stop, &oldTerminate);
+    sigaction(SIGPIPE, &ignore, &oldPipe);
+    stopping = 0;
+    initTable(&cache);
+
+    Client clients[SERVER_MAX_CLIENTS];
+    struct pollfd polls[SERVER_MAX_CLIENTS + 1];
+    int clientCount = 0;
+    bool ok = true;
+    while(!stopping){
+        polls[0] = (struct pollfd){ listener, clientCount < SERVER_MAX_CLIENTS ? POLLIN : 0, 0 };
+        for(int i = 0; i < clientCount; i++){
+            short events = 0;
+            if(!clients[i].closing && pending(&clients[i]) < OUTPUT_LIMIT) events |= POLLIN;
+            if(pending(&clients[i]) > 0) events |= POLLOUT;
+            polls[i + 1] = (struct pollfd){ clients[i].fd, events, 0 };
+        }
+        int polled = clientCount;
+        if(poll(polls, polled + 1, -1) < 0){
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Can't serve on %s: %s\n", path, strerror(errno));
+            ok = false;
+            break;
+        }
+
+        //Backwards, so a client dropped by moving the last one into its place has already had its turn.
+        for(int i = polled - 1; i >= 0; i--){
+            Client* client = &clients[i];
+            if(polls[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) readClient(client);
+            serveClient(client);
+            flushClient(client);
+            //One that hung up still gets the answers to every whole request it sent. The part of a request
+            //left after those can never be finished, so it goes once nothing is waiting to be sent.
+            while(client->closing && pending(client) == 0 && hasWholeRequest(client)){
+                serveClient(client);
+                flushClient(client);
+            }
+            if(client->closing && pending(client) == 0){
+                closeClient(client);
+                clients[i] = clients[--clientCount];
+            }
+        }
+        if(polls[0].revents & POLLIN) acceptClients(listener, clients, &clientCount);
+    }
+
+    for(int i = 0; i < clientCount; i++){
+        closeClient(&clients[i]);
+    }
+    close(listener);
+    unlink(path);
+    freeTable(&cache);
+    sigaction(SIGINT, &oldInterrupt, NULL);
+    sigaction(SIGTERM, &oldTerminate, NULL);
+    sigaction(SIGPIPE, &oldPipe, NULL);
+
+    writeReport(stdout);
+    return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef bnuuy_server_h
+#define bnuuy_server_h
+
+#include "Bnuuy_common.h"
+
+// EVALUATION SERVER
+// Keeps one VM warm and runs scripts sent to it over a Unix domain socket, so a caller pays neither a
+// process start nor initVM() per script. Requests share the VM and its globals the way lines typed into
+// the repl do, so a first request or the scripts given on the command line can define what later ones use.
+// Compiled scripts are cached by their source, sending the same text again skips the compiler.
+//
+// Every number on the wire is a 32 bit big-endian unsigned integer.
+//  request     length, then that many bytes of source
+//  response    status (an InterpretResult), then what the script printed and then its error messages,
+//              each as a length and that many bytes
+// A request with no source runs nothing and answers with the latency report as its printed output.
+// Clients can send any number of requests without waiting, the responses come back in the same order.
+// Several clients can be connected at once and take turns, one request at a time.
+
+#define SERVER_MAX_CLIENTS  64
+#define SERVER_MAX_REQUEST  (16 * 1024 * 1024)  // Bigger requests close the connection.
+
+// Serve until SIGINT or SIGTERM, then print the latency report. False if the socket can't be set up.
+bool runServer(const char* path);
+void markServerRoots();
+
+#endif
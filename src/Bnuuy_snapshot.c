@@ -0,0 +1,702 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_snapshot.h"
+#include "Bnuuy_verifier.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC         "BNUUYIMG"
+#define IMAGE_VERSION       6
+#define IMAGE_BYTE_ORDER    0x01020304u
+#define NO_OBJECT           UINT32_MAX
+
+// IMAGE LAYOUT
+//  header
+//  records, one per object, each starting with its ObjType
+//  object table, the offset of every record
+//  globals, a (name, value) pair per slot in slot order
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // Only reads back as IMAGE_BYTE_ORDER on a machine with the same endianness.
+    uint32_t objectCount;
+    uint32_t globalCount;
+    uint64_t tableOffset;
+    uint64_t globalsOffset;
+} ImageHeader;
+
+// A value as the image stores it, with the object swapped for its index.
+typedef struct {
+    uint32_t type;
+    uint32_t object;
+    union {
+        double number;      // Booleans are 0 or 1.
+        int64_t integer;
+    } as;
+} ImageValue;
+
+// SAVING
+
+// Every object we have come across, in the order we found them. Its position is its index in the image.
+// keys/indices is an open addressing map from the object back to that index.
+typedef struct {
+    Obj** objects;
+    uint32_t count;
+    uint32_t capacity;
+    Obj** keys;
+    uint32_t* indices;
+    uint32_t keyCapacity;
+} ObjectIndex;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+static const char* saveError;
+
+static uint32_t hashPointer(Obj* object, uint32_t mask){
+    return (uint32_t)(((uintptr_t) object >> 4) * 2654435761u) & mask;
+}
+
+static void growKeys(ObjectIndex* index){
+    uint32_t capacity = index->keyCapacity < 64 ? 64 : index->keyCapacity * 2;
+    Obj** keys = calloc(capacity, sizeof(Obj*));
+    uint32_t* indices = malloc(sizeof(uint32_t) * capacity);
+    if(keys == NULL || indices == NULL) exit(1);
+    for(uint32_t i = 0; i < index->keyCapacity; i++){
+        if(index->keys[i] == NULL) continue;
+        uint32_t slot = hashPointer(index->keys[i], capacity - 1);
+        while(keys[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+        keys[slot] = index->keys[i];
+        indices[slot] = index->indices[i];
+    }
+    free(index->keys);
+    free(index->indices);
+    index->keys = keys;
+    index->indices = indices;
+    index->keyCapacity = capacity;
+}
+
+/// @brief The object's index in the image, handing out the next one if we have not seen it before.
+static uint32_t indexOf(ObjectIndex* index, Obj* object){
+    if(object == NULL) return NO_OBJECT;
+    if((index->count + 1) * 4 > index->keyCapacity * 3) growKeys(index);
+
+    uint32_t mask = index->keyCapacity - 1;
+    uint32_t slot = hashPointer(object, mask);
+    while(index->keys[slot] != NULL){
+        if(index->keys[slot] == object) return index->indices[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    if(index->count == index->capacity){
+        index->capacity = GROW_CAPACITY(index->capacity);
+        index->objects = realloc(index->objects, sizeof(Obj*) * index->capacity);
+        if(index->objects == NULL) exit(1);
+    }
+    index->keys[slot] = object;
+    index->indices[slot] = index->count;
+    index->objects[index->count] = object;
+    return index->count++;
+}
+
+static void put(Writer* writer, const void* data, size_t size){
+    if(size == 0) return;
+    if(writer->count + size > writer->capacity){
+        while(writer->count + size > writer->capacity) writer->capacity = GROW_CAPACITY(writer->capacity);
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+        if(writer->bytes == NULL) exit(1);
+    }
+    memcpy(writer->bytes + writer->count, data, size);
+    writer->count += size;
+}
+
+static void putU32(Writer* writer, uint32_t value){
+    put(writer, &value, sizeof(value));
+}
+
+static void putRef(Writer* writer, ObjectIndex* index, Obj* object){
+    putU32(writer, indexOf(index, object));
+}
+
+static void putValue(Writer* writer, ObjectIndex* index, Value value){
+    ImageValue image = { value.type, NO_OBJECT, { 0 } };
+    switch(value.type){
+        case VAL_BOOL:      image.as.number = AS_BOOL(value) ? 1 : 0; break;
+        case VAL_NUMBER:    image.as.number = AS_NUMBER(value); break;
+        case VAL_INT:       image.as.integer = AS_INT(value); break;
+        case VAL_OBJ:       image.object = indexOf(index, AS_OBJ(value)); break;
+        default:            break;
+    }
+    put(writer, &image, sizeof(image));
+}
+
+// Natives are C functions and can't be written out. They are saved as the name of the global
+// that holds them, and the loading VM supplies its own.
+static ObjString* nativeName(Obj* native){
+    for(int i = 0; i < vm.globalValues.count; i++){
+        Value value = vm.globalValues.values[i];
+        if(IS_OBJ(value) && AS_OBJ(value) == native) return globalName(i);
+    }
+    return NULL;
+}
+
+// Write one object's record. Anything it refers to gets an index, and a record of its own later on.
+static void putRecord(Writer* writer, ObjectIndex* index, Obj* object){
+    //A rope is saved as the string it spells out, and loads as one.
+    putU32(writer, object->type == OBJ_ROPE ? OBJ_STRING : object->type);
+    switch(object->type){
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            putU32(writer, string->length);
+            put(writer, string->chars, string->length);
+            break;
+        }
+        case OBJ_ROPE: {
+            //Copied out rather than flattened, saving doesn't allocate on the heap.
+            ObjRope* rope = (ObjRope*) object;
+            char* chars = malloc(rope->length);
+            if(chars == NULL) exit(1);
+            copyRopeChars(rope, chars);
+            putU32(writer, rope->length);
+            put(writer, chars, rope->length);
+            free(chars);
+            break;
+        }
+        case OBJ_NATIVE: {
+            ObjString* name = nativeName(object);
+            if(name == NULL) saveError = "A native that no global holds can't be saved.";
+            putRef(writer, index, (Obj*) name);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            Chunk* chunk = &function->chunk;
+            putU32(writer, function->arity);
+            putRef(writer, index, (Obj*) function->name);
+            //A lazy function nobody called yet is saved as its source and stays lazy, it has no code.
+            bool lazy = !function->verified;
+            putRef(writer, index, lazy ? (Obj*) function->source : NULL);
+            putU32(writer, function->sourceLine);
+            putU32(writer, chunk->count);
+            put(writer, chunk->code, chunk->count);
+            putU32(writer, chunk->lineCount);
+            for(int i = 0; i < chunk->lineCount; i++){
+                putU32(writer, chunk->lines[i].offset);
+                putU32(writer, chunk->lines[i].line);
+            }
+            putU32(writer, chunk->constants.count);
+            for(int i = 0; i < chunk->constants.count; i++){
+                putValue(writer, index, chunk->constants.values[i]);
+            }
+            putU32(writer, chunk->cacheCount);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) object;
+            putRef(writer, index, (Obj*) klass->name);
+            putU32(writer, klass->fieldHint);
+            uint32_t methods = 0;
+            for(int i = 0; i < klass->methods.capacity; i++){
+                if(klass->methods.entries[i].key != NULL) methods++;
+            }
+            putU32(writer, methods);
+            for(int i = 0; i < klass->methods.capacity; i++){
+                Entry* entry = &klass->methods.entries[i];
+                if(entry->key == NULL) continue;
+                putRef(writer, index, (Obj*) entry->key);
+                putValue(writer, index, entry->value);
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            //The shape is rebuilt on load by adding the fields back in the same order.
+            ObjInstance* instance = (ObjInstance*) object;
+            int fieldCount = instance->shape->fieldCount;
+            ObjString** names = malloc(sizeof(ObjString*) * (fieldCount > 0 ? fieldCount : 1));
+            if(names == NULL) exit(1);
+            for(ObjShape* shape = instance->shape; shape->parent != NULL; shape = shape->parent){
+                names[shape->fieldCount - 1] = shape->name;
+            }
+            putRef(writer, index, (Obj*) instance->klass);
+            putU32(writer, fieldCount);
+            for(int i = 0; i < fieldCount; i++){
+                putRef(writer, index, (Obj*) names[i]);
+                putValue(writer, index, instance->fields[i]);
+            }
+            free(names);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            putValue(writer, index, bound->receiver);
+            putRef(writer, index, (Obj*) bound->method);
+            break;
+        }
+        case OBJ_FIBER: {
+            //A finished fiber is just its result. One that could still run has a stack we won't save.
+            ObjFiber* fiber = (ObjFiber*) object;
+            if(fiber->state != FIBER_DONE && fiber->state != FIBER_FAILED){
+                saveError = "A fiber that has not finished can't be saved.";
+            }
+            putU32(writer, fiber->state);
+            putValue(writer, index, fiber->result);
+            break;
+        }
+        case OBJ_VECTOR: {
+            ObjVector* vector = (ObjVector*) object;
+            putU32(writer, vector->length);
+            put(writer, vector->elements, sizeof(double) * vector->length);
+            break;
+        }
+        case OBJ_SHAPE:
+            //No value can hold a shape, only instances and caches, and neither saves them.
+            saveError = "Shapes can't be saved.";
+            break;
+    }
+}
+
+bool saveSnapshot(const char* path){
+    saveError = NULL;
+    ObjectIndex index = { NULL, 0, 0, NULL, NULL, 0 };
+    Writer records = { NULL, 0, 0 };
+    Writer tail = { NULL, 0, 0 };
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.globalCount = vm.globalValues.count;
+    put(&records, &header, sizeof(header));
+
+    //The globals are the roots. Index them first, their section is written at the end.
+    Writer globals = { NULL, 0, 0 };
+    for(int i = 0; i < vm.globalValues.count; i++){
+        putRef(&globals, &index, (Obj*) globalName(i));
+        putValue(&globals, &index, vm.globalValues.values[i]);
+    }
+
+    //Writing a record can find new objects, which go on the end, so this walks the whole graph.
+    uint64_t* offsets = NULL;
+    uint32_t offsetCapacity = 0;
+    for(uint32_t i = 0; i < index.count && saveError == NULL; i++){
+        if(i == offsetCapacity){
+            offsetCapacity = index.capacity;
+            offsets = realloc(offsets, sizeof(uint64_t) * offsetCapacity);
+            if(offsets == NULL) exit(1);
+        }
+        offsets[i] = records.count;
+        putRecord(&records, &index, index.objects[i]);
+    }
+
+    bool ok = saveError == NULL;
+    if(ok){
+        //Records are written, patch up the header and append the table and globals.
+        ImageHeader* written = (ImageHeader*) records.bytes;
+        written->objectCount = index.count;
+        written->tableOffset = records.count;
+        written->globalsOffset = records.count + sizeof(uint64_t) * index.count;
+        put(&tail, offsets, sizeof(uint64_t) * index.count);
+        put(&tail, globals.bytes, globals.count);
+
+        FILE* file = fopen(path, "wb");
+        if(file == NULL){
+            saveError = "Couldn't open the image file.";
+            ok = false;
+        } else {
+            ok = fwrite(records.bytes, 1, records.count, file) == records.count &&
+                 fwrite(tail.bytes, 1, tail.count, file) == tail.count;
+            if(fclose(file) != 0) ok = false;
+            if(!ok) saveError = "Couldn't write the image file.";
+        }
+    }
+    if(!ok) fprintf(stderr, "Can't save image %s: %s\n", path, saveError);
+
+    free(index.objects);
+    free(index.keys);
+    free(index.indices);
+    free(records.bytes);
+    free(tail.bytes);
+    free(globals.bytes);
+    free(offsets);
+    return ok;
+}
+
+// LOADING
+// The image is as untrusted as source code. Every read is bounds checked, every reference is checked
+// for its type, and the bytecode has to get past the verifier before anything can run it. The verifier
+// proves stack depths and that functions are pushed where a function is expected, the few values it
+// can't follow, like the class under OP_METHOD, are checked by the VM when it gets to them.
+
+typedef struct {
+    const uint8_t* bytes;
+    size_t size;
+    size_t offset;
+    const char* error;      // The first thing that went wrong, reads return zeros once it is set.
+    Obj** objects;          // By image index. NULL until the pass that makes the object.
+    uint32_t objectCount;
+} Loader;
+
+static void corrupt(Loader* loader, const char* message){
+    if(loader->error == NULL) loader->error = message;
+}
+
+static const uint8_t* take(Loader* loader, size_t size){
+    if(loader->error != NULL || size > loader->size - loader->offset){
+        corrupt(loader, "Image is truncated.");
+        return NULL;
+    }
+    const uint8_t* bytes = loader->bytes + loader->offset;
+    loader->offset += size;
+    return bytes;
+}
+
+static uint32_t takeU32(Loader* loader){
+    uint32_t value = 0;
+    const uint8_t* bytes = take(loader, sizeof(value));
+    if(bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// A reference to an object of the given type. NO_OBJECT reads back as NULL if nullable.
+static Obj* takeRef(Loader* loader, ObjType type, bool nullable){
+    uint32_t index = takeU32(loader);
+    if(loader->error != NULL) return NULL;
+    if(index == NO_OBJECT && nullable) return NULL;
+    if(index >= loader->objectCount || loader->objects[index] == NULL ||
+       loader->objects[index]->type != type){
+        corrupt(loader, "Bad object reference.");
+        return NULL;
+    }
+    return loader->objects[index];
+}
+
+static Value takeValue(Loader* loader){
+    ImageValue image = { VAL_NIL, NO_OBJECT, { 0 } };
+    const uint8_t* bytes = take(loader, sizeof(image));
+    if(bytes != NULL) memcpy(&image, bytes, sizeof(image));
+    switch(image.type){
+        case VAL_BOOL:      return BOOL_VAL(image.as.number != 0);
+        case VAL_NIL:       return NIL_VAL;
+        case VAL_NUMBER:    return NUMBER_VAL(image.as.number);
+        case VAL_INT:       return INT_VAL(image.as.integer);
+        case VAL_UNDEFINED: return UNDEFINED_VAL;
+        case VAL_OBJ:
+            if(image.object < loader->objectCount && loader->objects[image.object] != NULL &&
+               loader->objects[image.object]->type != OBJ_SHAPE){
+                return OBJ_VAL(loader->objects[image.object]);
+            }
+            corrupt(loader, "Bad object reference.");
+            return NIL_VAL;
+        default:
+            corrupt(loader, "Unknown value type.");
+            return NIL_VAL;
+    }
+}
+
+// Pass zero makes the strings and vectors, pass one the objects that need nothing but strings, pass two the
+// instances, which need their class. Pass three fills in everything that refers to other objects,
+// which by now all exist, so cycles are no trouble.
+static void loadRecord(Loader* loader, uint32_t index, int pass){
+    ObjType type = takeU32(loader);
+    Obj** slot = &loader->objects[index];
+    switch(type){
+        case OBJ_STRING: {
+            if(pass != 0) return;
+            uint32_t length = takeU32(loader);
+            const uint8_t* chars = take(loader, length);
+            if(chars != NULL && length <= INT32_MAX) *slot = (Obj*) copyString((const char*) chars, length);
+            return;
+        }
+        case OBJ_VECTOR: {
+            if(pass != 0) return;
+            uint32_t length = takeU32(loader);
+            const uint8_t* elements = length <= INT32_MAX / sizeof(double) ? take(loader, sizeof(double) * length) : NULL;
+            if(elements == NULL) return;
+            ObjVector* vector = newVector(length);
+            memcpy(vector->elements, elements, sizeof(double) * length);
+            *slot = (Obj*) vector;
+            return;
+        }
+        case OBJ_NATIVE: {
+            if(pass != 1) return;
+            ObjString* name = (ObjString*) takeRef(loader, OBJ_STRING, false);
+            Value global;
+            if(name == NULL || !tableGet(&vm.globalNames, name, &global) ||
+               !IS_NATIVE(vm.globalValues.values[(int) AS_NUMBER(global)])){
+                corrupt(loader, "Image needs a native this VM does not have.");
+                return;
+            }
+            *slot = AS_OBJ(vm.globalValues.values[(int) AS_NUMBER(global)]);
+            return;
+        }
+        case OBJ_FUNCTION: {
+            if(pass == 1){
+                *slot = (Obj*) newFunction();
+                return;
+            }
+            if(pass != 3) return;
+            ObjFunction* function = (ObjFunction*) *slot;
+            Chunk* chunk = &function->chunk;
+            function->arity = takeU32(loader);
+            function->name = (ObjString*) takeRef(loader, OBJ_STRING, true);
+            function->source = (ObjString*) takeRef(loader, OBJ_STRING, true);
+            function->sourceLine = takeU32(loader);
+            uint32_t codeCount = takeU32(loader);
+            const uint8_t* code = take(loader, codeCount);
+            if(code == NULL || codeCount > INT32_MAX || function->arity > UINT8_MAX ||
+               (function->source != NULL && (codeCount != 0 || function->name == NULL))){
+                corrupt(loader, "Bad function.");
+                return;
+            }
+            //The code goes in a line run at a time. Runs start at 0, move forward and cover all of it.
+            uint32_t lineCount = takeU32(loader);
+            if(lineCount > codeCount || (lineCount == 0) != (codeCount == 0)){
+                corrupt(loader, "Bad line table.");
+                return;
+            }
+            if(codeCount > 0) reserveChunk(chunk, codeCount);
+            uint32_t runStart = 0;
+            uint32_t runLine = 0;
+            for(uint32_t i = 0; i < lineCount; i++){
+                uint32_t offset = takeU32(loader);
+                uint32_t line = takeU32(loader);
+                if(loader->error != NULL || line > INT32_MAX ||
+                   (i == 0 ? offset != 0 : (offset <= runStart || offset >= codeCount))){
+                    corrupt(loader, "Bad line table.");
+                    return;
+                }
+                if(i > 0) writeChunkBytes(chunk, code + runStart, offset - runStart, runLine);
+                runStart = offset;
+                runLine = line;
+            }
+            if(lineCount > 0) writeChunkBytes(chunk, code + runStart, codeCount - runStart, runLine);
+            //Operands can't index past these, a bigger count can only be a broken image.
+            uint32_t constantCount = takeU32(loader);
+            if(constantCount > UINT8_COUNT) corrupt(loader, "Bad function.");
+            for(uint32_t i = 0; i < constantCount && loader->error == NULL; i++){
+                addConstant(chunk, takeValue(loader));
+            }
+            uint32_t cacheCount = takeU32(loader);
+            if(cacheCount > UINT16_MAX + 1) corrupt(loader, "Bad function.");
+            for(uint32_t i = 0; i < cacheCount && loader->error == NULL; i++){
+                addInlineCache(chunk);
+            }
+            return;
+        }
+        case OBJ_CLASS: {
+            if(pass == 1){
+                ObjString* name = (ObjString*) takeRef(loader, OBJ_STRING, false);
+                if(name != NULL) *slot = (Obj*) newClass(name);
+                return;
+            }
+            if(pass != 3) return;
+            ObjClass* klass = (ObjClass*) *slot;
+            takeU32(loader);
+            //Every instance made from the class is allocated this big, so a damaged hint can't be let through.
+            uint32_t fieldHint = takeU32(loader);
+            if(fieldHint > UINT16_MAX) corrupt(loader, "Bad class.");
+            klass->fieldHint = loader->error == NULL ? (int) fieldHint : 0;
+            uint32_t methods = takeU32(loader);
+            for(uint32_t i = 0; i < methods && loader->error == NULL; i++){
+                ObjString* name = (ObjString*) takeRef(loader, OBJ_STRING, false);
+                Value method = takeValue(loader);
+                if(!IS_FUNCTION(method)) corrupt(loader, "Method is not a function.");
+                if(loader->error == NULL) tableSet(&klass->methods, name, method);
+            }
+            return;
+        }
+        case OBJ_INSTANCE: {
+            if(pass == 2){
+                ObjClass* klass = (ObjClass*) takeRef(loader, OBJ_CLASS, false);
+                if(klass != NULL) *slot = (Obj*) newInstance(klass);
+                return;
+            }
+            if(pass != 3) return;
+            ObjInstance* instance = (ObjInstance*) *slot;
+            takeU32(loader);
+            uint32_t fieldCount = takeU32(loader);
+            for(uint32_t i = 0; i < fieldCount && loader->error == NULL; i++){
+                ObjString* name = (ObjString*) takeRef(loader, OBJ_STRING, false);
+                Value value = takeValue(loader);
+                if(loader->error != NULL) return;
+                if(shapeFieldOffset(instance->shape, name) != -1){
+                    corrupt(loader, "Instance has the same field twice.");
+                    return;
+                }
+                instanceAddField(instance, shapeTransition(instance->shape, name), value);
+            }
+            return;
+        }
+        case OBJ_BOUND_METHOD: {
+            if(pass == 1){
+                *slot = (Obj*) newBoundMethod(NIL_VAL, NULL);
+                return;
+            }
+            if(pass != 3) return;
+            ObjBoundMethod* bound = (ObjBoundMethod*) *slot;
+            bound->receiver = takeValue(loader);
+            bound->method = (ObjFunction*) takeRef(loader, OBJ_FUNCTION, false);
+            return;
+        }
+        case OBJ_FIBER: {
+            if(pass == 1){
+                *slot = (Obj*) newFiber();
+                return;
+            }
+            if(pass != 3) return;
+            ObjFiber* fiber = (ObjFiber*) *slot;
+            FiberState state = takeU32(loader);
+            if(state != FIBER_DONE && state != FIBER_FAILED) corrupt(loader, "Fiber has not finished.");
+            fiber->state = state;
+            fiber->result = takeValue(loader);
+            return;
+        }
+        default:
+            corrupt(loader, "Unknown object type.");
+            return;
+    }
+}
+
+// A function's constants have to pass before it can, so keep going round until nothing changes.
+static void verifyLoaded(Loader* loader){
+    bool progress = true;
+    uint32_t pending = 1;
+    while(progress && pending > 0 && loader->error == NULL){
+        progress = false;
+        pending = 0;
+        for(uint32_t i = 0; i < loader->objectCount; i++){
+            Obj* object = loader->objects[i];
+            if(object->type != OBJ_FUNCTION || ((ObjFunction*) object)->verified) continue;
+            //Lazy ones have no code yet, they go through the verifier when they are first called.
+            if(((ObjFunction*) object)->source != NULL) continue;
+
+            ObjFunction* function = (ObjFunction*) object;
+            bool ready = true;
+            for(int c = 0; c < function->chunk.constants.count; c++){
+                Value constant = function->chunk.constants.values[c];
+                if(IS_FUNCTION(constant) && !AS_FUNCTION(constant)->verified &&
+                   AS_FUNCTION(constant)->source == NULL) ready = false;
+            }
+            if(!ready){
+                pending++;
+                continue;
+            }
+            VerifyResult result = verifyFunction(function);
+            if(!result.ok){
+                corrupt(loader, result.message);
+                return;
+            }
+            finalizeChunk(&function->chunk);
+            progress = true;
+        }
+    }
+    if(pending > 0) corrupt(loader, "Functions refer to each other in a cycle.");
+}
+
+// Bytecode uses slot numbers, so the image's globals have to land in the same slots it had them in.
+// Pass zero checks every slot the VM has already given out holds the same name in the image, before we
+// change anything. Pass one gives out the rest, which the verifier needs to see. Pass two sets the values.
+static void loadGlobals(Loader* loader, ImageHeader* header, int pass){
+    loader->offset = header->globalsOffset;
+    for(uint32_t slot = 0; slot < header->globalCount && loader->error == NULL; slot++){
+        ObjString* name = (ObjString*) takeRef(loader, OBJ_STRING, false);
+        Value value = takeValue(loader);
+        if(loader->error != NULL) return;
+        if(pass == 0){
+            Value existing;
+            bool known = tableGet(&vm.globalNames, name, &existing);
+            if((int) slot < vm.globalValues.count ? globalName(slot) != name : known){
+                corrupt(loader, "Image globals don't match this VM's.");
+            }
+        } else if(pass == 1){
+            if(resolveGlobal(name) != (int) slot) corrupt(loader, "Image names a global twice.");
+        } else {
+            vm.globalValues.values[slot] = value;
+        }
+    }
+}
+
+static void loadImage(Loader* loader){
+    ImageHeader header;
+    const uint8_t* bytes = take(loader, sizeof(header));
+    if(bytes == NULL) return;
+    memcpy(&header, bytes, sizeof(header));
+    if(memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) { corrupt(loader, "Not a Bnuuy image."); return; }
+    if(header.version != IMAGE_VERSION) { corrupt(loader, "Image is from a different version."); return; }
+    if(header.byteOrder != IMAGE_BYTE_ORDER) { corrupt(loader, "Image was made on a machine with a different byte order."); return; }
+    if(header.tableOffset > loader->size ||
+       (loader->size - header.tableOffset) / sizeof(uint64_t) < header.objectCount ||
+       header.globalsOffset > loader->size){
+        { corrupt(loader, "Image is truncated."); return; }
+    }
+
+    loader->objectCount = header.objectCount;
+    loader->objects = calloc(header.objectCount > 0 ? header.objectCount : 1, sizeof(Obj*));
+    if(loader->objects == NULL) exit(1);
+
+    const uint8_t* table = loader->bytes + header.tableOffset;
+    for(int pass = 0; pass < 4 && loader->error == NULL; pass++){
+        for(uint32_t i = 0; i < header.objectCount && loader->error == NULL; i++){
+            uint64_t offset;
+            memcpy(&offset, table + sizeof(uint64_t) * i, sizeof(offset));
+            if(offset > loader->size) { corrupt(loader, "Image is truncated."); return; }
+            loader->offset = offset;
+            loadRecord(loader, i, pass);
+        }
+    }
+    for(uint32_t i = 0; i < header.objectCount && loader->error == NULL; i++){
+        if(loader->objects[i] == NULL) corrupt(loader, "Bad object record.");
+    }
+
+    if(loader->error == NULL) loadGlobals(loader, &header, 0);
+    if(loader->error == NULL) loadGlobals(loader, &header, 1);
+    if(loader->error == NULL) verifyLoaded(loader);
+    if(loader->error == NULL) loadGlobals(loader, &header, 2);
+}
+
+bool loadSnapshot(const char* path){
+    int file = open(path, O_RDONLY);
+    struct stat info;
+    if(file < 0 || fstat(file, &info) != 0 || info.st_size == 0){
+        fprintf(stderr, "Can't load image %s: Couldn't open the image file.\n", path);
+        if(file >= 0) close(file);
+        return false;
+    }
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(mapping == MAP_FAILED){
+        fprintf(stderr, "Can't load image %s: Couldn't map the image file.\n", path);
+        return false;
+    }
+
+    //Like a compile worker, the loader allocates into a heap of its own so no collection can start
+    //while half the objects are only reachable from the loader's table.
+    if(vm.gcPhase != GC_IDLE) collectGarbage();
+    LocalHeap heap;
+    initLocalHeap(&heap);
+    localHeap = &heap;
+
+    Loader loader = { mapping, info.st_size, 0, NULL, NULL, 0 };
+    loadImage(&loader);
+
+    localHeap = NULL;
+    adoptLocalHeap(&heap);
+    free(loader.objects);
+    munmap(mapping, info.st_size);
+
+    if(loader.error != NULL){
+        fprintf(stderr, "Can't load image %s: %s\n", path, loader.error);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef bnuuy_snapshot_h
+#define bnuuy_snapshot_h
+
+#include "Bnuuy_common.h"
+
+// VM IMAGES
+// A snapshot of everything the scripts have set up: the globals and every object reachable from them,
+// compiled functions included. Loading one puts the VM back in that state without compiling or running
+// anything, so a restart skips straight past initialisation.
+//
+// The image is relocatable, nothing in it is a pointer. Objects refer to each other by their index in
+// the object table, and the table says where each object's record starts in the file. The loader maps
+// the file and rebuilds the objects straight out of the mapping. Inline caches and shapes are not saved,
+// they fill back in as the code runs. Functions are verified again on the way in like freshly compiled ones,
+// except lazy functions that were never called, which are saved as source and stay lazy.
+//
+// Images are tied to the machine's byte order and to the natives the VM defines, both are checked on load.
+
+bool saveSnapshot(const char* path);   // Call once the fibers have finished. Reports why on stderr if it fails.
+bool loadSnapshot(const char* path);   // Call on a VM that has not run anything yet.
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_table.h"
+#include "Bnuuy_value.h"
+
+// Grow once the table is 3/4 full (tombstones included).
+#define TABLE_MAX_LOAD_NUM 3
+#define TABLE_MAX_LOAD_DEN 4
+
+void initTable(Table* table){
+    table->count    = 0;
+    table->capacity = 0;
+    table->entries  = NULL;
+}
+
+void freeTable(Table* table){
+    FREE_ARRAY(MEM_TABLES, Entry, table->entries, table->capacity);
+    initTable(table);
+}
+
+// Linear probing. The capacity is a power of two so (index + 1) & mask wraps around.
+// Keys are interned, so once the hashes match a pointer comparison decides it.
+static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = key->hash & mask;
+    Entry* tombstone = NULL;
+
+    for(;;){
+        Entry* entry = &entries[index];
+        if(entry->key == NULL){
+            if(IS_NIL(entry->value)){
+                //Empty slot, reuse a tombstone we passed if we had one.
+                return tombstone != NULL ? tombstone : entry;
+            } else {
+                if(tombstone == NULL) tombstone = entry;
+            }
+        } else if(entry->key == key){
+            return entry;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void adjustCapacity(Table* table, int capacity){
+    Entry* entries = ALLOCATE(MEM_TABLES, Entry, capacity);
+    for(int i = 0; i < capacity; i++){
+        entries[i].key   = NULL;
+        entries[i].hash  = 0;
+        entries[i].value = NIL_VAL;
+    }
+
+    //Re-insert everything, dropping tombstones on the way.
+    table->count = 0;
+    for(int i = 0; i < table->capacity; i++){
+        Entry* entry = &table->entries[i];
+        if(entry->key == NULL) continue;
+
+        Entry* dest = findEntry(entries, capacity, entry->key);
+        dest->key   = entry->key;
+        dest->hash  = entry->hash;
+        dest->value = entry->value;
+        table->count++;
+    }
+
+    FREE_ARRAY(MEM_TABLES, Entry, table->entries, table->capacity);
+    table->entries  = entries;
+    table->capacity = capacity;
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value){
+    if(table->count == 0) return false;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if(entry->key == NULL) return false;
+
+    *value = entry->value;
+    return true;
+}
+
+/// @brief Insert or overwrite key in the table.
+/// @return true if the key was not in the table before.
+bool tableSet(Table* table, ObjString* key, Value value){
+    if((table->count + 1) * TABLE_MAX_LOAD_DEN > table->capacity * TABLE_MAX_LOAD_NUM){
+        int capacity = GROW_CAPACITY(table->capacity);
+        adjustCapacity(table, capacity);
+    }
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    bool isNewKey = entry->key == NULL;
+    //Only count truly empty slots, a reused tombstone is already counted.
+    if(isNewKey && IS_NIL(entry->value)) table->count++;
+
+    entry->key   = key;
+    entry->hash  = key->hash;
+    entry->value = value;
+    return isNewKey;
+}
+
+bool tableDelete(Table* table, ObjString* key){
+    if(table->count == 0) return false;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if(entry->key == NULL) return false;
+
+    //Leave a tombstone so probe sequences running through this slot keep going.
+    entry->key   = NULL;
+    entry->hash  = 0;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+void tableAddAll(Table* from, Table* to){
+    for(int i = 0; i < from->capacity; i++){
+        Entry* entry = &from->entries[i];
+        if(entry->key != NULL){
+            tableSet(to, entry->key, entry->value);
+        }
+    }
+}
+
+// Used by the string interner, the only place we have raw characters rather than an interned key.
+// The inline hash means we only dereference the key when it is very likely to be the one we want.
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash){
+    if(table->count == 0) return NULL;
+
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
+    for(;;){
+        Entry* entry = &table->entries[index];
+        if(entry->key == NULL){
+            //Stop at an empty non-tombstone slot.
+            if(IS_NIL(entry->value)) return NULL;
+        } else if(entry->hash == hash &&
+                  entry->key->length == length &&
+                  memcmp(entry->key->chars, chars, length) == 0){
+            return entry->key;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+// Same as tableFindString but for the string a + b, without building it first.
+ObjString* tableFindConcatenated(Table* table, ObjString* a, ObjString* b, uint32_t hash){
+    if(table->count == 0) return NULL;
+
+    int length = a->length + b->length;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
+    for(;;){
+        Entry* entry = &table->entries[index];
+        if(entry->key == NULL){
+            if(IS_NIL(entry->value)) return NULL;
+        } else if(entry->hash == hash &&
+                  entry->key->length == length &&
+                  memcmp(entry->key->chars, a->chars, a->length) == 0 &&
+                  memcmp(entry->key->chars + a->length, b->chars, b->length) == 0){
+            return entry->key;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+void markTable(Table* table){
+    for(int i = 0; i < table->capacity; i++){
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+// The intern table holds its strings weakly. Before sweeping, drop every string that nothing else reached.
+void tableRemoveWhite(Table* table){
+    for(int i = 0; i < table->capacity; i++){
+        Entry* entry = &table->entries[i];
+        if(entry->key != NULL && !entry->key->obj.isMarked){
+            tableDelete(table, entry->key);
+        }
+    }
+}
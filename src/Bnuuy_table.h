@@ -0,0 +1,33 @@
+#ifndef bnuuy_table_h
+#define bnuuy_table_h
+
+#include "Bnuuy_common.h"
+#include "Bnuuy_value.h"
+
+// Open addressing hash table keyed by interned strings.
+// Each entry keeps its own copy of the key hash so probing compares integers
+// and only touches the string itself when the hashes already match.
+typedef struct {
+    ObjString* key;         // NULL for an empty slot or a tombstone.
+    uint32_t hash;          // Copy of key->hash.
+    Value value;            // Tombstones are a NULL key with a true value.
+} Entry;
+
+typedef struct {
+    int count;              // Live entries + tombstones.
+    int capacity;           // Always a power of two so we can mask instead of divide.
+    Entry* entries;
+} Table;
+
+void initTable(Table* table);
+void freeTable(Table* table);
+bool tableGet(Table* table, ObjString* key, Value* value);
+bool tableSet(Table* table, ObjString* key, Value value);
+bool tableDelete(Table* table, ObjString* key);
+void tableAddAll(Table* from, Table* to);
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+ObjString* tableFindConcatenated(Table* table, ObjString* a, ObjString* b, uint32_t hash);
+void markTable(Table* table);
+void tableRemoveWhite(Table* table);
+
+#endif
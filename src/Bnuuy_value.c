@@ -1,11 +1,15 @@
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-#include "bnuuy_memory.h"
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
 #include "Bnuuy_value.h"
 
-void initValueArray(ValueArray* array){
+void initValueArray(ValueArray* array, MemSite site){
     array->capacity = 0;
     array->count    = 0;
+    array->site     = site;
     array->values   = NULL;
 }
 
@@ -13,7 +17,7 @@ void writeValueArray(ValueArray* array, Value value){
     if(array->capacity < array->count + 1){
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values   = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values   = GROW_ARRAY(array->site, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
@@ -21,11 +25,59 @@ void writeValueArray(ValueArray* array, Value value){
 }
 
 void freeValueArray(ValueArray* array){
-    FREE_ARRAY(Value, array->values, array->capacity);
-    initValueArray(array);
+    FREE_ARRAY(array->site, Value, array->values, array->capacity);
+    initValueArray(array, array->site);
+}
+
+static bool vectorsEqual(ObjVector* a, ObjVector* b){
+    if(a->length != b->length) return false;
+    for(int i = 0; i < a->length; i++){
+        if(a->elements[i] != b->elements[i]) return false;
+    }
+    return true;
+}
+
+// Two values are only equal if they share a type, except that an integer equals the double with the same value.
+// Strings are interned, so two equal strings are always the same object and comparing the pointers is enough.
+// That only holds for flattened ropes, OP_EQUAL flattens its operands before it gets here.
+// Vectors are equal when their elements are.
+bool valuesEqual(Value a, Value b){
+    if(a.type != b.type){
+        if(IS_NUMERIC(a) && IS_NUMERIC(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+        return false;
+    }
+    switch(a.type){
+        case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:       return true;
+        case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:       return AS_INT(a) == AS_INT(b);
+        case VAL_OBJ:
+            if(IS_VECTOR(a) && IS_VECTOR(b)) return vectorsEqual(AS_VECTOR(a), AS_VECTOR(b));
+            return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
+        default:            return false; //Unreachable
+    }
+}
+
+// The shortest form that reads back as the same double. Plain %g stops after six digits.
+static void printNumber(FILE* stream, double number){
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.15g", number);
+    if(strtod(buffer, NULL) != number) snprintf(buffer, sizeof(buffer), "%.17g", number);
+    fputs(buffer, stream);
 }
 
 void printValue(Value value){
-    //We need to switch here later?
-    printf("%g", AS_NUMBER(value));
-}
\ No newline at end of file
+    fprintValue(stdout, value);
+}
+
+void fprintValue(FILE* stream, Value value){
+    switch(value.type){
+        case VAL_BOOL:      fputs(AS_BOOL(value) ? "true" : "false", stream); break;
+        case VAL_NIL:       fputs("nil", stream); break;
+        case VAL_NUMBER:    printNumber(stream, AS_NUMBER(value)); break;
+        case VAL_INT:       fprintf(stream, "%" PRId64, AS_INT(value)); break;
+        case VAL_OBJ:       printObject(stream, value); break;
+        case VAL_UNDEFINED: fputs("<undefined>", stream); break;
+    }
+}
@@ -1,8 +1,16 @@
 #ifndef bnuuy_value_h
 #define bnuuy_value_h
 
+#include <stdio.h>
+
 #include "Bnuuy_common.h"
 
+// Heap allocated values live behind a pointer to their Obj header.
+// The full definitions live in Bnuuy_object.h
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
+
 // A value can no longer be a double, it was originally treated as a double entirely.
 // We are going to create a type for it
 //typedef double Value;
@@ -11,10 +19,13 @@
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER,
+    VAL_NUMBER,     // A double.
+    VAL_INT,        // A 64 bit integer. Arithmetic that overflows or leaves a fraction gives a VAL_NUMBER.
+    VAL_OBJ,        // Anything that lives on the heap (strings, ...)
+    VAL_UNDEFINED,  // Internal. Marks a global slot that has been resolved but not defined yet.
 } ValueType;
 
-//The struct implementing the 
+//The struct implementing the
 typedef struct {
     ValueType type;
     //C-type unions are a struct element or element of memory which takes the size in memory of the largest member of the union.
@@ -22,34 +33,54 @@ typedef struct {
     // So comparisons need to consider this.
     //The name 'as' allows it to be easily dereferenced simiariliy as a cast, making it easier to use
     // Ie Value.as.boolean
-    union { 
+    union {
         //Largest element is Double = 8b
         // |00000000|00000000|00000000|00000000|00000000|00000000|00000000|00000000|
         // ^ This is size of object in memory, enum ValueType has size 4b as int
         // A 'variable' or constant in bnuuy currently observes 12b even for a 1 bit bool. (?)
         bool boolean;
         double number;
+        int64_t integer;
+        Obj* obj;       // Pointer is also 8b on 64 bit, so the Value does not grow.
     } as;
 } Value;
 
+//Type checks
+#define IS_BOOL(value)          ((value).type == VAL_BOOL)
+#define IS_NIL(value)           ((value).type == VAL_NIL)
+#define IS_NUMBER(value)        ((value).type == VAL_NUMBER)
+#define IS_INT(value)           ((value).type == VAL_INT)
+#define IS_NUMERIC(value)       (IS_INT(value) || IS_NUMBER(value))
+#define IS_OBJ(value)           ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value)     ((value).type == VAL_UNDEFINED)
+
 //Default 'constructors'/casters
 #define BOOL_VAL(value)         ((Value){VAL_BOOL,      {.boolean = value}})
 #define NIL_VAL                 ((Value){VAL_NIL,       {.number = 0}})
 #define NUMBER_VAL(value)       ((Value){VAL_NUMBER,    {.number = value}})
+#define INT_VAL(value)          ((Value){VAL_INT,       {.integer = value}})
+#define OBJ_VAL(object)         ((Value){VAL_OBJ,       {.obj = (Obj*)object}})
+#define UNDEFINED_VAL           ((Value){VAL_UNDEFINED, {.number = 0}})
 
 //Default recasts/casts
 #define AS_BOOL(value)          ((value).as.boolean)
 #define AS_NUMBER(value)        ((value).as.number)
+#define AS_INT(value)           ((value).as.integer)
+#define AS_DOUBLE(value)        (IS_INT(value) ? (double) AS_INT(value) : AS_NUMBER(value))  // Either kind of number. Evaluates value twice.
+#define AS_OBJ(value)           ((value).as.obj)
 
 typedef struct {
     int capacity;
     int count;
+    MemSite site;       // What the memory stats count it as.
     Value* values;
 } ValueArray;
 
-void initValueArray(ValueArray* array);
+bool valuesEqual(Value a, Value b);
+void initValueArray(ValueArray* array, MemSite site);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+void fprintValue(FILE* stream, Value value);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,125 @@
+#include "Bnuuy_vector.h"
+
+// A lane is as many doubles as fit in VECTOR_ALIGN bytes. With GCC and Clang the arithmetic on lanes
+// becomes SSE or AVX instructions. Anything else gets one element lanes, and the loops are plain loops.
+#if defined(__GNUC__)
+typedef double Lanes __attribute__((vector_size(VECTOR_ALIGN), __may_alias__));
+typedef int64_t LaneMask __attribute__((vector_size(VECTOR_ALIGN)));
+#define LANES ((int)(VECTOR_ALIGN / sizeof(double)))
+// x in the lanes where mask is set, y in the rest.
+#define SELECT(mask, x, y) ((Lanes)(((LaneMask)(mask) & (LaneMask)(x)) | (~(LaneMask)(mask) & (LaneMask)(y))))
+#else
+typedef double Lanes;
+#define LANES 1
+#define SELECT(mask, x, y) ((mask) ? (x) : (y))
+#endif
+
+#define LOAD(p)         (*(const Lanes*)(p))
+#define STORE(p, v)     (*(Lanes*)(p) = (v))
+
+// On x86 every kernel is built twice, for plain x86-64 (SSE2) and for AVX. The loader picks one when the
+// program starts, which needs glibc's ifunc support.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__GLIBC__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define KERNEL __attribute__((target_clones("avx", "default")))
+#endif
+#endif
+#ifndef KERNEL
+#define KERNEL
+#endif
+
+// Each operator gets its own copy of the loops, so the operator is decided once per call and not per element.
+#define KERNELS(name, op) \
+    KERNEL static void name##Binary(double* out, const double* a, const double* b, int length){\
+        int i = 0;\
+        for(; i + LANES <= length; i += LANES) STORE(out + i, LOAD(a + i) op LOAD(b + i));\
+        for(; i < length; i++) out[i] = a[i] op b[i];\
+    }\
+    KERNEL static void name##Right(double* out, const double* a, double b, int length){\
+        int i = 0;\
+        for(; i + LANES <= length; i += LANES) STORE(out + i, LOAD(a + i) op b);\
+        for(; i < length; i++) out[i] = a[i] op b;\
+    }\
+    KERNEL static void name##Left(double* out, double a, const double* b, int length){\
+        int i = 0;\
+        for(; i + LANES <= length; i += LANES) STORE(out + i, a op LOAD(b + i));\
+        for(; i < length; i++) out[i] = a op b[i];\
+    }
+
+KERNELS(add, +)
+KERNELS(subtract, -)
+KERNELS(multiply, *)
+KERNELS(divide, /)
+
+void vectorBinary(VectorOp op, double* out, const double* a, const double* b, int length){
+    switch(op){
+        case VECTOR_ADD:        addBinary(out, a, b, length); return;
+        case VECTOR_SUBTRACT:   subtractBinary(out, a, b, length); return;
+        case VECTOR_MULTIPLY:   multiplyBinary(out, a, b, length); return;
+        case VECTOR_DIVIDE:     divideBinary(out, a, b, length); return;
+    }
+}
+
+void vectorScalar(VectorOp op, double* out, const double* a, double b, int length){
+    switch(op){
+        case VECTOR_ADD:        addRight(out, a, b, length); return;
+        case VECTOR_SUBTRACT:   subtractRight(out, a, b, length); return;
+        case VECTOR_MULTIPLY:   multiplyRight(out, a, b, length); return;
+        case VECTOR_DIVIDE:     divideRight(out, a, b, length); return;
+    }
+}
+
+void scalarVector(VectorOp op, double* out, double a, const double* b, int length){
+    switch(op){
+        case VECTOR_ADD:        addLeft(out, a, b, length); return;
+        case VECTOR_SUBTRACT:   subtractLeft(out, a, b, length); return;
+        case VECTOR_MULTIPLY:   multiplyLeft(out, a, b, length); return;
+        case VECTOR_DIVIDE:     divideLeft(out, a, b, length); return;
+    }
+}
+
+KERNEL void vectorNegate(double* out, const double* a, int length){
+    int i = 0;
+    for(; i + LANES <= length; i += LANES) STORE(out + i, -LOAD(a + i));
+    for(; i < length; i++) out[i] = -a[i];
+}
+
+KERNEL double vectorSum(const double* a, int length){
+    Lanes lanes = {0};
+    int i = 0;
+    for(; i + LANES <= length; i += LANES) lanes += LOAD(a + i);
+
+    _Alignas(VECTOR_ALIGN) double spill[LANES];
+    STORE(spill, lanes);
+    double total = 0;
+    for(int lane = 0; lane < LANES; lane++) total += spill[lane];
+    for(; i < length; i++) total += a[i];
+    return total;
+}
+
+// Each lane keeps the best it has seen. A NaN always wins and then nothing beats it, so it sticks.
+#define EXTREME(name, better) \
+    KERNEL double name(const double* a, int length){\
+        double best = a[0];\
+        int i = 0;\
+        if(length >= LANES){\
+            Lanes lanes = LOAD(a);\
+            for(i = LANES; i + LANES <= length; i += LANES){\
+                Lanes x = LOAD(a + i);\
+                lanes = SELECT((x better lanes) | (x != x), x, lanes);\
+            }\
+            _Alignas(VECTOR_ALIGN) double spill[LANES];\
+            STORE(spill, lanes);\
+            best = spill[0];\
+            for(int lane = 1; lane < LANES; lane++){\
+                if(spill[lane] better best || spill[lane] != spill[lane]) best = spill[lane];\
+            }\
+        }\
+        for(; i < length; i++){\
+            if(a[i] better best || a[i] != a[i]) best = a[i];\
+        }\
+        return best;\
+    }
+
+EXTREME(vectorMin, <)
+EXTREME(vectorMax, >)
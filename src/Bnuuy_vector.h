@@ -0,0 +1,30 @@
+#ifndef bnuuy_vector_h
+#define bnuuy_vector_h
+
+#include "Bnuuy_common.h"
+
+// VECTOR KERNELS
+// The loops behind vector values. They work on whole SIMD lanes of VECTOR_ALIGN bytes and finish the
+// leftovers one element at a time, so every array passed in must start on a VECTOR_ALIGN boundary.
+// On x86 each kernel is also built for AVX and the CPU picks when the program loads.
+#define VECTOR_ALIGN 32
+
+typedef enum {
+    VECTOR_ADD,
+    VECTOR_SUBTRACT,
+    VECTOR_MULTIPLY,
+    VECTOR_DIVIDE,
+} VectorOp;
+
+void vectorBinary(VectorOp op, double* out, const double* a, const double* b, int length);  // a[i] op b[i]
+void vectorScalar(VectorOp op, double* out, const double* a, double b, int length);        // a[i] op b
+void scalarVector(VectorOp op, double* out, double a, const double* b, int length);        // a op b[i]
+void vectorNegate(double* out, const double* a, int length);
+
+// Sums add up each lane separately and then the lanes, so the last bits can differ from a loop in order.
+// Min and max need at least one element, and a NaN anywhere makes the result NaN.
+double vectorSum(const double* a, int length);
+double vectorMin(const double* a, int length);
+double vectorMax(const double* a, int length);
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_verifier.h"
+#include "vm.h"
+
+// What follows each opcode in the byte stream.
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_LINE,           // 1 byte line number.
+    OPERAND_CONSTANT,       // 1 byte constant index.
+    OPERAND_NAME,           // 1 byte constant index, which must be a string.
+    OPERAND_GLOBAL,         // 1 byte global slot.
+    OPERAND_LOCAL,          // 1 byte slot in the frame.
+    OPERAND_CALL,           // 1 byte argument count.
+    OPERAND_COUNT,          // 1 byte element count.
+    OPERAND_JUMP,           // 2 byte forward offset.
+    OPERAND_LOOP,           // 2 byte backward offset.
+    OPERAND_PROPERTY,       // 1 byte name constant, 2 byte inline cache index.
+    OPERAND_REDUCTION,      // 1 byte Reduction.
+} OperandKind;
+
+static OperandKind operandKind(uint8_t instruction){
+    switch(instruction){
+        case OP_UPDATE_LINE:            return OPERAND_LINE;
+        case OP_CONSTANT:               return OPERAND_CONSTANT;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:             return OPERAND_GLOBAL;
+        case OP_DEFINE_GLOBAL_NAME:
+        case OP_GET_GLOBAL_NAME:
+        case OP_SET_GLOBAL_NAME:
+        case OP_CLASS:
+        case OP_METHOD:                 return OPERAND_NAME;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:              return OPERAND_LOCAL;
+        case OP_CALL:                   return OPERAND_CALL;
+        case OP_VECTOR:                 return OPERAND_COUNT;
+        case OP_PARALLEL_FOR:           return OPERAND_REDUCTION;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:          return OPERAND_JUMP;
+        case OP_LOOP:                   return OPERAND_LOOP;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:           return OPERAND_PROPERTY;
+        default:                        return OPERAND_NONE;
+    }
+}
+
+static int operandLength(OperandKind kind){
+    switch(kind){
+        case OPERAND_NONE:      return 0;
+        case OPERAND_JUMP:
+        case OPERAND_LOOP:      return 2;
+        case OPERAND_PROPERTY:  return 3;
+        default:                return 1;
+    }
+}
+
+int instructionLength(uint8_t instruction){
+    return 1 + operandLength(operandKind(instruction));
+}
+
+/// @brief How many values the instruction needs on the stack, and how it changes the depth.
+static void stackEffect(Chunk* chunk, int offset, int* needs, int* effect){
+    uint8_t instruction = chunk->code[offset];
+    switch(instruction){
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_DIVIDE:
+        case OP_MULTIPLY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_INDEX:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:                 *needs = 2; *effect = -1; return;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_NAME:
+        case OP_SET_LOCAL:
+        case OP_GET_PROPERTY:
+        case OP_JUMP_IF_FALSE:          *needs = 1; *effect = 0; return;
+        case OP_DUP:                    *needs = 1; *effect = 1; return;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_NAME:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_RETURN:                 *needs = 1; *effect = -1; return;
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_NAME:
+        case OP_GET_LOCAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_CLASS:                  *needs = 0; *effect = 1; return;
+        case OP_PARALLEL_FOR:           *needs = 3; *effect = -2; return;
+        case OP_VECTOR: {
+            int count = chunk->code[offset + 1];
+            *needs = count;
+            *effect = 1 - count;
+            return;
+        }
+        case OP_CALL: {
+            //Pops the callee and arguments, pushes the result.
+            int argCount = chunk->code[offset + 1];
+            *needs = argCount + 1;
+            *effect = -argCount;
+            return;
+        }
+        default:                        *needs = 0; *effect = 0; return;
+    }
+}
+
+static VerifyResult fail(int offset, const char* message){
+    return (VerifyResult){ false, offset, message, 0 };
+}
+
+/// @brief Whether the instruction casts the value on top of the stack to a function without looking.
+/// The compiler always pushes that function with the OP_CONSTANT just before, so we hold images to the same.
+static bool takesFunctionConstant(uint8_t instruction){
+    return instruction == OP_PARALLEL_FOR || instruction == OP_METHOD;
+}
+
+// Pass one. Walk the instructions in order, check each operand on its own and note where instructions start.
+static VerifyResult checkOperands(Chunk* chunk, bool* isStart){
+    int offset = 0;
+    while(offset < chunk->count){
+        uint8_t instruction = chunk->code[offset];
+        if(instruction >= OP_COUNT) return fail(offset, "Unknown opcode.");
+
+        OperandKind kind = operandKind(instruction);
+        int length = 1 + operandLength(kind);
+        if(offset + length > chunk->count) return fail(offset, "Operand runs past the end of the chunk.");
+        isStart[offset] = true;
+
+        uint8_t operand = length > 1 ? chunk->code[offset + 1] : 0;
+        switch(kind){
+            case OPERAND_CONSTANT:
+                if(operand >= chunk->constants.count) return fail(offset, "Constant index out of range.");
+                //Functions are verified when they are made, we only run functions that passed.
+                //Lazy ones are made without code and verified when they get some, on their first call.
+                if(IS_FUNCTION(chunk->constants.values[operand]) &&
+                   !AS_FUNCTION(chunk->constants.values[operand])->verified &&
+                   AS_FUNCTION(chunk->constants.values[operand])->source == NULL){
+                    return fail(offset, "Constant is an unverified function.");
+                }
+                break;
+            case OPERAND_NAME:
+            case OPERAND_PROPERTY:
+                if(operand >= chunk->constants.count) return fail(offset, "Constant index out of range.");
+                if(!IS_STRING(chunk->constants.values[operand])) return fail(offset, "Name constant is not a string.");
+                if(kind == OPERAND_PROPERTY){
+                    int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+                    if(cache >= chunk->cacheCount) return fail(offset, "Inline cache index out of range.");
+                }
+                break;
+            case OPERAND_REDUCTION:
+                if(operand >= REDUCE_COUNT) return fail(offset, "Unknown reduction.");
+                break;
+            case OPERAND_GLOBAL:
+                //Slots are only ever added, so one that exists now exists for good.
+                if(operand >= globalCount()) return fail(offset, "Global slot out of range.");
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+    return (VerifyResult){ true, 0, NULL, 0 };
+}
+
+// Pass two. Follow every path from the entry point, tracking the stack depth at each instruction.
+VerifyResult verifyChunk(Chunk* chunk, int arity){
+    if(chunk->count == 0) return fail(0, "Empty chunk.");
+
+    bool* isStart = ALLOCATE(MEM_COMPILER, bool, chunk->count);
+    int* depth = ALLOCATE(MEM_COMPILER, int, chunk->count);          // -1 until a path reaches the instruction.
+    int* worklist = ALLOCATE(MEM_COMPILER, int, chunk->count);
+    for(int i = 0; i < chunk->count; i++){
+        isStart[i] = false;
+        depth[i] = -1;
+    }
+
+    VerifyResult result = checkOperands(chunk, isStart);
+    if(!result.ok) goto done;
+
+    //The frame starts with the callee and its arguments.
+    int base = arity + 1;
+    int maxDepth = base;
+    int pending = 0;
+    if(takesFunctionConstant(chunk->code[0])){
+        result = fail(0, "Expected a function constant before this instruction.");
+        goto done;
+    }
+    depth[0] = base;
+    worklist[pending++] = 0;
+
+    while(pending > 0){
+        int offset = worklist[--pending];
+        int here = depth[offset];
+        uint8_t instruction = chunk->code[offset];
+        OperandKind kind = operandKind(instruction);
+        int next = offset + 1 + operandLength(kind);
+
+        int needs, effect;
+        stackEffect(chunk, offset, &needs, &effect);
+        //Slot zero belongs to the callee, nothing may pop into it except the final return.
+        if(here - needs < (instruction == OP_RETURN ? 0 : 1)){
+            result = fail(offset, "Stack underflow.");
+            goto done;
+        }
+        if(kind == OPERAND_LOCAL && chunk->code[offset + 1] >= here){
+            result = fail(offset, "Local slot is past the top of the stack.");
+            goto done;
+        }
+
+        int after = here + effect;
+        if(after > maxDepth) maxDepth = after;
+        if(maxDepth > UINT8_COUNT){
+            result = fail(offset, "Frame uses more than 256 stack slots.");
+            goto done;
+        }
+
+        //Work out where control goes next.
+        int targets[2];
+        int targetCount = 0;
+        if(kind == OPERAND_JUMP || kind == OPERAND_LOOP){
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            targets[targetCount++] = kind == OPERAND_JUMP ? next + jump : next - jump;
+        }
+        if(instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_LOOP){
+            targets[targetCount++] = next;
+        }
+
+        for(int i = 0; i < targetCount; i++){
+            int target = targets[i];
+            if(target == chunk->count){
+                result = fail(offset, "Execution can run off the end of the chunk.");
+                goto done;
+            }
+            if(target < 0 || target > chunk->count || !isStart[target]){
+                result = fail(offset, "Jump does not land on an instruction.");
+                goto done;
+            }
+            //Only reachable by falling through from the constant, a jump straight to it could skip the constant.
+            if(takesFunctionConstant(chunk->code[target]) &&
+               (target != next || instruction != OP_CONSTANT ||
+                !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]))){
+                result = fail(target, "Expected a function constant before this instruction.");
+                goto done;
+            }
+            if(depth[target] == -1){
+                depth[target] = after;
+                worklist[pending++] = target;
+            } else if(depth[target] != after){
+                result = fail(target, "Stack depth differs between paths.");
+                goto done;
+            }
+        }
+    }
+    result = (VerifyResult){ true, 0, NULL, maxDepth };
+
+done:
+    FREE_ARRAY(MEM_COMPILER, bool, isStart, chunk->count);
+    FREE_ARRAY(MEM_COMPILER, int, depth, chunk->count);
+    FREE_ARRAY(MEM_COMPILER, int, worklist, chunk->count);
+    return result;
+}
+
+VerifyResult verifyFunction(ObjFunction* function){
+    VerifyResult result = verifyChunk(&function->chunk, function->arity);
+    if(result.ok){
+        function->maxStack = result.maxDepth;
+        function->verified = true;
+    }
+    return result;
+}
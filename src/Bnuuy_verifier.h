@@ -0,0 +1,25 @@
+#ifndef bnuuy_verifier_h
+#define bnuuy_verifier_h
+
+#include "Bnuuy_chunk.h"
+#include "Bnuuy_object.h"
+
+// The verifier proves, once, everything run() would otherwise have to check on every instruction:
+//  - every opcode is one we know and its operands fit inside the chunk,
+//  - every constant, global slot, local slot and inline cache index is in range,
+//  - every jump lands on the start of an instruction,
+//  - the stack depth is the same on every path into an instruction, never drops
+//    below the frame, never passes UINT8_COUNT slots, and execution can not run off the end.
+// Functions that pass are marked verified and only verified functions are ever run.
+typedef struct {
+    bool ok;
+    int offset;             // Where it went wrong.
+    const char* message;
+    int maxDepth;           // Deepest the stack gets, counting the callee and arguments.
+} VerifyResult;
+
+int instructionLength(uint8_t instruction);     // The opcode and its operands, in bytes.
+VerifyResult verifyChunk(Chunk* chunk, int arity);
+VerifyResult verifyFunction(ObjFunction* function);
+
+#endif
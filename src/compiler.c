@@ -1,15 +1,18 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-#include "bnuuy_common.h"
+#include "Bnuuy_common.h"
 #include "compiler.h"
+#include "Bnuuy_debugger.h"
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_optimizer.h"
 #include "Bnuuy_value.h"
 #include "scanner.h"
-
-#ifdef DEBUG_PRINT_CODE
-#include "Bnuuy_debugger.h"
-#endif
-
+#include "Bnuuy_verifier.h"
+#include "vm.h"
 
 
 typedef struct {
@@ -33,32 +36,69 @@ typedef enum {
     PREC_PRIMARY,       // 
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 typedef struct {
     ParseFn prefix;
     ParseFn infix;
     Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk* compilingChunk;
+// A local variable lives in a stack slot of the function's call frame.
+// The compiler's locals array mirrors that window of the stack exactly.
+typedef struct {
+    Token name;
+    int depth;          // Scope depth, -1 while the initialiser is still being compiled.
+} Local;
+
+typedef enum {
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,   // A class's init() method, always returns this.
+    TYPE_METHOD,
+    TYPE_SCRIPT,        // The implicit function wrapping top level code.
+} FunctionType;
+
+// One of these per function being compiled, chained through enclosing for nested declarations.
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    ObjFunction* function;
+    FunctionType type;
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;     // 0 is global scope.
+} Compiler;
+
+// Tracks whether we are inside a class body, so 'this' can be rejected outside one.
+typedef struct ClassCompiler {
+    struct ClassCompiler* enclosing;
+} ClassCompiler;
+
+// Thread local so several workers can compile at once, see Bnuuy_parallel.c.
+static _Thread_local Parser parser;
+static _Thread_local Compiler* current = NULL;
+static _Thread_local ClassCompiler* currentClass = NULL;
+static _Thread_local FILE* errorStream = NULL;   // Where errors are reported.
+static bool lazyCompile = false;                 // Set before compiling starts, workers only read it.
+static bool printCode = false;                   // List every function as it is finished. Same rules.
 
 static Chunk* currentChunk(){
-    return compilingChunk;
+    return &current->function->chunk;
 }
 
 static void errorAt(Token* token, const char* error_message){
-    fprintf(stderr, "[line %d] Error", token->line);
+    //Only report the first error until we resynchronise.
+    if(parser.panicMode) return;
+    parser.panicMode = true;
+    fprintf(errorStream, "[line %d] Error", token->line);
 
     if(token->type == TOKEN_EOF){
-        fprintf(stderr, " at end.");
+        fprintf(errorStream, " at end.");
     } else if(token->type == TOKEN_ERROR) {
         // Don't report
     } else {
-        fprintf(stderr, "at '%.*s'", token->length, token->start);
+        fprintf(errorStream, "at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": '%s\n", error_message);
+    fprintf(errorStream, ": '%s\n", error_message);
     parser.hadError = true;
 }
 
@@ -72,6 +112,147 @@ static void errorAtCurrent(const char* error_message){
 }
 
 
+// Bytes of code a function will need, judged from its own source. Typical Bnuuy runs to about one token
+// every CHARS_PER_TOKEN characters and BYTES_PER_TOKEN bytes of code per token. Guessing high only costs
+// until finalizeChunk() trims it, guessing low costs a couple of doublings, so lean high.
+#define CHARS_PER_TOKEN 4
+#define BYTES_PER_TOKEN 3
+
+// One pass over the source sizes the function it starts in and every function nested inside, which each
+// get a chunk of their own. The nested ones are kept here in source order, which is the order the
+// compiler reaches their bodies in, so a body is only ever measured once however deep it sits.
+typedef struct {
+    const char* body;       // Just past the opening brace.
+    int size;
+} BodyEstimate;
+
+static _Thread_local BodyEstimate* bodyEstimates = NULL;
+static _Thread_local int bodyEstimateCount = 0;
+static _Thread_local int bodyEstimateCapacity = 0;
+static _Thread_local int nextBodyEstimate = 0;     // The first one the compiler has not reached yet.
+
+static void clearBodyEstimates(){
+    FREE_ARRAY(MEM_COMPILER, BodyEstimate, bodyEstimates, bodyEstimateCapacity);
+    bodyEstimates = NULL;
+    bodyEstimateCount = 0;
+    bodyEstimateCapacity = 0;
+    nextBodyEstimate = 0;
+}
+
+static int addBodyEstimate(const char* body){
+    if(bodyEstimateCapacity < bodyEstimateCount + 1){
+        int oldCapacity = bodyEstimateCapacity;
+        bodyEstimateCapacity = GROW_CAPACITY(oldCapacity);
+        bodyEstimates = GROW_ARRAY(MEM_COMPILER, BodyEstimate, bodyEstimates, oldCapacity, bodyEstimateCapacity);
+    }
+    bodyEstimates[bodyEstimateCount] = (BodyEstimate){ body, 0 };
+    return bodyEstimateCount++;
+}
+
+static bool isWordChar(char c){
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/// @brief Skip past a string or a # comment starting at c, so braces inside them don't count.
+static const char* skipText(const char* c){
+    if(*c == '"'){
+        c++;
+        while(*c != '\0' && *c != '"') c++;
+        return *c == '"' ? c + 1 : c;
+    }
+    while(*c != '\0' && *c != '\n') c++;
+    return c;
+}
+
+/// @brief Skip to the opening brace of a declaration's body, past its name, parameters or superclass.
+static const char* skipToBrace(const char* c){
+    while(*c != '\0' && *c != '{'){
+        c = (*c == '"' || *c == '#') ? skipText(c) : c + 1;
+    }
+    return c;
+}
+
+static int estimateBody(const char* body, const char** end);
+
+/// @brief Size each method of the class whose body opens at c, returns past the closing brace.
+static const char* estimateClass(const char* c){
+    if(*c == '{') c++;
+    while(*c != '\0' && *c != '}'){
+        if(*c == '"' || *c == '#'){
+            c = skipText(c);
+        } else if(*c == '{'){
+            int index = addBodyEstimate(c + 1);
+            bodyEstimates[index].size = estimateBody(c + 1, &c);
+        } else {
+            c++;
+        }
+    }
+    return *c == '}' ? c + 1 : c;
+}
+
+/// @brief Code size for the function whose body starts just after its opening brace at body, or for
+/// the script when body is the whole source. Ends past the closing brace and records every function
+/// nested inside on the way.
+static int estimateBody(const char* body, const char** end){
+    size_t characters = 0;
+    int depth = 0;
+    const char* c = body;
+    while(*c != '\0'){
+        //A comment makes no code, a string of any length is one constant.
+        if(*c == '"' || *c == '#'){
+            if(*c == '"') characters += CHARS_PER_TOKEN;
+            c = skipText(c);
+            continue;
+        }
+        if(isWordChar(*c)){
+            const char* word = c;
+            while(isWordChar(*c)) c++;
+            bool isFun = c - word == 3 && memcmp(word, "fun", 3) == 0;
+            bool isClass = c - word == 5 && memcmp(word, "class", 5) == 0;
+            if(!isFun && !isClass){
+                characters += c - word;
+                continue;
+            }
+            //Here it is only a constant and a definition, the body is sized on its own.
+            characters += 2 * CHARS_PER_TOKEN;
+            c = skipToBrace(c);
+            if(isClass){
+                c = estimateClass(c);
+            } else if(*c == '{'){
+                int index = addBodyEstimate(c + 1);
+                bodyEstimates[index].size = estimateBody(c + 1, &c);
+            }
+            continue;
+        }
+        if(*c == '{') depth++;
+        if(*c == '}' && --depth < 0){
+            c++;
+            break;
+        }
+        characters++;
+        c++;
+    }
+    *end = c;
+    size_t estimate = (characters / CHARS_PER_TOKEN + 1) * BYTES_PER_TOKEN;
+    //Past 64k the jumps can't reach anyway.
+    return estimate > UINT16_MAX ? UINT16_MAX : (int) estimate;
+}
+
+/// @brief Code size for the body starting at body. Taken from the pass over the enclosing source when
+/// that reached it, otherwise this starts a fresh pass there.
+static int estimateCodeSize(const char* body){
+    //Bodies we passed without compiling belong to lazy functions.
+    while(nextBodyEstimate < bodyEstimateCount && bodyEstimates[nextBodyEstimate].body < body){
+        nextBodyEstimate++;
+    }
+    if(nextBodyEstimate < bodyEstimateCount && bodyEstimates[nextBodyEstimate].body == body){
+        return bodyEstimates[nextBodyEstimate++].size;
+    }
+    clearBodyEstimates();
+    const char* end;
+    return estimateBody(body, &end);
+}
+
 static void advance(){
     parser.previous = parser.current;
     for (;;) {
@@ -92,15 +273,51 @@ static void consume(TokenType type, const char* message){
     errorAtCurrent(message);
 }
 
-//Print out the bytecode.
+static bool check(TokenType type){
+    return parser.current.type == type;
+}
+
+//Consume the next token only if it is the one we are after.
+static bool match(TokenType type){
+    if(!check(type)) return false;
+    advance();
+    return true;
+}
+
+//Print out the bytecode. It is tagged with the line of the token we just consumed, for runtime errors.
 static void emitByte(uint8_t byte){
-    writeChunk(currentChunk(), byte);
+    writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
 //Helper function for multiple bytes
 static void emitBytes(uint8_t byte1, uint8_t byte2){
-    emitByte(byte1);
-    emitByte(byte2);
+    uint8_t bytes[] = { byte1, byte2 };
+    writeChunkBytes(currentChunk(), bytes, 2, parser.previous.line);
+}
+
+// Jumps carry a 16 bit offset, patched in once we know where they land.
+static int emitJump(uint8_t instruction){
+    uint8_t bytes[] = { instruction, 0xff, 0xff };
+    writeChunkBytes(currentChunk(), bytes, 3, parser.previous.line);
+    return currentChunk()->count - 2;
+}
+
+static void patchJump(int offset){
+    // -2 to adjust for the bytecode for the jump offset itself.
+    int jump = currentChunk()->count - offset - 2;
+    if(jump > UINT16_MAX){
+        error("Too much code to jump over.");
+    }
+    currentChunk()->code[offset]     = (jump >> 8) & 0xff;
+    currentChunk()->code[offset + 1] = jump & 0xff;
+}
+
+static void emitLoop(int loopStart){
+    // +3 to also jump back over the OP_LOOP and its own operand.
+    int offset = currentChunk()->count - loopStart + 3;
+    if(offset > UINT16_MAX) error("Loop body too large.");
+    uint8_t bytes[] = { OP_LOOP, (offset >> 8) & 0xff, offset & 0xff };
+    writeChunkBytes(currentChunk(), bytes, 3, parser.previous.line);
 }
 
 static int makeConstant(Value constantValue){
@@ -116,30 +333,114 @@ static void emitConstant(Value constantValue){
     emitBytes(OP_CONSTANT, makeConstant(constantValue));
 }
 
+static uint8_t identifierConstant(Token* name){
+    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+}
+
+// Property accesses carry the name and their own inline cache slot.
+static void emitPropertyOp(uint8_t instruction, uint8_t name){
+    int cache = addInlineCache(currentChunk());
+    if(cache > UINT16_MAX){
+        error("Too many property accesses in one function.");
+    }
+    uint8_t bytes[] = { instruction, name, (cache >> 8) & 0xff, cache & 0xff };
+    writeChunkBytes(currentChunk(), bytes, 4, parser.previous.line);
+}
+
+// Falling off the end of a function returns nil.
 static void emitReturn(){
+    if(current->type == TYPE_INITIALIZER){
+        emitBytes(OP_GET_LOCAL, 0);
+    } else {
+        emitByte(OP_NIL);
+    }
     emitByte(OP_RETURN);
 }
 
-static void endCompiler(){
+static void initCompiler(Compiler* compiler, FunctionType type){
+    compiler->enclosing = current;
+    //Set to NULL first, newFunction() can set off the GC which walks the compiler chain.
+    compiler->function = NULL;
+    compiler->type = type;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
+    current = compiler;
+    compiler->function = newFunction();
+    if(type != TYPE_SCRIPT){
+        current->function->name = copyString(parser.previous.start, parser.previous.length);
+    }
+
+    //Slot zero holds the function being called, the user can never name it.
+    //In methods it holds the receiver instead, and is named this.
+    Local* local = &current->locals[current->localCount++];
+    local->depth = 0;
+    if(type != TYPE_FUNCTION && type != TYPE_SCRIPT){
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
+}
+
+static ObjFunction* endCompiler(){
     emitReturn();
-#ifdef DEBUG_PRINT_CODE
-    //If we haven't had an error, disassemble the chunk
+    ObjFunction* function = current->function;
+
+    //Nothing runs without passing the verifier, optimized or not. If our own output fails it is a bug in here.
     if(!parser.hadError){
-        disassembleChunk(currentChunk(), "code");
+        optimizeChunk(&function->chunk);
+        VerifyResult result = verifyFunction(function);
+        if(!result.ok){
+            fprintf(errorStream, "Internal error: bytecode failed verification at %04d: %s\n", result.offset, result.message);
+            parser.hadError = true;
+        }
+    }
+    finalizeChunk(&function->chunk);
+    //No longer a compiler root, so what went into it since it was last traced has to be looked at now.
+    gcRescan((Obj*)function);
+    if(current->type != TYPE_SCRIPT){
+        LOCK_SHARED();
+        vm.functionsCompiled++;
+        UNLOCK_SHARED();
+    }
+    //If we haven't had an error, disassemble the chunk
+    if(printCode && !parser.hadError){
+        //Keep each listing in one piece when workers are printing at the same time.
+        LOCK_SHARED();
+        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        UNLOCK_SHARED();
+    }
+    current = current->enclosing;
+    return function;
+}
+
+static void beginScope(){
+    current->scopeDepth++;
+}
+
+// Leaving a block pops its locals off the stack.
+static void endScope(){
+    current->scopeDepth--;
+    while(current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth){
+        emitByte(OP_POP);
+        current->localCount--;
     }
-#endif
 }
 
 
 //          PRATT PARSER
 
 static void expression();
+static void statement();
+static void declaration();
+static void varDeclaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
 
 
-static void binary(){
+static void binary(bool canAssign){
     TokenType operatorType = parser.previous.type;
     //Determine which precedence is appropriate 
     // Are we adding, dividing, something else?
@@ -152,6 +453,13 @@ static void binary(){
         case TOKEN_MINUS:           emitByte(OP_SUBTRACT); break;
         case TOKEN_SLASH:           emitByte(OP_DIVIDE); break;
         case TOKEN_STAR:            emitByte(OP_MULTIPLY); break;
+        //a != b is !(a == b), a >= b is !(a < b) and so on.
+        case TOKEN_BANG_EQUAL:      emitBytes(OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:     emitByte(OP_EQUAL); break;
+        case TOKEN_GREATER:         emitByte(OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL:   emitBytes(OP_LESS, OP_NOT); break;
+        case TOKEN_LESSER:          emitByte(OP_LESS); break;
+        case TOKEN_LESSER_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
         default:                    return; //unreachable
     }
 }
@@ -166,7 +474,7 @@ static void expression() {
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
-static void unary() {
+static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     
     //Compile the operand ie: we can have -(1+2)
@@ -175,66 +483,312 @@ static void unary() {
     //Compile the expression to bytecode
     switch(operatorType){
         case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:  emitByte(OP_NOT); break;
         default: return; //Unreachable
     }
 }
 
-static void grouping() {
+// LOCALS
+
+static bool identifiersEqual(Token* a, Token* b){
+    if(a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+// Walk backwards so inner declarations shadow outer ones. The index is the stack slot.
+static int resolveLocal(Compiler* compiler, Token* name){
+    for(int i = compiler->localCount - 1; i >= 0; i--){
+        Local* local = &compiler->locals[i];
+        if(identifiersEqual(name, &local->name)){
+            if(local->depth == -1){
+                error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void addLocal(Token name){
+    if(current->localCount == UINT8_COUNT){
+        error("Too many local variables in function.");
+        return;
+    }
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+}
+
+// Locals are declared when the name is seen and only usable once initialised.
+static void declareVariable(Token* name){
+    //Globals are late-bound, nothing to do.
+    if(current->scopeDepth == 0) return;
+
+    for(int i = current->localCount - 1; i >= 0; i--){
+        Local* local = &current->locals[i];
+        if(local->depth != -1 && local->depth < current->scopeDepth) break;
+        if(identifiersEqual(name, &local->name)){
+            error("Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(*name);
+}
+
+static void markInitialized(){
+    if(current->scopeDepth == 0) return;
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+// GLOBALS
+// A global's name is turned into a slot in vm.globalValues here, at compile time,
+// so reading or writing it at runtime is a single indexed load or store.
+// The slot operand is one byte; once those run out, names fall back to being
+// late-bound and looked up by name when the instruction runs.
+// A lazy body can be compiled by a parallel for worker while the others run, and they read the global
+// slots and names without a lock. Adding a slot there could move both under them, so a name that has
+// no slot yet is late-bound instead.
+static void emitGlobalOp(uint8_t slotOp, uint8_t nameOp, Token* name){
+    ObjString* string = copyString(name->start, name->length);
+    int slot = exec.isWorker ? findGlobal(string) : resolveGlobal(string);
+    if(slot != -1 && slot <= UINT8_MAX){
+        emitBytes(slotOp, (uint8_t) slot);
+    } else {
+        emitBytes(nameOp, makeConstant(OBJ_VAL(string)));
+    }
+}
+
+// A local's value is already sitting on the stack, a global's value gets stored in its slot.
+static void defineVariable(Token* name){
+    if(current->scopeDepth > 0){
+        markInitialized();
+        return;
+    }
+    emitGlobalOp(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_NAME, name);
+}
+
+static void namedVariable(Token name, bool canAssign){
+    int slot = resolveLocal(current, &name);
+    if(canAssign && match(TOKEN_EQUAL)){
+        expression();
+        if(slot != -1){
+            emitBytes(OP_SET_LOCAL, (uint8_t) slot);
+        } else {
+            emitGlobalOp(OP_SET_GLOBAL, OP_SET_GLOBAL_NAME, &name);
+        }
+    } else {
+        if(slot != -1){
+            emitBytes(OP_GET_LOCAL, (uint8_t) slot);
+        } else {
+            emitGlobalOp(OP_GET_GLOBAL, OP_GET_GLOBAL_NAME, &name);
+        }
+    }
+}
+
+static void variable(bool canAssign) {
+    namedVariable(parser.previous, canAssign);
+}
+
+// this is just a local in slot zero of a method.
+static void this_(bool canAssign) {
+    if(currentClass == NULL){
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+    variable(false);
+}
+
+static void dot(bool canAssign){
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(&parser.previous);
+
+    if(canAssign && match(TOKEN_EQUAL)){
+        expression();
+        emitPropertyOp(OP_SET_PROPERTY, name);
+    } else {
+        emitPropertyOp(OP_GET_PROPERTY, name);
+    }
+}
+
+// Short circuit. If the left side is falsey it is the result and the right side is skipped.
+static void and_(bool canAssign){
+    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    parsePrecedence(PREC_AND);
+    patchJump(endJump);
+}
+
+static void or_(bool canAssign){
+    int elseJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(OP_JUMP);
+    patchJump(elseJump);
+    emitByte(OP_POP);
+    parsePrecedence(PREC_OR);
+    patchJump(endJump);
+}
+
+static uint8_t argumentList(){
+    uint8_t argCount = 0;
+    if(!check(TOKEN_RIGHT_PAREN)){
+        do {
+            expression();
+            if(argCount == 255){
+                error("Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while(match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+// The callee is already on the stack, the arguments go on top of it and become the callee's first locals.
+static void call(bool canAssign){
+    uint8_t argCount = argumentList();
+    emitBytes(OP_CALL, argCount);
+}
+
+// [a, b, c] makes a vector of the numbers the elements come to.
+static void vector(bool canAssign){
+    uint8_t count = 0;
+    if(!check(TOKEN_RIGHT_BRACKET)){
+        do {
+            expression();
+            if(count == 255){
+                error("Can't have more than 255 elements in a vector literal.");
+            }
+            count++;
+        } while(match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after vector elements.");
+    emitBytes(OP_VECTOR, count);
+}
+
+// v[i], the vector is already on the stack. Vectors never change, so there is nothing to assign to.
+static void subscript(bool canAssign){
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    emitByte(OP_INDEX);
+}
+
+static void grouping(bool canAssign) {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after an expression to end a grouping.");
 }
 
 //Number expression
-static void number() {
+// Literals without a decimal point are integers, unless they are too big for 64 bits.
+static void number(bool canAssign) {
+    if(memchr(parser.previous.start, '.', parser.previous.length) == NULL){
+        errno = 0;
+        long long value = strtoll(parser.previous.start, NULL, 10);
+        if(errno != ERANGE){
+            emitConstant(INT_VAL((int64_t) value));
+            return;
+        }
+    }
     double value = strtod(parser.previous.start, NULL);
     emitConstant(NUMBER_VAL(value));
 }
 
+//String expression, trim the quotes off either end.
+static void string(bool canAssign) {
+    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+//true, false and nil have their own instructions rather than taking up a constant.
+static void literal(bool canAssign) {
+    switch(parser.previous.type){
+        case TOKEN_FALSE:   emitByte(OP_FALSE); break;
+        case TOKEN_NIL:     emitByte(OP_NIL); break;
+        case TOKEN_TRUE:    emitByte(OP_TRUE); break;
+        default: return; //Unreachable
+    }
+}
+
+
+// PARALLEL FOR
+//   for sum (i = start, end) expression
+// evaluates expression for every whole i from start up to but not including end, spread over every core,
+// and combines the values with sum, min or max. The expression becomes a function of i of its own, so like
+// any other function it can see its parameter and globals but not the locals around it.
+static void parallelFor(bool canAssign){
+    consume(TOKEN_IDENTIFIER, "Expect sum, min or max after 'for'.");
+    Token name = parser.previous;
+    Reduction reduction = REDUCE_SUM;
+    if(name.length == 3 && memcmp(name.start, "sum", 3) == 0) reduction = REDUCE_SUM;
+    else if(name.length == 3 && memcmp(name.start, "min", 3) == 0) reduction = REDUCE_MIN;
+    else if(name.length == 3 && memcmp(name.start, "max", 3) == 0) reduction = REDUCE_MAX;
+    else error("Expect sum, min or max after 'for'.");
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after the reduction.");
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token index = parser.previous;
+    consume(TOKEN_EQUAL, "Expect '=' after loop variable.");
+    expression();
+    consume(TOKEN_COMMA, "Expect ',' between the start and end of the range.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after the range.");
+
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION);
+    current->function->name = copyString("for body", 8);
+    beginScope();
+    current->function->arity = 1;
+    declareVariable(&index);
+    defineVariable(&index);
+    expression();
+    emitByte(OP_RETURN);
+    ObjFunction* body = endCompiler();
+
+    emitConstant(OBJ_VAL(body));
+    emitBytes(OP_PARALLEL_FOR, (uint8_t) reduction);
+}
 
 // PARSE RULES. 
 // EACH TOKENTYPE has a set of RULES determining how to HANDLE it based on if it is an infix, postfix, prefix operator. It points to the instruction to compile the instruction.
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]      = {grouping,    NULL,       PREC_NONE},
+    [TOKEN_LEFT_PAREN]      = {grouping,    call,       PREC_CALL},
     [TOKEN_RIGHT_PAREN]     = {NULL,        NULL,       PREC_NONE},
     [TOKEN_LEFT_BRACE]      = {NULL,        NULL,       PREC_NONE},
     [TOKEN_RIGHT_BRACE]     = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_LEFT_BRACKET]    = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_LEFT_BRACKET]    = {vector,      subscript,  PREC_CALL},
     [TOKEN_RIGHT_BRACKET]   = {NULL,        NULL,       PREC_NONE},
     [TOKEN_COMMA]           = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_DOT]             = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_DOT]             = {NULL,        dot,        PREC_CALL},
     [TOKEN_MINUS]           = {unary,       binary,     PREC_TERM},
     [TOKEN_PLUS]            = {NULL,        binary,     PREC_TERM},
     [TOKEN_SEMICOLON]       = {NULL,        NULL,       PREC_NONE},
     [TOKEN_SLASH]           = {NULL,        binary,     PREC_FACTOR},
     [TOKEN_STAR]            = {NULL,        binary,     PREC_FACTOR},
-    [TOKEN_BANG]            = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_BANG]            = {unary,       NULL,       PREC_NONE},
     [TOKEN_BANG_BANG]       = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_BANG_EQUAL]      = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_BANG_EQUAL]      = {NULL,        binary,     PREC_EQUALITY},
     [TOKEN_EQUAL]           = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_EQUAL_EQUAL]     = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_GREATER]         = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_GREATER_EQUAL]   = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_LESSER]          = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_LESSER_EQUAL]    = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_IDENTIFIER]      = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_STRING]          = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_EQUAL_EQUAL]     = {NULL,        binary,     PREC_EQUALITY},
+    [TOKEN_GREATER]         = {NULL,        binary,     PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL]   = {NULL,        binary,     PREC_COMPARISON},
+    [TOKEN_LESSER]          = {NULL,        binary,     PREC_COMPARISON},
+    [TOKEN_LESSER_EQUAL]    = {NULL,        binary,     PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]      = {variable,    NULL,       PREC_NONE},
+    [TOKEN_STRING]          = {string,      NULL,       PREC_NONE},
     [TOKEN_NUMBER]          = {number,      NULL,       PREC_NONE},
-    [TOKEN_AND]             = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_AND]             = {NULL,        and_,       PREC_AND},
     [TOKEN_CLASS]           = {NULL,        NULL,       PREC_NONE},
     [TOKEN_ELSE]            = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_FALSE]           = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_FOR]             = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_FALSE]           = {literal,     NULL,       PREC_NONE},
+    [TOKEN_FOR]             = {parallelFor, NULL,       PREC_NONE},
     [TOKEN_FUN]             = {NULL,        NULL,       PREC_NONE},
     [TOKEN_IF]              = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_NIL]             = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_OR]              = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_NIL]             = {literal,     NULL,       PREC_NONE},
+    [TOKEN_OR]              = {NULL,        or_,        PREC_OR},
     [TOKEN_PRINT]           = {NULL,        NULL,       PREC_NONE},
     [TOKEN_RETURN]          = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_THIS]            = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_THIS]            = {this_,       NULL,       PREC_NONE},
     [TOKEN_SUPER]           = {NULL,        NULL,       PREC_NONE},
-    [TOKEN_TRUE]            = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_TRUE]            = {literal,     NULL,       PREC_NONE},
     [TOKEN_VAR]             = {NULL,        NULL,       PREC_NONE},
     [TOKEN_WHILE]           = {NULL,        NULL,       PREC_NONE},
+    [TOKEN_YIELD]           = {NULL,        NULL,       PREC_NONE},
     [TOKEN_ERROR]           = {NULL,        NULL,       PREC_NONE},
     [TOKEN_EOF]             = {NULL,        NULL,       PREC_NONE},
 };
@@ -253,13 +807,19 @@ static void parsePrecedence(Precedence precedence){
         return;
     }
     //Execute the prefix rule.
-    prefixRule();
+    //Only a low precedence expression can be the target of an assignment, so a * b = c is an error.
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    prefixRule(canAssign);
 
     //Read the following tokens, then execute any infix rules.
     while(precedence <= getRule(parser.current.type)->precedence){
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+        infixRule(canAssign);
+    }
+
+    if(canAssign && match(TOKEN_EQUAL)){
+        error("Invalid assignment target.");
     }
 }
 
@@ -268,18 +828,454 @@ static ParseRule* getRule(TokenType type){
 }
 
 
+//          STATEMENTS
+
+static void block(){
+    while(!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)){
+        declaration();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// Compile a function body with its own compiler, then leave the finished function as a constant.
+// The parameter list and body, compiled into the function current is building.
+static void parametersAndBody(){
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if(!check(TOKEN_RIGHT_PAREN)){
+        do {
+            current->function->arity++;
+            if(current->function->arity > 255){
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            Token name = parser.previous;
+            declareVariable(&name);
+            defineVariable(&name);
+        } while(match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    reserveChunk(&current->function->chunk, estimateCodeSize(parser.previous.start + 1));
+    block();
+}
+
+static void function(FunctionType type){
+    Compiler compiler;
+    initCompiler(&compiler, type);
+    beginScope();
+    parametersAndBody();
+
+    //No endScope(), the whole frame is thrown away on return.
+    ObjFunction* function = endCompiler();
+    emitConstant(OBJ_VAL(function));
+}
+
+// LAZY FUNCTIONS
+// Skim the function instead of compiling it. We count the parameters, so calls can be checked, then
+// skip tokens to the brace that closes the body. The function keeps that stretch of source and
+// compileLazy() turns it into code the first time it is called, so a library only pays for the functions
+// a run uses. Mistakes inside the body are not reported until then.
+static void lazyFunction(){
+    ObjFunction* function = newFunction();
+    //Not in a constant yet, keep it from the GC. Workers never collect.
+    if(localHeap == NULL) push(OBJ_VAL(function));
+    function->name = copyString(parser.previous.start, parser.previous.length);
+    gcWriteBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    Token open = parser.current;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if(!check(TOKEN_RIGHT_PAREN)){
+        do {
+            function->arity++;
+            if(function->arity > 255){
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+        } while(match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    int depth = 1;
+    while(depth > 0 && !check(TOKEN_EOF)){
+        if(check(TOKEN_LEFT_BRACE)) depth++;
+        if(check(TOKEN_RIGHT_BRACE)) depth--;
+        advance();
+    }
+    if(depth > 0) errorAtCurrent("Expect '}' after block.");
+
+    const char* end = parser.previous.start + parser.previous.length;
+    function->source = copyString(open.start, (int)(end - open.start));
+    gcWriteBarrier((Obj*)function, OBJ_VAL(function->source));
+    function->sourceLine = open.line;
+    LOCK_SHARED();
+    vm.functionsDeferred++;
+    UNLOCK_SHARED();
+
+    emitConstant(OBJ_VAL(function));
+    if(localHeap == NULL) pop();
+}
+
+/// @brief Compile a lazy function's body, as if it were being declared now at the top level.
+/// Errors go to stderr. The function is only changed if it compiles.
+bool compileLazy(ObjFunction* function){
+    //Code only runs once compiling is over, so the compiler state on this thread is free to use.
+    errorStream = stderr;
+
+    initScannerAt(function->source->chars, function->sourceLine);
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.previous = (Token){ TOKEN_IDENTIFIER, function->name->chars, function->name->length, function->sourceLine };
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION);
+    beginScope();
+    advance();
+    parametersAndBody();
+    consume(TOKEN_EOF, "Expect end of function.");
+    ObjFunction* compiled = endCompiler();
+    clearBodyEstimates();
+    bool ok = !parser.hadError;
+
+    if(ok){
+        //Everyone already holds the lazy function, so the code moves over to it.
+        freeChunk(&function->chunk);
+        function->chunk = compiled->chunk;
+        function->maxStack = compiled->maxStack;
+        startChunk(&compiled->chunk);
+        //It may have been traced already this cycle, before it had constants.
+        gcRescan((Obj*)function);
+        atomic_store_explicit(&function->verified, true, memory_order_release);
+        LOCK_SHARED();
+        vm.functionsCompiledLate++;
+        UNLOCK_SHARED();
+    }
+    return ok;
+}
+
+void setLazyCompile(bool lazy){
+    lazyCompile = lazy;
+}
+
+void setPrintCode(bool print){
+    printCode = print;
+}
+
+static void method(){
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(&parser.previous);
+    FunctionType type = TYPE_METHOD;
+    if(parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0){
+        type = TYPE_INITIALIZER;
+    }
+    function(type);
+    emitBytes(OP_METHOD, constant);
+}
+
+static void classDeclaration(){
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser.previous;
+    uint8_t nameConstant = identifierConstant(&className);
+    declareVariable(&className);
+
+    emitBytes(OP_CLASS, nameConstant);
+    defineVariable(&className);
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = currentClass;
+    currentClass = &classCompiler;
+
+    //Put the class back on the stack so OP_METHOD can find it.
+    namedVariable(className, false);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while(!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)){
+        method();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(OP_POP);
+
+    currentClass = currentClass->enclosing;
+}
+
+static void funDeclaration(){
+    consume(TOKEN_IDENTIFIER, "Expect function name.");
+    Token name = parser.previous;
+    declareVariable(&name);
+    //A function can refer to itself, so it is usable before the body is compiled.
+    markInitialized();
+    //Methods and functions inside classes need the class around them to compile, so they can't wait.
+    if(lazyCompile && currentClass == NULL){
+        lazyFunction();
+    } else {
+        function(TYPE_FUNCTION);
+    }
+    defineVariable(&name);
+}
+
+static void expressionStatement(){
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+    //An expression statement throws its value away.
+    emitByte(OP_POP);
+}
+
+static void printStatement(){
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(OP_PRINT);
+}
+
+// Hand the VM over to the next ready fiber. This one carries on from here on its next turn.
+static void yieldStatement(){
+    consume(TOKEN_SEMICOLON, "Expect ';' after 'yield'.");
+    emitByte(OP_YIELD);
+}
+
+static void ifStatement(){
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    //The condition stays on the stack for the jump to look at, each branch pops it.
+    int thenJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    statement();
+
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    emitByte(OP_POP);
+
+    if(match(TOKEN_ELSE)) statement();
+    patchJump(elseJump);
+}
+
+// for (initializer; condition; increment) body, all three clauses optional.
+// The increment is compiled before the body but runs after it, so the body jumps back to it.
+static void forStatement(){
+    beginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if(match(TOKEN_SEMICOLON)){
+        // No initializer.
+    } else if(match(TOKEN_VAR)){
+        varDeclaration();
+    } else {
+        expressionStatement();
+    }
+
+    int loopStart = currentChunk()->count;
+    int exitJump = -1;
+    if(!match(TOKEN_SEMICOLON)){
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+    }
+
+    if(!match(TOKEN_RIGHT_PAREN)){
+        int bodyJump = emitJump(OP_JUMP);
+        int incrementStart = currentChunk()->count;
+        expression();
+        emitByte(OP_POP);
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emitLoop(loopStart);
+        loopStart = incrementStart;
+        patchJump(bodyJump);
+    }
+
+    statement();
+    emitLoop(loopStart);
+
+    if(exitJump != -1){
+        patchJump(exitJump);
+        emitByte(OP_POP);
+    }
+    endScope();
+}
+
+static void whileStatement(){
+    int loopStart = currentChunk()->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    statement();
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+    emitByte(OP_POP);
+}
+
+static void returnStatement(){
+    if(current->type == TYPE_SCRIPT){
+        error("Can't return from top-level code.");
+    }
+
+    if(match(TOKEN_SEMICOLON)){
+        emitReturn();
+    } else {
+        if(current->type == TYPE_INITIALIZER){
+            error("Can't return a value from an initializer.");
+        }
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitByte(OP_RETURN);
+    }
+}
+
+static void varDeclaration(){
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token name = parser.previous;
+    declareVariable(&name);
+
+    if(match(TOKEN_EQUAL)){
+        expression();
+    } else {
+        emitByte(OP_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(&name);
+}
+
+//After an error skip ahead to something that looks like the start of a statement,
+//so one mistake does not cascade into a screen of errors.
+static void synchronize(){
+    parser.panicMode = false;
+
+    while(parser.current.type != TOKEN_EOF){
+        if(parser.previous.type == TOKEN_SEMICOLON) return;
+        switch(parser.current.type){
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+            case TOKEN_YIELD:
+                return;
+            default:
+                ; //Keep going
+        }
+        advance();
+    }
+}
+
+static void statement(){
+    if(match(TOKEN_PRINT)){
+        printStatement();
+    } else if(match(TOKEN_IF)){
+        ifStatement();
+    } else if(match(TOKEN_WHILE)){
+        whileStatement();
+    } else if(match(TOKEN_FOR)){
+        //for ( is a plain loop. Anything else is a parallel for used as a statement.
+        if(check(TOKEN_LEFT_PAREN)){
+            forStatement();
+        } else {
+            parallelFor(false);
+            consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+            emitByte(OP_POP);
+        }
+    } else if(match(TOKEN_RETURN)){
+        returnStatement();
+    } else if(match(TOKEN_YIELD)){
+        yieldStatement();
+    } else if(match(TOKEN_LEFT_BRACE)){
+        beginScope();
+        block();
+        endScope();
+    } else {
+        expressionStatement();
+    }
+}
+
+static void declaration(){
+    if(match(TOKEN_CLASS)){
+        classDeclaration();
+    } else if(match(TOKEN_FUN)){
+        funDeclaration();
+    } else if(match(TOKEN_VAR)){
+        varDeclaration();
+    } else {
+        statement();
+    }
+
+    if(parser.panicMode) synchronize();
+}
+
+
 
 // Compile
 
-bool compile(const char* source, Chunk* chunk){
+// Top level code is compiled into an implicit function with no name.
+ObjFunction* compile(const char* source){
+    return compileReporting(source, stderr);
+}
+
+ObjFunction* compileReporting(const char* source, FILE* errors){
+    errorStream = errors;
     //Prime the scanner by feeding it the source.
     initScanner(source);
-    compilingChunk = chunk;
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT);
+    //Size the script's code from the source up front rather than doubling our way there.
+    reserveChunk(&compiler.function->chunk, estimateCodeSize(source));
+    parser.hadError = false;
+    parser.panicMode = false;
+    advance();
+    while(!match(TOKEN_EOF)){
+        declaration();
+    }
+    ObjFunction* function = endCompiler();
+    clearBodyEstimates();
+    return parser.hadError ? NULL : function;
+}
+
+/// @brief Compile a single expression into a function that returns its value, for hosts embedding the VM.
+/// Each input becomes a parameter, in the order given, so the function is called with the inputs' values.
+/// Errors go to stderr. Returns NULL if the expression does not compile.
+ObjFunction* compileExpression(const char* source, int inputCount, const char* const* inputs){
+    errorStream = stderr;
+    initScanner(source);
+    parser.hadError = false;
+    parser.panicMode = false;
+    //initCompiler() names the function after the previous token.
+    parser.previous = (Token){ TOKEN_IDENTIFIER, "expression", 10, 1 };
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION);
+    beginScope();
+    for(int i = 0; i < inputCount; i++){
+        current->function->arity++;
+        if(current->function->arity > 255){
+            error("Can't have more than 255 inputs.");
+            break;
+        }
+        Token name = { TOKEN_IDENTIFIER, inputs[i], (int)strlen(inputs[i]), 1 };
+        declareVariable(&name);
+        defineVariable(&name);
+    }
     advance();
     expression();
-    consume(TOKEN_EOF, "Expect end of expression");
-    endCompiler();
-    return !parser.hadError;
+    consume(TOKEN_EOF, "Expect end of expression.");
+    emitByte(OP_RETURN);
+    ObjFunction* function = endCompiler();
+    return parser.hadError ? NULL : function;
+}
+
+// The functions we are still building are only reachable from here.
+// The functions being compiled gain constants and names without barriers, so they are traced again
+// every time, which includes the last look at the roots before a cycle's marking is done.
+void markCompilerRoots(){
+    Compiler* compiler = current;
+    while(compiler != NULL){
+        //NULL while initCompiler() is making it.
+        if(compiler->function != NULL) gcRescan((Obj*)compiler->function);
+        markObject((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
 }
 
     // Old troubleshoot compiler
@@ -1,9 +1,18 @@
 #ifndef COMPILER
 #define COMPILER
 
+#include <stdio.h>
+
+#include "Bnuuy_object.h"
 #include "vm.h"
 
 //void compile(const char* source);
-bool compile(const char* source, Chunk* chunk);
+ObjFunction* compile(const char* source);
+ObjFunction* compileReporting(const char* source, FILE* errors);   // Same, but errors go to the given stream.
+ObjFunction* compileExpression(const char* source, int inputCount, const char* const* inputs);
+bool compileLazy(ObjFunction* function);    // Give a lazy function its code. False if the body has an error.
+void setLazyCompile(bool lazy);             // Skim function bodies instead of compiling them.
+void setPrintCode(bool print);              // Disassemble every function once it is compiled.
+void markCompilerRoots();
 
 #endif
\ No newline at end of file
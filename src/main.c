@@ -5,6 +5,11 @@
 #include "Bnuuy_common.h"
 #include "Bnuuy_chunk.h"
 #include "Bnuuy_debugger.h"
+#include "Bnuuy_optimizer.h"
+#include "Bnuuy_parallel.h"
+#include "Bnuuy_server.h"
+#include "Bnuuy_snapshot.h"
+#include "compiler.h"
 #include "vm.h"
 
 static void repl() {
@@ -58,20 +63,118 @@ static void runFile(const char* path){
     if(result == INTERPRET_COMPILE_ERROR) exit(70);
 }
 
+// Several files are compiled side by side, then run one after another in the order given.
+static void runFiles(int count, const char* paths[]){
+    CompileJob* jobs = malloc(sizeof(CompileJob) * count);
+    if(jobs == NULL) exit(74);
+    for(int i = 0; i < count; i++){
+        jobs[i].name = paths[i];
+        jobs[i].source = readFile(paths[i]);
+        jobs[i].function = NULL;
+    }
+
+    int failed = compileParallel(jobs, count, 0);
+    InterpretResult result = INTERPRET_OK;
+    for(int i = 0; i < count && failed == 0 && result == INTERPRET_OK; i++){
+        result = interpretFunction(jobs[i].function);
+    }
+    releaseCompileJobs();
+
+    for(int i = 0; i < count; i++){
+        free((char*) jobs[i].source);
+    }
+    free(jobs);
+
+    if(failed > 0) exit(70);
+    if(result == INTERPRET_RUNTIME_ERROR) exit(65);
+}
+
+static void usage(){
+    fprintf(stderr, "Usage: Bnuuy [--lazy] [--mem-stats] [--stats] [--opt passes] [--print-code] [--trace] [--profile] [--step]\n");
+    fprintf(stderr, "             [--load-image path] [--save-image path] [--serve socket] [script...]\n");
+    fprintf(stderr, "  passes is all, none, or any of negate,identity,strength,dead\n");
+    fprintf(stderr, "  SIGUSR1 turns tracing on and off while running, SIGUSR2 profiling\n");
+    fprintf(stderr, "  --serve runs the scripts first, then answers requests on the socket until SIGINT or SIGTERM\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]){
     //Initialise the virtual machine
     initVM();
-    if(argc == 1){
+    installDispatchSignals();
+
+    //Options come before the scripts. An image is loaded straight away, and saved once the scripts are done.
+    const char* saveImage = NULL;
+    const char* servePath = NULL;
+    bool memStats = false;
+    bool vmStats = false;
+    int first = 1;
+    while(first < argc && strncmp(argv[first], "--", 2) == 0){
+        if(strcmp(argv[first], "--lazy") == 0){
+            setLazyCompile(true);
+            first++;
+            continue;
+        }
+        if(strcmp(argv[first], "--mem-stats") == 0){
+            memStats = true;
+            first++;
+            continue;
+        }
+        if(strcmp(argv[first], "--stats") == 0){
+            vmStats = true;
+            first++;
+            continue;
+        }
+        if(strcmp(argv[first], "--print-code") == 0){
+            setPrintCode(true);
+            first++;
+            continue;
+        }
+        //Only the starting mode, the step prompt and the signals can change it later.
+        if(strcmp(argv[first], "--trace") == 0 || strcmp(argv[first], "--profile") == 0 || strcmp(argv[first], "--step") == 0){
+            if(argv[first][2] == 't') setDispatchMode(DISPATCH_TRACE);
+            else if(argv[first][2] == 'p') setDispatchMode(DISPATCH_PROFILE);
+            else setDispatchMode(DISPATCH_STEP);
+            first++;
+            continue;
+        }
+        if(first + 1 == argc) usage();
+        if(strcmp(argv[first], "--load-image") == 0){
+            if(!loadSnapshot(argv[first + 1])) exit(74);
+        } else if(strcmp(argv[first], "--save-image") == 0){
+            saveImage = argv[first + 1];
+        } else if(strcmp(argv[first], "--serve") == 0){
+            servePath = argv[first + 1];
+        } else if(strcmp(argv[first], "--opt") == 0){
+            int passes;
+            if(!parseOptimizerPasses(argv[first + 1], &passes)) usage();
+            setOptimizerPasses(passes);
+        } else {
+            usage();
+        }
+        first += 2;
+    }
+
+    int count = argc - first;
+    if(count == 0 && servePath == NULL){
         //Drop into a repl 
         repl();
-    } else if (argc == 2){
+    } else if (count == 1){
         //Run a file
-        runFile(argv[1]);
-    } else{
-        fprintf(stderr, "Usage: bnuuy [path]\n");
+        runFile(argv[first]);
+    } else if (count > 1){
+        runFiles(count, argv + first);
     }
+    //The scripts have warmed the server up, whatever they defined is there for the requests.
+    if(servePath != NULL && !runServer(servePath)) exit(74);
+    if(saveImage != NULL && !saveSnapshot(saveImage)) exit(74);
+    //While everything is still live, so the numbers say what the scripts left behind.
+    if(memStats) printMemStats();
+    if(vmStats) printVMStats();
+    //Only prints if something was profiled, from --profile or SIGUSR2.
+    printProfile();
 
     //Free the virtual machine
     freeVM();
     return 0;
-}
\ No newline at end of file
+}
@@ -4,7 +4,8 @@
 #include "scanner.h"
 #include "Bnuuy_common.h"
 
-Scanner scanner;
+// One per thread, so compile workers can scan side by side.
+static _Thread_local Scanner scanner;
 
 void initScanner(const char* source){
     scanner.start = source;
@@ -12,6 +13,11 @@ void initScanner(const char* source){
     scanner.line = 1;
 }
 
+void initScannerAt(const char* source, int line){
+    initScanner(source);
+    scanner.line = line;
+}
+
 static char advance() {
     scanner.current++;
     return scanner.current[-1];
@@ -81,6 +87,7 @@ static void skipWhitespace(){
             case '#':
                 //Comments in my script will be # like python
                 while( (peek() != '\n' && !isAtEnd())) advance();
+                break;
             default:
                 return;
         }
@@ -88,7 +95,7 @@ static void skipWhitespace(){
 }
 
 static TokenType checkWord(int start, int length, const char* remainder, TokenType type){
-    if((scanner.current - scanner.start == start + length) && strcmp(scanner.start + start, remainder + length)) {
+    if((scanner.current - scanner.start == start + length) && memcmp(scanner.start + start, remainder, length) == 0) {
         return type;
     }
     return TOKEN_IDENTIFIER;
@@ -136,6 +143,7 @@ static TokenType identifierType() {
                     case 'r': return checkWord(2, 2, "ue", TOKEN_TRUE);
                 }
             }
+            break;
         case 'f':
             if(scanner.current - scanner.start > 1){
                 switch(scanner.start[1]){
@@ -144,9 +152,11 @@ static TokenType identifierType() {
                     case 'u': return checkWord(2, 1, "n", TOKEN_FUN);
                 }
             }
+            break;
         case 's': return checkWord(1, 3, "uper", TOKEN_SUPER);
         case 'v': return checkWord(1, 2, "ar", TOKEN_VAR);
         case 'w': return checkWord(1, 4, "hile", TOKEN_WHILE);
+        case 'y': return checkWord(1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
@@ -192,8 +202,8 @@ Token scanToken(){
         //Doubles
         case '!': return makeToken( match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG); 
         case '=': return makeToken( match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken( match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '>': return makeToken( match('=') ? TOKEN_LESSER_EQUAL : TOKEN_LESSER);
+        case '<': return makeToken( match('=') ? TOKEN_LESSER_EQUAL : TOKEN_LESSER);
+        case '>': return makeToken( match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         //String literal
         case '"': return string();
     }
@@ -19,7 +19,7 @@ typedef enum {
     TOKEN_NUMBER,
     //Reserverd Keywords
     //Organising these alphabetically makes life easier
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_THIS, TOKEN_SUPER, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_THIS, TOKEN_SUPER, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
 
     TOKEN_ERROR, TOKEN_EOF 
 } TokenType;
@@ -39,6 +39,7 @@ typedef struct {
 
 
 void initScanner(const char* source);
+void initScannerAt(const char* source, int line);   // Source that was cut out of a file, starting on line.
 Token scanToken();
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Bnuuy_object.h"
+#include "vm.h"
+
+// INTERN BENCHMARK
+// Times copyString() on keys the intern table already holds and on keys it has never seen, then prints
+// the VM's own counters so the hit rate can be checked against what the loops asked for.
+#define KEYS    100000
+#define ROUNDS  10
+
+static uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+// Keys are made up front so only the lookups are timed.
+static char (*makeKeys(const char* prefix, int first, int* lengths))[32]{
+    char (*keys)[32] = malloc(sizeof(*keys) * KEYS);
+    if(keys == NULL) exit(1);
+    for(int i = 0; i < KEYS; i++){
+        lengths[i] = snprintf(keys[i], sizeof(keys[i]), "%s%d", prefix, first + i);
+    }
+    return keys;
+}
+
+int main(){
+    initVM();
+    //Nothing here is rooted, keep the collector from taking the keys between rounds.
+    configureGC((GCConfig){ .pauseBudgetNs = 500 * 1000, .stepBytes = 64 * 1024,
+                            .heapGrowPercent = 200, .minHeapBytes = SIZE_MAX });
+    static int lengths[KEYS];
+    char (*keys)[32] = makeKeys("key", 0, lengths);
+    for(int i = 0; i < KEYS; i++){
+        copyString(keys[i], lengths[i]);
+    }
+    uint64_t lookups = vm.internLookups;
+    uint64_t hits = vm.internHits;
+
+    //Every one of these is already interned.
+    uint64_t elapsed = 0;
+    for(int round = 0; round < ROUNDS; round++){
+        uint64_t start = nowNs();
+        for(int i = 0; i < KEYS; i++){
+            copyString(keys[i], lengths[i]);
+        }
+        elapsed += nowNs() - start;
+    }
+    double hitNs = (double) elapsed / ((double) KEYS * ROUNDS);
+    free(keys);
+
+    //And none of these are, each one allocates and inserts.
+    elapsed = 0;
+    for(int round = 0; round < ROUNDS; round++){
+        keys = makeKeys("new", round * KEYS, lengths);
+        uint64_t start = nowNs();
+        for(int i = 0; i < KEYS; i++){
+            copyString(keys[i], lengths[i]);
+        }
+        elapsed += nowNs() - start;
+        free(keys);
+    }
+    double missNs = (double) elapsed / ((double) KEYS * ROUNDS);
+
+    lookups = vm.internLookups - lookups;
+    hits = vm.internHits - hits;
+    printf("intern hit       %.1f ns per lookup\n", hitNs);
+    printf("intern miss      %.1f ns per lookup, allocation included\n", missNs);
+    printf("intern hits      %llu / %llu (%.1f%%, expected 50.0%%)\n", (unsigned long long) hits,
+        (unsigned long long) lookups, (100.0 * hits) / lookups);
+    printf("interned strings %d / %d slots\n", vm.strings.count, vm.strings.capacity);
+    freeVM();
+    return 0;
+}
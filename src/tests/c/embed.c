@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "Bnuuy_embed.h"
+
+// EMBEDDING TESTS
+// A host that only goes through Bnuuy_embed.h: compiles a few expressions, binds inputs, evaluates them
+// and checks what comes back. Then times one evaluation in a loop, and checks that freeVM() gave back
+// every byte the VM took.
+#define EVALUATIONS 1000000
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if(!(condition)){ fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); failures++; } \
+    } while(0)
+
+static uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+int main(){
+    initVM();
+    //Writes to the VM's own streams so a failed evaluation still says why.
+    CHECK(interpret(
+        "var scale = 3;\n"
+        "fun clamp(x, low, high){\n"
+        "    if(x < low) return low;\n"
+        "    if(x > high) return high;\n"
+        "    return x;\n"
+        "}\n") == INTERPRET_OK);
+
+    //Inputs by index, globals and script functions from inside the expression.
+    const char* const names[] = {"x", "y"};
+    Expression* sum = newExpression("clamp(x * scale + y, 0, 100)", 2, names);
+    CHECK(sum != NULL);
+    Value result = NIL_VAL;
+    bindInput(sum, 0, INT_VAL(4));
+    bindInput(sum, 1, INT_VAL(5));
+    CHECK(evaluate(sum, &result) == INTERPRET_OK && IS_INT(result) && AS_INT(result) == 17);
+    //An input keeps its value until it is bound again.
+    bindInput(sum, 1, INT_VAL(-20));
+    CHECK(evaluate(sum, &result) == INTERPRET_OK && IS_INT(result) && AS_INT(result) == 0);
+    bindInput(sum, 0, INT_VAL(1000));
+    CHECK(evaluate(sum, &result) == INTERPRET_OK && IS_INT(result) && AS_INT(result) == 100);
+
+    //Strings in and out, including one long enough to come back as a rope.
+    const char* const textNames[] = {"s"};
+    Expression* text = newExpression("s + s + s + s + s + s + s + s", 1, textNames);
+    CHECK(text != NULL);
+    bindInput(text, 0, stringValue("0123456789", 10));
+    collectGarbage();
+    CHECK(evaluate(text, &result) == INTERPRET_OK);
+    const char* chars = valueChars(result);
+    CHECK(chars != NULL && strlen(chars) == 80 && strncmp(chars + 70, "0123456789", 10) == 0);
+    CHECK(valueChars(INT_VAL(1)) == NULL);
+
+    //Errors come back as results, and the expression can be evaluated again after one.
+    fprintf(stderr, "(a compile error and a runtime error are expected here)\n");
+    CHECK(newExpression("x +", 1, names) == NULL);
+    bindInput(sum, 0, NIL_VAL);
+    CHECK(evaluate(sum, &result) == INTERPRET_RUNTIME_ERROR);
+    bindInput(sum, 0, INT_VAL(2));
+    CHECK(evaluate(sum, &result) == INTERPRET_OK && IS_INT(result) && AS_INT(result) == 0);
+
+    //Nothing is compiled or looked up by name per evaluation, this is the whole cost of one.
+    bindInput(sum, 0, INT_VAL(7));
+    bindInput(sum, 1, INT_VAL(1));
+    int64_t total = 0;
+    uint64_t start = nowNs();
+    for(int i = 0; i < EVALUATIONS; i++){
+        evaluate(sum, &result);
+        total += AS_INT(result);
+    }
+    uint64_t elapsed = nowNs() - start;
+    CHECK(total == (int64_t) EVALUATIONS * 22);
+    printf("evaluate         %.1f ns per call\n", (double) elapsed / EVALUATIONS);
+
+    freeExpression(sum);
+    freeExpression(text);
+    freeVM();
+    MemStats stats = memoryStats();
+    CHECK(stats.liveBytes == 0);
+    if(stats.liveBytes != 0) fprintf(stderr, "%lld bytes still live after freeVM()\n", (long long) stats.liveBytes);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Bnuuy_embed.h"
+#include "vm.h"
+
+// FIBER TESTS
+// Drives fibers from C through spawnFiber(), resumeFiber() and runFibers(), to check the states they go
+// through and the values they finish with, which a script has no way to see.
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if(!(condition)){ fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); failures++; } \
+    } while(0)
+
+// The value of a global the scripts defined, through an expression that just names it. Evaluating runs
+// every queued fiber, so look everything up before spawning.
+static Value global(const char* name){
+    Expression* expression = newExpression(name, 0, NULL);
+    Value value = NIL_VAL;
+    if(expression == NULL || evaluate(expression, &value) != INTERPRET_OK) value = NIL_VAL;
+    if(expression != NULL) freeExpression(expression);
+    return value;
+}
+
+int main(){
+    initVM();
+    //The fibers made here are only held by this file, keep the collector off them.
+    configureGC((GCConfig){ .pauseBudgetNs = 500 * 1000, .stepBytes = 64 * 1024,
+                            .heapGrowPercent = 200, .minHeapBytes = SIZE_MAX });
+    CHECK(interpret(
+        "fun square(x){ return x * x; }\n"
+        "fun twice(x){ yield; yield; return x + x; }\n"
+        "fun fail(){ yield; return nil + 1; }\n"
+        "fun spin(){ var i = 0; while(i < 100000) i = i + 1; return i; }\n") == INTERPRET_OK);
+    Value square = global("square"), twice = global("twice"), fail = global("fail"), spin = global("spin");
+    Value three = INT_VAL(3);
+
+    //Runs straight through to its result.
+    ObjFiber* fiber = spawnFiber(square, 1, &three);
+    CHECK(fiber != NULL && fiber->state == FIBER_READY);
+    CHECK(runFibers() == INTERPRET_OK);
+    CHECK(fiber->state == FIBER_DONE && IS_INT(fiber->result) && AS_INT(fiber->result) == 9);
+
+    //Each resume stops at the next yield, and a finished fiber resumes as a no-op.
+    fiber = spawnFiber(twice, 1, &three);
+    CHECK(resumeFiber(fiber, FIBER_SLICE) == INTERPRET_OK && fiber->state == FIBER_READY);
+    CHECK(resumeFiber(fiber, FIBER_SLICE) == INTERPRET_OK && fiber->state == FIBER_READY);
+    CHECK(resumeFiber(fiber, FIBER_SLICE) == INTERPRET_OK && fiber->state == FIBER_DONE);
+    CHECK(IS_INT(fiber->result) && AS_INT(fiber->result) == 6);
+    CHECK(resumeFiber(fiber, FIBER_SLICE) == INTERPRET_OK && fiber->state == FIBER_DONE);
+    CHECK(runFibers() == INTERPRET_OK);
+
+    //A small budget runs out before the loop ends, the fiber just waits for its next turn.
+    fiber = spawnFiber(spin, 0, NULL);
+    CHECK(resumeFiber(fiber, 10) == INTERPRET_OK && fiber->state == FIBER_READY);
+    CHECK(runFibers() == INTERPRET_OK);
+    CHECK(fiber->state == FIBER_DONE && IS_INT(fiber->result) && AS_INT(fiber->result) == 100000);
+
+    //A failure stays with its fiber, and the one beside it still finishes.
+    ObjFiber* failing = spawnFiber(fail, 0, NULL);
+    fiber = spawnFiber(square, 1, &three);
+    fprintf(stderr, "(a runtime error is expected here)\n");
+    CHECK(runFibers() == INTERPRET_RUNTIME_ERROR);
+    CHECK(failing->state == FIBER_FAILED);
+    CHECK(resumeFiber(failing, FIBER_SLICE) == INTERPRET_RUNTIME_ERROR);
+    CHECK(fiber->state == FIBER_DONE && AS_INT(fiber->result) == 9);
+
+    //Spawning refuses what it can't call, with the reason left for the caller.
+    CHECK(spawnFiber(INT_VAL(1), 0, NULL) == NULL);
+    CHECK(spawnFiber(square, 0, NULL) == NULL);
+
+    freeVM();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,264 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Bnuuy_embed.h"
+#include "Bnuuy_snapshot.h"
+#include "compiler.h"
+#include "vm.h"
+
+// SNAPSHOT TESTS
+// Saves an image of a small program and checks it comes back the same. Then feeds the loader images that
+// are cut short, have random bytes flipped, or were saved from a VM patched into a state no compiler
+// makes, and checks each is turned away or fails cleanly at runtime rather than taking the process down.
+// Every VM is freed with nothing left live, failed loads included.
+#define FLIPS 300
+#define TRUNCATE_STEP 13
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if(!(condition)){ fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); failures++; } \
+    } while(0)
+
+static const char* program =
+    "var greeting = \"hello\";\n"
+    "var long = \"\";\n"
+    "for(var i = 0; i < 20; i = i + 1) long = long + \"0123456789\";\n"
+    "var numbers = vector(5, 1, 2);\n"
+    "class Point {\n"
+    "    init(x, y){ this.x = x; this.y = y; }\n"
+    "    sum(){ return this.x + this.y; }\n"
+    "}\n"
+    "var origin = Point(3, 4);\n"
+    "fun sevens(){ return for sum (i = 0, 3) i * 7; }\n"
+    "fun makeClass(){\n"
+    "    class Inner { eleven(){ return 11; } }\n"
+    "    return Inner;\n"
+    "}\n";
+// Left lazy, so it is saved as source.
+static const char* lazyProgram = "fun triple(x){ return x * 3; }\n";
+
+// Each of these has to come out true once the image is loaded.
+static const char* expected[] = {
+    "greeting == \"hello\"",
+    "len(long) == 200 and long + \"!\" != long",
+    "numbers[4] == 9",
+    "origin.sum() == 7",
+    "Point(10, 20).sum() == 30",
+    "sevens() == 21",
+    "makeClass()().eleven() == 11",
+    "triple(5) == 15",
+};
+#define EXPECTED (int) (sizeof(expected) / sizeof(expected[0]))
+
+static char imagePath[] = "/tmp/bnuuy-image-XXXXXX";
+static char scratchPath[] = "/tmp/bnuuy-scratch-XXXXXX";
+
+// The loader says why it turned an image down on stderr, which would bury the checks that matter.
+static int savedStderr = -1;
+
+static void quiet(){
+    fflush(stderr);
+    savedStderr = dup(2);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+    close(null);
+}
+
+static void loud(){
+    fflush(stderr);
+    dup2(savedStderr, 2);
+    close(savedStderr);
+}
+
+static Value evaluateSource(const char* source, InterpretResult* result){
+    Value value = NIL_VAL;
+    Expression* expression = newExpression(source, 0, NULL);
+    if(expression == NULL){
+        *result = INTERPRET_COMPILE_ERROR;
+        return value;
+    }
+    *result = evaluate(expression, &value);
+    freeExpression(expression);
+    return value;
+}
+
+static Value global(const char* name){
+    InterpretResult result;
+    return evaluateSource(name, &result);
+}
+
+static void startVM(){
+    initVM();
+    setLazyCompile(false);
+}
+
+static void stopVM(){
+    freeVM();
+    CHECK(memoryStats().liveBytes == 0);
+}
+
+// A VM with the test program in it, not yet saved.
+static void buildProgram(){
+    startVM();
+    CHECK(interpret(program) == INTERPRET_OK);
+    setLazyCompile(true);
+    CHECK(interpret(lazyProgram) == INTERPRET_OK);
+    setLazyCompile(false);
+}
+
+static void checkProgram(){
+    for(int i = 0; i < EXPECTED; i++){
+        InterpretResult result;
+        Value value = evaluateSource(expected[i], &result);
+        bool same = result == INTERPRET_OK && IS_BOOL(value) && AS_BOOL(value);
+        if(!same) fprintf(stderr, "after loading, %s came out wrong\n", expected[i]);
+        CHECK(same);
+    }
+}
+
+static uint8_t* readFile(const char* path, size_t* size){
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) exit(1);
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+    uint8_t* bytes = malloc(*size);
+    if(bytes == NULL || fread(bytes, 1, *size, file) != *size) exit(1);
+    fclose(file);
+    return bytes;
+}
+
+static void writeFile(const char* path, const uint8_t* bytes, size_t size){
+    FILE* file = fopen(path, "wb");
+    if(file == NULL || fwrite(bytes, 1, size, file) != size) exit(1);
+    fclose(file);
+}
+
+// Loads path into a fresh VM. A damaged image that still loads gets run, any error is fine, a crash not.
+static bool tryLoad(const char* path){
+    startVM();
+    quiet();
+    bool loaded = loadSnapshot(path);
+    if(loaded){
+        for(int i = 0; i < EXPECTED; i++){
+            InterpretResult result;
+            evaluateSource(expected[i], &result);
+        }
+    }
+    loud();
+    stopVM();
+    return loaded;
+}
+
+// The offset in function's code of an OP_CONSTANT loading a function straight before instruction.
+static int functionConstantBefore(ObjFunction* function, OpCode instruction){
+    Chunk* chunk = &function->chunk;
+    for(int i = 0; i + 2 < chunk->count; i++){
+        if(chunk->code[i] == OP_CONSTANT && chunk->code[i + 2] == instruction &&
+           IS_FUNCTION(chunk->constants.values[chunk->code[i + 1]])) return i;
+    }
+    return -1;
+}
+
+// Point the constant that feeds instruction in function's code at one that is not a function, then save.
+static void saveWithoutFunction(const char* functionName, OpCode instruction){
+    buildProgram();
+    ObjFunction* function = AS_FUNCTION(global(functionName));
+    int offset = functionConstantBefore(function, instruction);
+    CHECK(offset >= 0);
+    if(offset >= 0){
+        ValueArray* constants = &function->chunk.constants;
+        for(int i = 0; i < constants->count; i++){
+            if(!IS_FUNCTION(constants->values[i])) function->chunk.code[offset + 1] = (uint8_t) i;
+        }
+        CHECK(!IS_FUNCTION(constants->values[function->chunk.code[offset + 1]]));
+    }
+    CHECK(saveSnapshot(scratchPath));
+    stopVM();
+}
+
+int main(){
+    int image = mkstemp(imagePath);
+    int scratch = mkstemp(scratchPath);
+    if(image < 0 || scratch < 0) return 1;
+    close(image);
+    close(scratch);
+
+    //Round trip.
+    buildProgram();
+    CHECK(saveSnapshot(imagePath));
+    stopVM();
+    startVM();
+    CHECK(loadSnapshot(imagePath));
+    checkProgram();
+    stopVM();
+
+    //Images cut short are turned away. Every length through the header, then a sample of the rest
+    //ending one byte short, writing a file per try is what takes the time.
+    size_t size;
+    uint8_t* bytes = readFile(imagePath, &size);
+    int truncatedLoads = 0;
+    for(size_t length = 0; length < size; length += length < 64 ? 1 : TRUNCATE_STEP){
+        writeFile(scratchPath, bytes, length);
+        if(tryLoad(scratchPath)) truncatedLoads++;
+    }
+    writeFile(scratchPath, bytes, size - 1);
+    if(tryLoad(scratchPath)) truncatedLoads++;
+    CHECK(truncatedLoads == 0);
+
+    //Random single byte changes. Most are caught, the rest load into something that runs without crashing.
+    //A fixed generator, so a failure comes back the same every run.
+    uint32_t random = 12345;
+    int flippedLoads = 0;
+    for(int i = 0; i < FLIPS; i++){
+        random = random * 1103515245u + 12345u;
+        size_t offset = (random >> 8) % size;
+        random = random * 1103515245u + 12345u;
+        uint8_t mask = (uint8_t) (1u << ((random >> 16) % 8));
+        bytes[offset] ^= mask;
+        writeFile(scratchPath, bytes, size);
+        if(tryLoad(scratchPath)) flippedLoads++;
+        bytes[offset] ^= mask;
+    }
+    printf("flips            %d of %d images still loaded\n", flippedLoads, FLIPS);
+    free(bytes);
+
+    //Parallel for and method definitions with something other than a function under them.
+#ifndef READ_ONLY_CODE
+    saveWithoutFunction("sevens", OP_PARALLEL_FOR);
+    CHECK(!tryLoad(scratchPath));
+    saveWithoutFunction("makeClass", OP_METHOD);
+    CHECK(!tryLoad(scratchPath));
+#endif
+
+    //A parallel for body that wants more arguments than the loop passes it loads, then fails when run.
+    buildProgram();
+    ObjFunction* sevens = AS_FUNCTION(global("sevens"));
+    int offset = functionConstantBefore(sevens, OP_PARALLEL_FOR);
+    CHECK(offset >= 0);
+    if(offset >= 0) AS_FUNCTION(sevens->chunk.constants.values[sevens->chunk.code[offset + 1]])->arity = 2;
+    CHECK(saveSnapshot(scratchPath));
+    stopVM();
+    startVM();
+    CHECK(loadSnapshot(scratchPath));
+    InterpretResult result;
+    fprintf(stderr, "(a runtime error is expected here)\n");
+    evaluateSource("sevens()", &result);
+    CHECK(result == INTERPRET_RUNTIME_ERROR);
+    stopVM();
+
+    //A class claiming its instances have more fields than a shape can hold.
+    buildProgram();
+    AS_CLASS(global("Point"))->fieldHint = 1 << 20;
+    CHECK(saveSnapshot(scratchPath));
+    stopVM();
+    CHECK(!tryLoad(scratchPath));
+
+    unlink(imagePath);
+    unlink(scratchPath);
+    return failures == 0 ? 0 : 1;
+}
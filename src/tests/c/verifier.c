@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Bnuuy_embed.h"
+#include "Bnuuy_verifier.h"
+#include "vm.h"
+
+// VERIFIER TESTS
+// Hand-built chunks, one fault each, to check the verifier turns down every kind of bad code the
+// dispatch loop relies on it to catch, at the instruction that is wrong. A few good chunks go through
+// too, so a verifier that rejected everything would not pass.
+#define MAX_CODE 320
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if(!(condition)){ fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); failures++; } \
+    } while(0)
+
+// Every chunk gets the same constants: an int, a string to use as a name, a verified function
+// and one that has not been verified.
+enum { INT_CONSTANT, NAME_CONSTANT, FUNCTION_CONSTANT, UNVERIFIED_CONSTANT };
+
+typedef struct {
+    const char* name;
+    int arity;
+    int length;
+    uint8_t code[MAX_CODE];
+    const char* message;    // NULL if the chunk is good.
+    int offset;             // Where the verifier has to say it went wrong.
+} Case;
+
+static const Case cases[] = {
+    { "constant", 0, 3, { OP_CONSTANT, INT_CONSTANT, OP_RETURN }, NULL, 0 },
+    { "parallel for", 0, 9, { OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, FUNCTION_CONSTANT,
+        OP_PARALLEL_FOR, REDUCE_SUM, OP_RETURN }, NULL, 0 },
+    { "method", 0, 7, { OP_CLASS, NAME_CONSTANT, OP_CONSTANT, FUNCTION_CONSTANT, OP_METHOD, NAME_CONSTANT,
+        OP_RETURN }, NULL, 0 },
+    { "branches", 1, 8, { OP_GET_LOCAL, 1, OP_JUMP_IF_FALSE, 0, 2, OP_POP, OP_NIL, OP_RETURN }, NULL, 0 },
+
+    { "empty", 0, 0, { 0 }, "Empty chunk.", 0 },
+    { "unknown opcode", 0, 2, { OP_NIL, OP_COUNT }, "Unknown opcode.", 1 },
+    { "operand past the end", 0, 2, { OP_NIL, OP_CONSTANT }, "Operand runs past the end of the chunk.", 1 },
+    { "constant out of range", 0, 3, { OP_CONSTANT, 200, OP_RETURN }, "Constant index out of range.", 0 },
+    { "unverified function", 0, 3, { OP_CONSTANT, UNVERIFIED_CONSTANT, OP_RETURN },
+        "Constant is an unverified function.", 0 },
+    { "name is not a string", 0, 3, { OP_CLASS, INT_CONSTANT, OP_RETURN }, "Name constant is not a string.", 0 },
+    { "inline cache out of range", 0, 6, { OP_NIL, OP_GET_PROPERTY, NAME_CONSTANT, 0, 9, OP_RETURN },
+        "Inline cache index out of range.", 1 },
+    { "global out of range", 0, 3, { OP_GET_GLOBAL, 255, OP_RETURN }, "Global slot out of range.", 0 },
+    { "unknown reduction", 0, 9, { OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, FUNCTION_CONSTANT,
+        OP_PARALLEL_FOR, REDUCE_COUNT, OP_RETURN }, "Unknown reduction.", 6 },
+    { "local past the top", 1, 3, { OP_GET_LOCAL, 2, OP_RETURN }, "Local slot is past the top of the stack.", 0 },
+    { "pop into the callee", 0, 3, { OP_POP, OP_NIL, OP_RETURN }, "Stack underflow.", 0 },
+    { "add with one operand", 0, 4, { OP_CONSTANT, INT_CONSTANT, OP_ADD, OP_RETURN }, "Stack underflow.", 2 },
+    { "call past the frame", 0, 4, { OP_NIL, OP_CALL, 3, OP_RETURN }, "Stack underflow.", 1 },
+    { "runs off the end", 0, 1, { OP_NIL }, "Execution can run off the end of the chunk.", 0 },
+    { "jump into an operand", 0, 6, { OP_JUMP, 0, 1, OP_CONSTANT, INT_CONSTANT, OP_RETURN },
+        "Jump does not land on an instruction.", 0 },
+    { "loop before the start", 0, 4, { OP_NIL, OP_LOOP, 0, 9 }, "Jump does not land on an instruction.", 1 },
+    { "depths differ", 0, 6, { OP_TRUE, OP_JUMP_IF_FALSE, 0, 1, OP_NIL, OP_RETURN },
+        "Stack depth differs between paths.", 5 },
+    { "parallel for over an int", 0, 9, { OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, INT_CONSTANT, OP_CONSTANT, INT_CONSTANT,
+        OP_PARALLEL_FOR, REDUCE_SUM, OP_RETURN }, "Expected a function constant before this instruction.", 6 },
+    { "parallel for over a local", 3, 9, { OP_GET_LOCAL, 1, OP_GET_LOCAL, 2, OP_GET_LOCAL, 3,
+        OP_PARALLEL_FOR, REDUCE_SUM, OP_RETURN }, "Expected a function constant before this instruction.", 6 },
+    { "parallel for first", 3, 3, { OP_PARALLEL_FOR, REDUCE_SUM, OP_RETURN },
+        "Expected a function constant before this instruction.", 0 },
+    { "method with a string", 0, 7, { OP_CLASS, NAME_CONSTANT, OP_CONSTANT, NAME_CONSTANT, OP_METHOD, NAME_CONSTANT,
+        OP_RETURN }, "Expected a function constant before this instruction.", 4 },
+    { "jump onto a method", 0, 10, { OP_CLASS, NAME_CONSTANT, OP_CONSTANT, FUNCTION_CONSTANT, OP_JUMP, 0, 0,
+        OP_METHOD, NAME_CONSTANT, OP_RETURN }, "Expected a function constant before this instruction.", 7 },
+};
+#define CASES (int) (sizeof(cases) / sizeof(cases[0]))
+
+// More values than a frame may hold.
+static void tooDeep(Case* deep){
+    deep->name = "too deep";
+    deep->arity = 0;
+    deep->length = 0;
+    for(int i = 0; i < 300; i++) deep->code[deep->length++] = OP_NIL;
+    deep->code[deep->length++] = OP_RETURN;
+    deep->message = "Frame uses more than 256 stack slots.";
+    deep->offset = UINT8_COUNT - 1;
+}
+
+static void run(const Case* test, Value* constants){
+    Chunk chunk;
+    startChunk(&chunk);
+    if(test->length > 0) writeChunkBytes(&chunk, test->code, test->length, 1);
+    for(int i = 0; i <= UNVERIFIED_CONSTANT; i++) addConstant(&chunk, constants[i]);
+    //The property case needs an inline cache to be out of range of.
+    addInlineCache(&chunk);
+
+    VerifyResult result = verifyChunk(&chunk, test->arity);
+    bool right = test->message == NULL ? result.ok
+        : !result.ok && strcmp(result.message, test->message) == 0 && result.offset == test->offset;
+    if(!right){
+        fprintf(stderr, "%s: got %s at %d\n", test->name, result.ok ? "ok" : result.message, result.offset);
+        failures++;
+    }
+    freeChunk(&chunk);
+}
+
+int main(){
+    initVM();
+    //The constants are only held by the chunks here, keep the collector off them.
+    configureGC((GCConfig){ .pauseBudgetNs = 500 * 1000, .stepBytes = 64 * 1024,
+                            .heapGrowPercent = 200, .minHeapBytes = SIZE_MAX });
+    CHECK(interpret("fun body(i){ return i; }\n") == INTERPRET_OK);
+    Value function = NIL_VAL;
+    Expression* lookup = newExpression("body", 0, NULL);
+    CHECK(lookup != NULL && evaluate(lookup, &function) == INTERPRET_OK && IS_FUNCTION(function));
+    freeExpression(lookup);
+
+    Value constants[] = {
+        [INT_CONSTANT] = INT_VAL(1),
+        [NAME_CONSTANT] = OBJ_VAL(copyString("m", 1)),
+        [FUNCTION_CONSTANT] = function,
+        [UNVERIFIED_CONSTANT] = OBJ_VAL(newFunction()),
+    };
+    for(int i = 0; i < CASES; i++) run(&cases[i], constants);
+    static Case deep;
+    tooDeep(&deep);
+    run(&deep, constants);
+
+    //A good chunk's depth includes the callee and its arguments, and verifyFunction() records it.
+    ObjFunction* checked = newFunction();
+    checked->arity = 2;
+    writeChunkBytes(&checked->chunk, (const uint8_t[]){ OP_GET_LOCAL, 1, OP_GET_LOCAL, 2, OP_ADD, OP_RETURN }, 6, 1);
+    CHECK(verifyFunction(checked).ok && checked->verified && checked->maxStack == 5);
+
+    freeVM();
+    return failures == 0 ? 0 : 1;
+}
@@ -1,154 +1,1506 @@
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "Bnuuy_common.h"
 #include "Bnuuy_chunk.h"
 #include "Bnuuy_debugger.h"
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_optimizer.h"
+#include "Bnuuy_parallel.h"
+#include "Bnuuy_vector.h"
 #include "compiler.h"
 #include "vm.h"
 
 // Have a static VM ready to go.
 VM vm;
+_Thread_local ExecContext exec;
 
 static void resetStack(){
-    vm.stackTop = vm.stack;
+    exec.stackTop = exec.stack;
+    exec.frameCount = 0;
 }
+
+static Value clockNative(int argCount, Value* args){
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+// spawn(fn, args...) starts fn on a fiber of its own and returns the fiber. It first runs once the caller yields.
+static Value spawnNative(int argCount, Value* args){
+    if(exec.isWorker){
+        exec.nativeError = "Can't spawn fibers inside a parallel for.";
+        return NIL_VAL;
+    }
+    if(argCount < 1){
+        exec.nativeError = "spawn() needs a function to run.";
+        return NIL_VAL;
+    }
+    ObjFiber* fiber = spawnFiber(args[0], argCount - 1, args + 1);
+    return fiber == NULL ? NIL_VAL : OBJ_VAL(fiber);
+}
+
+// len(x) is how many elements a vector has, or characters a string. A rope knows without being flattened.
+static Value lenNative(int argCount, Value* args){
+    if(argCount == 1 && IS_VECTOR(args[0])) return INT_VAL(AS_VECTOR(args[0])->length);
+    if(argCount == 1 && IS_STRING(args[0])) return INT_VAL(AS_STRING(args[0])->length);
+    if(argCount == 1 && IS_ROPE(args[0])) return INT_VAL(AS_ROPE(args[0])->length);
+    exec.nativeError = "len() takes a vector or a string.";
+    return NIL_VAL;
+}
+
+// vector(length, first, step) counts up from first in steps of step. Both default to 0, so vector(n) is n zeros.
+static Value vectorNative(int argCount, Value* args){
+    bool ok = argCount >= 1 && argCount <= 3 && IS_INT(args[0]) && AS_INT(args[0]) >= 0 && AS_INT(args[0]) <= INT_MAX;
+    for(int i = 1; ok && i < argCount; i++) ok = IS_NUMERIC(args[i]);
+    if(!ok){
+        exec.nativeError = "vector() takes a length, then optionally a first value and a step.";
+        return NIL_VAL;
+    }
+    double first = argCount > 1 ? AS_DOUBLE(args[1]) : 0;
+    double step = argCount > 2 ? AS_DOUBLE(args[2]) : 0;
+    ObjVector* vector = newVector((int) AS_INT(args[0]));
+    for(int i = 0; i < vector->length; i++){
+        vector->elements[i] = first + step * i;
+    }
+    return OBJ_VAL(vector);
+}
+
+// The one vector a reduction was given, or NULL with the error set.
+static ObjVector* vectorArgument(int argCount, Value* args, bool needsElements, const char* error){
+    if(argCount == 1 && IS_VECTOR(args[0]) && (!needsElements || AS_VECTOR(args[0])->length > 0)){
+        return AS_VECTOR(args[0]);
+    }
+    exec.nativeError = error;
+    return NULL;
+}
+
+static Value sumNative(int argCount, Value* args){
+    ObjVector* vector = vectorArgument(argCount, args, false, "sum() takes a vector.");
+    return vector == NULL ? NIL_VAL : NUMBER_VAL(vectorSum(vector->elements, vector->length));
+}
+
+static Value minNative(int argCount, Value* args){
+    ObjVector* vector = vectorArgument(argCount, args, true, "min() takes a vector with at least one element.");
+    return vector == NULL ? NIL_VAL : NUMBER_VAL(vectorMin(vector->elements, vector->length));
+}
+
+static Value maxNative(int argCount, Value* args){
+    ObjVector* vector = vectorArgument(argCount, args, true, "max() takes a vector with at least one element.");
+    return vector == NULL ? NIL_VAL : NUMBER_VAL(vectorMax(vector->elements, vector->length));
+}
+
+// Natives are just globals holding an ObjNative.
+static void defineNative(const char* name, NativeFn function){
+    //Keep both objects on the stack while the global is set up, it allocates.
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    push(OBJ_VAL(newNative(function)));
+    int slot = resolveGlobal(AS_STRING(exec.stack[0]));
+    vm.globalValues.values[slot] = exec.stack[1];
+    pop();
+    pop();
+}
+
 void initVM(){
+    exec.fiber = NULL;
+    exec.stack = NULL;
+    exec.frames = NULL;
     resetStack();
+    vm.rootFiber = NULL;
+    vm.readyHead = NULL;
+    vm.readyTail = NULL;
+    exec.budget = 0;
+    exec.nativeError = NULL;
+    exec.isWorker = false;
+    vm.printStream = stdout;
+    vm.errorStream = stderr;
+    vm.fiberSwitches = 0;
+    vm.functionsCompiled = 0;
+    vm.functionsDeferred = 0;
+    vm.functionsCompiledLate = 0;
+    vm.objects = NULL;
+    vm.bytesAllocated = 0;
+    vm.gcDebt = 0;
+    vm.gcPhase = GC_IDLE;
+    vm.grayCount = 0;
+    vm.grayCapacity = 0;
+    vm.grayStack = NULL;
+    vm.sweepList = NULL;
+    vm.gcCyclePauseNs = 0;
+    vm.gcCycleMaxPauseNs = 0;
+    memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+    memset(&vm.memStats, 0, sizeof(vm.memStats));
+    vm.nextGC = 0;
+    configureGC((GCConfig){
+        .pauseBudgetNs      = 500 * 1000,       // 0.5ms
+        .stepBytes          = 64 * 1024,
+        .heapGrowPercent    = 200,
+        .minHeapBytes       = 1024 * 1024,
+    });
+    initTable(&vm.strings);
+    initTable(&vm.globalNames);
+    pthread_mutex_init(&vm.sharedLock, NULL);
+    pthread_mutex_init(&vm.lazyLock, NULL);
+    initValueArray(&vm.globalValues, MEM_GLOBALS);
+    vm.internLookups = 0;
+    vm.internHits = 0;
+    vm.icHits = 0;
+    vm.icMisses = 0;
+
+    //Everything from here on needs a stack to park values on.
+    vm.rootFiber = newFiber();
+    vm.rootFiber->stack = GROW_ARRAY(MEM_STACKS, Value, NULL, 0, UINT8_COUNT);
+    vm.rootFiber->stackTop = vm.rootFiber->stack;
+    vm.rootFiber->stackCapacity = UINT8_COUNT;
+    //It is never scheduled, it is just where the VM is when no script is running.
+    vm.rootFiber->state = FIBER_RUNNING;
+    exec.fiber = vm.rootFiber;
+    exec.stack = exec.stackTop = vm.rootFiber->stack;
+
+    vm.initString = NULL;
+    vm.initString = copyString("init", 4);
+
+    defineNative("clock", clockNative);
+    defineNative("spawn", spawnNative);
+    defineNative("len", lenNative);
+    defineNative("vector", vectorNative);
+    defineNative("sum", sumNative);
+    defineNative("min", minNative);
+    defineNative("max", maxNative);
 }
 
 void freeVM(){
+    freeTable(&vm.strings);
+    freeTable(&vm.globalNames);
+    pthread_mutex_destroy(&vm.sharedLock);
+    pthread_mutex_destroy(&vm.lazyLock);
+    freeValueArray(&vm.globalValues);
+    vm.initString = NULL;
+    stopParallelPool();
+    freeObjects();
+    exec.fiber = NULL;
+    vm.rootFiber = NULL;
+    vm.readyHead = NULL;
+    vm.readyTail = NULL;
+    exec.stack = NULL;
+    exec.frames = NULL;
     resetStack();
 }
 
+/// @brief Find the slot for a global, giving it the next free one if we have not seen the name before.
+/// @return The index of the global in vm.globalValues.
+int resolveGlobal(ObjString* name){
+    Value slot;
+    LOCK_SHARED();
+    if(tableGet(&vm.globalNames, name, &slot)){
+        UNLOCK_SHARED();
+        return (int) AS_NUMBER(slot);
+    }
+
+    int index = vm.globalValues.count;
+    //Both of these can allocate, keep the name safe from the GC.
+    if(localHeap == NULL) push(OBJ_VAL(name));
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalNames, name, NUMBER_VAL(index));
+    if(localHeap == NULL) pop();
+    UNLOCK_SHARED();
+    return index;
+}
+
+int findGlobal(ObjString* name){
+    Value slot;
+    LOCK_SHARED();
+    bool found = tableGet(&vm.globalNames, name, &slot);
+    UNLOCK_SHARED();
+    return found ? (int) AS_NUMBER(slot) : -1;
+}
+
+int globalCount(){
+    LOCK_SHARED();
+    int count = vm.globalValues.count;
+    UNLOCK_SHARED();
+    return count;
+}
+
+// Slow reverse lookup, only for error messages and the disassembler.
+ObjString* globalName(int slot){
+    for(int i = 0; i < vm.globalNames.capacity; i++){
+        Entry* entry = &vm.globalNames.entries[i];
+        if(entry->key != NULL && (int) AS_NUMBER(entry->value) == slot) return entry->key;
+    }
+    return NULL;
+}
+
+void printVMStats(){
+    double hitRate = vm.internLookups == 0 ? 0 : (100.0 * vm.internHits) / vm.internLookups;
+    printf("== vm stats ==\n");
+    printf("intern lookups   %llu\n", (unsigned long long) vm.internLookups);
+    printf("intern hits      %llu (%.1f%%)\n", (unsigned long long) vm.internHits, hitRate);
+    printf("interned strings %d / %d slots\n", vm.strings.count, vm.strings.capacity);
+    printf("globals          %d\n", vm.globalValues.count);
+
+    //Count what state every property access site ended up in.
+    int sites[3] = {0, 0, 0};
+    for(Obj* object = vm.objects; object != NULL; object = object->next){
+        if(object->type != OBJ_FUNCTION) continue;
+        Chunk* chunk = &((ObjFunction*)object)->chunk;
+        for(int i = 0; i < chunk->cacheCount; i++){
+            int count = chunk->caches[i].count;
+            if(count == 1) sites[0]++;
+            else if(count > 1 && count <= IC_POLY_MAX) sites[1]++;
+            else if(count > IC_POLY_MAX) sites[2]++;
+        }
+    }
+    uint64_t accesses = vm.icHits + vm.icMisses;
+    printf("ic hits          %llu / %llu (%.1f%%)\n", (unsigned long long) vm.icHits,
+        (unsigned long long) accesses, accesses == 0 ? 0 : (100.0 * vm.icHits) / accesses);
+    printf("ic sites         %d mono, %d poly, %d mega\n", sites[0], sites[1], sites[2]);
+    printf("functions        %llu compiled, %llu skimmed, %llu of those never called\n",
+        (unsigned long long) vm.functionsCompiled, (unsigned long long) vm.functionsDeferred,
+        (unsigned long long) (vm.functionsDeferred - vm.functionsCompiledLate));
+    printOptimizerStats();
+    printGCStats();
+    printf("fiber switches   %llu\n", (unsigned long long) vm.fiberSwitches);
+}
+
 void push(Value value){
     //Set the element at this position 
-    *vm.stackTop = value;
+    *exec.stackTop = value;
     //Incremenet the pointer
-    vm.stackTop++;
+    exec.stackTop++;
 }
 
 Value pop(){
     //Regress the pointer (we are 1 ahead)
-    vm.stackTop--;
-    return *vm.stackTop;
+    exec.stackTop--;
+    return *exec.stackTop;
 }
 
 //We want to peek INTO the stack.
 static Value peek(int depth){
     //Grab the pointer stackTop, and grab the position BEHIND it by depth
-    return vm.stackTop[-1-depth];
+    return exec.stackTop[-1-depth];
 }
 
-static void runTimeError( const char* format, ...){
+static void runtimeError( const char* format, ...){
+    //Parallel for workers can fail at the same time, keep each report in one piece.
+    LOCK_SHARED();
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm.errorStream, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm.errorStream);
+
+    //Walk the frames from the innermost call out. Each ip is just past the instruction that was running,
+    //the line table says where that came from. Code without one has only what OP_UPDATE_LINE told us.
+    for(int i = exec.frameCount - 1; i >= 0; i--){
+        CallFrame* frame = &exec.frames[i];
+        ObjFunction* function = frame->function;
+        Chunk* chunk = &function->chunk;
+        int line = chunk->lineCount > 0 ? getLine(chunk, (int)(frame->ip - chunk->code) - 1) : exec.line;
+        if(function->name == NULL){
+            fprintf(vm.errorStream, "[line %d] in script\n", line);
+        } else {
+            fprintf(vm.errorStream, "[line %d] in %s()\n", line, function->name->chars);
+        }
+    }
+    UNLOCK_SHARED();
+    resetStack();
+    exec.fiber->state = FIBER_FAILED;
+}
+
+// A lazy function gets its code on the first call. Workers can get there at the same time,
+// the lock makes sure only one of them compiles it.
+static bool ensureCompiled(ObjFunction* function){
+    if(atomic_load_explicit(&function->verified, memory_order_acquire)) return true;
+    pthread_mutex_lock(&vm.lazyLock);
+    bool ok = atomic_load_explicit(&function->verified, memory_order_acquire) || compileLazy(function);
+    pthread_mutex_unlock(&vm.lazyLock);
+    return ok;
+}
+
+// STACK GROWTH
+// Fibers start with small stacks. call() makes room for the callee before its frame goes in,
+// so nothing inside run() ever has to check.
+
+static void ensureFrames(){
+    ObjFiber* fiber = exec.fiber;
+    if(exec.frameCount < fiber->frameCapacity) return;
+    int capacity = GROW_CAPACITY(fiber->frameCapacity);
+    fiber->frames = GROW_ARRAY(MEM_STACKS, CallFrame, fiber->frames, fiber->frameCapacity, capacity);
+    fiber->frameCapacity = capacity;
+    exec.frames = fiber->frames;
+}
+
+// Room for needed more values above stackTop. Frames point into the stack, so they move with it.
+static void ensureStack(int needed){
+    ObjFiber* fiber = exec.fiber;
+    int used = (int)(exec.stackTop - exec.stack);
+    if(used + needed <= fiber->stackCapacity) return;
+
+    int slots[FRAMES_MAX];
+    for(int i = 0; i < exec.frameCount; i++){
+        slots[i] = (int)(exec.frames[i].slots - exec.stack);
+    }
+    int capacity = fiber->stackCapacity;
+    while(capacity < used + needed) capacity = GROW_CAPACITY(capacity);
+    fiber->stack = GROW_ARRAY(MEM_STACKS, Value, fiber->stack, fiber->stackCapacity, capacity);
+    fiber->stackCapacity = capacity;
+
+    exec.stack = fiber->stack;
+    exec.stackTop = exec.stack + used;
+    for(int i = 0; i < exec.frameCount; i++){
+        exec.frames[i].slots = exec.stack + slots[i];
+    }
+}
+
+// Push a new frame. The arguments are already on the stack right after the callee,
+// so they become its first locals where they are, nothing is copied.
+// Every function is verified before its first frame goes in, lazy ones just below, so its operands
+// and stack use are already known good and run() does not check them again.
+static bool call(ObjFunction* function, int argCount){
+    if(argCount != function->arity){
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if(exec.frameCount == FRAMES_MAX){
+        runtimeError("Stack overflow.");
+        return false;
+    }
+    if(!ensureCompiled(function)){
+        runtimeError("Can't call %s, it has a compile error.", function->name->chars);
+        return false;
+    }
+
+    ensureFrames();
+    //The callee and its arguments are in place already, the verifier told us how far past them it goes.
+    ensureStack(function->maxStack - argCount - 1 + STACK_SLACK);
 
-    //Set the IP to the start of the code block to stop code from executing.
-    size_t instruction = vm.ip - vm.chunk->code -1;
-    
+    CallFrame* frame = &exec.frames[exec.frameCount++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = exec.stackTop - argCount - 1;
+    return true;
+}
+
+static bool callValue(Value callee, int argCount){
+    if(IS_OBJ(callee)){
+        switch(OBJ_TYPE(callee)){
+            case OBJ_BOUND_METHOD: {
+                //The receiver takes the callee's slot so it becomes 'this'.
+                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+                exec.stackTop[-argCount - 1] = bound->receiver;
+                return call(bound->method, argCount);
+            }
+            case OBJ_CLASS: {
+                //Calling a class makes an instance, which replaces the class on the stack.
+                ObjClass* klass = AS_CLASS(callee);
+                exec.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                Value initializer;
+                if(tableGet(&klass->methods, vm.initString, &initializer)){
+                    return call(AS_FUNCTION(initializer), argCount);
+                } else if(argCount != 0){
+                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    return false;
+                }
+                return true;
+            }
+            case OBJ_FUNCTION:
+                return call(AS_FUNCTION(callee), argCount);
+            case OBJ_NATIVE: {
+                NativeFn native = AS_NATIVE(callee);
+                Value result = native(argCount, exec.stackTop - argCount);
+                if(exec.nativeError != NULL){
+                    const char* message = exec.nativeError;
+                    exec.nativeError = NULL;
+                    runtimeError("%s", message);
+                    return false;
+                }
+                //Drop the arguments and the native itself, leave the result.
+                exec.stackTop -= argCount + 1;
+                push(result);
+                return true;
+            }
+            default:
+                break; //Not callable
+        }
+    }
+    runtimeError("Can only call functions.");
+    return false;
+}
+
+// Find the entry for this shape. The first entry is checked on its own since most sites are monomorphic.
+static inline ICEntry* icLookup(InlineCache* cache, ObjShape* shape){
+    if(cache->count > 0 && cache->entries[0].shape == shape) return &cache->entries[0];
+    int count = cache->count < IC_POLY_MAX ? cache->count : IC_POLY_MAX;
+    for(int i = 1; i < count; i++){
+        if(cache->entries[i].shape == shape) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// Remember a lookup. Once a site has seen more than IC_POLY_MAX shapes it is megamorphic
+// and keeps the entries it has without learning new ones.
+static void icRemember(ObjFunction* function, InlineCache* cache, ObjShape* shape, int offset, Obj* target){
+    //Caches are shared, parallel for workers only read them.
+    if(exec.isWorker) return;
+    cache->misses++;
+    vm.icMisses++;
+    if(cache->count >= IC_POLY_MAX){
+        cache->count = IC_POLY_MAX + 1;
+        return;
+    }
+    ICEntry* entry = &cache->entries[cache->count++];
+    entry->shape = shape;
+    entry->offset = offset;
+    entry->target = target;
+    gcWriteBarrier((Obj*)function, OBJ_VAL(shape));
+    if(target != NULL) gcWriteBarrier((Obj*)function, OBJ_VAL(target));
+}
+
+// nil and false are falsey, everything else is truthy.
+static bool isFalsey(Value value){
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Peek rather than pop the operands so they are still on the stack while the result is built.
+// Short strings are joined straight away, anything longer becomes a rope (see Bnuuy_object.h).
+static void concatenate(){
+    Value b = peek(0);
+    Value a = peek(1);
+    Obj* result;
+    if(IS_STRING(a) && IS_STRING(b) && AS_STRING(a)->length + AS_STRING(b)->length < ROPE_MIN_LENGTH){
+        result = (Obj*)concatenateStrings(AS_STRING(a), AS_STRING(b));
+    } else {
+        result = (Obj*)newRope(AS_OBJ(a), AS_OBJ(b));
+    }
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+}
+
+// Swap a rope on the stack for its flat string. It stays on the stack, and so alive, while that is made.
+static void flattenAt(int distance){
+    Value value = peek(distance);
+    if(IS_ROPE(value)) exec.stackTop[-1 - distance] = OBJ_VAL(flattenRope(AS_ROPE(value)));
+}
+
+// Arithmetic with a vector on either side goes element by element, and a number on the other side is used
+// for every element. The kernels do the looping, so a long vector costs one dispatch rather than one per element.
+// The result replaces both operands. Without a vector this is just the error for bad operands.
+static bool vectorArithmetic(VectorOp op){
+    Value b = peek(0);
+    Value a = peek(1);
+    if(!IS_VECTOR(a) && !IS_VECTOR(b)){
+        runtimeError("Operands must be numbers.");
+        return false;
+    }
+    if((!IS_VECTOR(a) && !IS_NUMERIC(a)) || (!IS_VECTOR(b) && !IS_NUMERIC(b))){
+        runtimeError("Operands must be numbers or vectors.");
+        return false;
+    }
+    int length = IS_VECTOR(a) ? AS_VECTOR(a)->length : AS_VECTOR(b)->length;
+    if(IS_VECTOR(a) && IS_VECTOR(b) && AS_VECTOR(b)->length != length){
+        runtimeError("Vectors must be the same length, not %d and %d.", length, AS_VECTOR(b)->length);
+        return false;
+    }
+
+    //Both operands stay on the stack while the result is allocated.
+    ObjVector* result = newVector(length);
+    if(!IS_VECTOR(a)){
+        scalarVector(op, result->elements, AS_DOUBLE(a), AS_VECTOR(b)->elements, length);
+    } else if(!IS_VECTOR(b)){
+        vectorScalar(op, result->elements, AS_VECTOR(a)->elements, AS_DOUBLE(b), length);
+    } else {
+        vectorBinary(op, result->elements, AS_VECTOR(a)->elements, AS_VECTOR(b)->elements, length);
+    }
+    exec.stackTop--;
+    exec.stackTop[-1] = OBJ_VAL(result);
+    return true;
 }
 
 //This is the program.
 // The virtual machine reads bytes from the chunk and
 // 'dispatches' or 'decodes' them to the C implementation of the code.
 
+// PARALLEL FOR
+// "for sum (i = start, end) body" calls the body once for every i in [start, end) on every core and
+// folds the numbers it produces together. Each participant runs on its own thread with its own
+// ExecContext, fiber and local heap, so the bodies share nothing but what they can read. Bodies can't
+// change globals or fields, so the order they run in only shows in the last bits of a float sum.
+
+static InterpretResult run();
+
+// One participant's partial result, and the fiber it runs bodies on. Made on its own thread, first time it gets work.
+typedef struct {
+    bool ready;
+    LocalHeap heap;
+    ObjFiber* fiber;
+    double sum;
+    int64_t intSum;         // The same sum, while every value so far was an integer and it has not overflowed.
+    bool exact;
+    Value min;
+    Value max;
+    int64_t count;
+    char padding[64];       // Participants write these constantly, keep them off each other's cache lines.
+} ForWorker;
+
+typedef struct {
+    ObjFunction* body;
+    Reduction reduction;
+    ForWorker* workers;
+    atomic_bool failed;
+} ForJob;
+
+static void startForWorker(ForWorker* worker, ObjFunction* body){
+    localHeap = &worker->heap;
+    ObjFiber* fiber = newFiber();
+    int capacity = body->maxStack + STACK_SLACK;
+    fiber->stack = GROW_ARRAY(MEM_STACKS, Value, NULL, 0, capacity);
+    fiber->stackTop = fiber->stack;
+    fiber->stackCapacity = capacity;
+    fiber->frames = GROW_ARRAY(MEM_STACKS, CallFrame, NULL, 0, GROW_CAPACITY(0));
+    fiber->frameCapacity = GROW_CAPACITY(0);
+    fiber->state = FIBER_RUNNING;
+
+    exec.fiber = fiber;
+    exec.stack = fiber->stack;
+    exec.stackTop = fiber->stack;
+    exec.frames = fiber->frames;
+    exec.frameCount = 0;
+    exec.nativeError = NULL;
+    exec.isWorker = true;
+    worker->fiber = fiber;
+    worker->ready = true;
+}
+
+// Run the body for every index in [lo, hi). Returns false once anything has failed, which stops the pool.
+static bool forRange(int participant, int64_t lo, int64_t hi, void* data){
+    ForJob* job = (ForJob*) data;
+    ForWorker* worker = &job->workers[participant];
+    if(!worker->ready) startForWorker(worker, job->body);
+
+    for(int64_t i = lo; i < hi; i++){
+        if(atomic_load_explicit(&job->failed, memory_order_relaxed)) return false;
+        exec.stackTop = exec.stack;
+        exec.frameCount = 0;
+        push(OBJ_VAL(job->body));
+        push(INT_VAL(i));
+        //Only a damaged image can get the arity wrong, but then there is no frame to run. call() reported it.
+        if(!call(job->body, 1)){
+            atomic_store(&job->failed, true);
+            return false;
+        }
+        worker->fiber->state = FIBER_RUNNING;
+
+        //A worker has nobody to hand over to, yields and used up budgets just carry on.
+        while(worker->fiber->state == FIBER_RUNNING){
+            exec.budget = INT_MAX;
+            if(run() != INTERPRET_OK) break;
+        }
+        if(worker->fiber->state != FIBER_DONE){
+            atomic_store(&job->failed, true);
+            return false;
+        }
+
+        Value result = worker->fiber->result;
+        if(!IS_NUMERIC(result)){
+            runtimeError("Parallel for body must produce a number.");
+            atomic_store(&job->failed, true);
+            return false;
+        }
+        double value = AS_DOUBLE(result);
+        worker->sum += value;
+        if(worker->exact && (!IS_INT(result) || ADD_OVERFLOWS(worker->intSum, AS_INT(result), &worker->intSum))){
+            worker->exact = false;
+        }
+        if(worker->count == 0 || value < AS_DOUBLE(worker->min)) worker->min = result;
+        if(worker->count == 0 || value > AS_DOUBLE(worker->max)) worker->max = result;
+        worker->count++;
+    }
+    return true;
+}
+
+static bool isWholeNumber(Value value){
+    if(IS_INT(value)) return true;
+    //Past +-2^63 the conversion below is undefined.
+    return IS_NUMBER(value) && AS_NUMBER(value) > -9.2e18 && AS_NUMBER(value) < 9.2e18 &&
+           AS_NUMBER(value) == (double)(int64_t) AS_NUMBER(value);
+}
+
+static int64_t wholeNumber(Value value){
+    return IS_INT(value) ? AS_INT(value) : (int64_t) AS_NUMBER(value);
+}
+
+/// @brief Run the parallel for on top of the stack: start, end, then the body. Leaves the result in their place.
+static bool parallelFor(Reduction reduction){
+    if(exec.isWorker){
+        runtimeError("Can't nest a parallel for inside another.");
+        return false;
+    }
+    if(!isWholeNumber(peek(2)) || !isWholeNumber(peek(1))){
+        runtimeError("Parallel for range must be whole numbers.");
+        return false;
+    }
+    //The compiler always puts the body here, but the verifier only proves the stack depth.
+    if(!IS_FUNCTION(peek(0))){
+        runtimeError("Parallel for body must be a function.");
+        return false;
+    }
+    ObjFunction* body = AS_FUNCTION(peek(0));
+    int64_t start = wholeNumber(peek(2));
+    int64_t end = wholeNumber(peek(1));
+    //The pool splits the range by its length, which has to be a number we can hold.
+    int64_t length;
+    if(end > start && SUB_OVERFLOWS(end, start, &length)){
+        runtimeError("Parallel for range is too long.");
+        return false;
+    }
+
+    //Like the compile workers, the bodies can't run alongside a collection and don't pay into the VM's heap.
+    if(vm.gcPhase != GC_IDLE) collectGarbage();
+
+    int participants = parallelParticipants();
+    ForWorker* workers = malloc(sizeof(ForWorker) * participants);
+    if(workers == NULL) exit(1);
+    for(int i = 0; i < participants; i++){
+        workers[i] = (ForWorker){ .ready = false, .heap = { NULL, 0 }, .fiber = NULL,
+                                  .sum = 0, .intSum = 0, .exact = true, .count = 0 };
+    }
+    ForJob job = { .body = body, .reduction = reduction, .workers = workers };
+    atomic_init(&job.failed, false);
+
+    //This thread joins in as participant 0, so its registers have to survive.
+    ExecContext saved = exec;
+    parallelRange(start, end, forRange, &job);
+    exec = saved;
+    localHeap = NULL;
+
+    double sum = 0;
+    int64_t intSum = 0;
+    bool exact = true;
+    Value min = NIL_VAL;
+    Value max = NIL_VAL;
+    int64_t count = 0;
+    for(int i = 0; i < participants; i++){
+        ForWorker* worker = &workers[i];
+        if(!worker->ready) continue;
+        //Their fibers are garbage now, anything else they made is reachable through the result or the strings.
+        adoptLocalHeap(&worker->heap);
+        if(worker->count == 0) continue;
+        sum += worker->sum;
+        if(exact && (!worker->exact || ADD_OVERFLOWS(intSum, worker->intSum, &intSum))) exact = false;
+        if(count == 0 || AS_DOUBLE(worker->min) < AS_DOUBLE(min)) min = worker->min;
+        if(count == 0 || AS_DOUBLE(worker->max) > AS_DOUBLE(max)) max = worker->max;
+        count += worker->count;
+    }
+    free(workers);
+
+    if(atomic_load(&job.failed)){
+        //The worker that failed already reported why, fail this fiber along with it.
+        exec.fiber->state = FIBER_FAILED;
+        resetStack();
+        return false;
+    }
+
+    //An empty range has no smallest or biggest, min and max are still nil then.
+    Value result = reduction == REDUCE_MIN ? min : max;
+    if(reduction == REDUCE_SUM) result = exact ? INT_VAL(intSum) : NUMBER_VAL(sum);
+    pop();
+    pop();
+    pop();
+    push(result);
+    return true;
+}
+
+// DISPATCH MODES
+// An atomic int is lock free everywhere we run, so signal handlers and other threads can both write it.
+static atomic_int dispatchMode = DISPATCH_PLAIN;
+static _Atomic uint64_t opcodeCounts[OP_COUNT];    // Instructions run while profiling, by opcode.
+static StepHook stepHook = NULL;
+static void* stepData = NULL;
+
+void setDispatchMode(DispatchMode mode){
+    atomic_store_explicit(&dispatchMode, mode, memory_order_relaxed);
+}
+
+DispatchMode getDispatchMode(){
+    return (DispatchMode) atomic_load_explicit(&dispatchMode, memory_order_relaxed);
+}
+
+void setStepHook(StepHook hook, void* data){
+    stepHook = hook;
+    stepData = data;
+}
+
+#ifdef SIGUSR1
+static void toggleDispatch(int signal){
+    DispatchMode mode = signal == SIGUSR1 ? DISPATCH_TRACE : DISPATCH_PROFILE;
+    setDispatchMode(getDispatchMode() == mode ? DISPATCH_PLAIN : mode);
+}
+#endif
+
+void installDispatchSignals(){
+#ifdef SIGUSR1
+    signal(SIGUSR1, toggleDispatch);
+    signal(SIGUSR2, toggleDispatch);
+#endif
+}
+
+// The stack, then the instruction about to run.
+static void traceInstruction(ObjFunction* function, int offset){
+    //Keep each line in one piece when workers are tracing too.
+    LOCK_SHARED();
+    printf("            ");
+    for(Value* slot = exec.stack; slot < exec.stackTop; slot++){
+        printf("[");
+        printValue(*slot);
+        printf("]");
+    }
+    printf("\n");
+    disassembleInstruction(&function->chunk, offset);
+    UNLOCK_SHARED();
+}
+
+// The default step hook. Return steps, c carries on without stopping, t and p carry on tracing or
+// profiling, and q stops the script.
+static bool promptStep(void* data, ObjFunction* function, int offset){
+    (void) data;
+    traceInstruction(function, offset);
+    printf("step> ");
+    fflush(stdout);
+    char line[64];
+    if(!fgets(line, sizeof(line), stdin)){
+        setDispatchMode(DISPATCH_PLAIN);
+        return true;
+    }
+    switch(line[0]){
+        case 'c': setDispatchMode(DISPATCH_PLAIN); break;
+        case 't': setDispatchMode(DISPATCH_TRACE); break;
+        case 'p': setDispatchMode(DISPATCH_PROFILE); break;
+        case 'q': return false;
+    }
+    return true;
+}
+
+// What the instrumented tables do before each instruction. False stops the script.
+static bool instrument(DispatchMode mode, CallFrame* frame, uint8_t* ip){
+    ObjFunction* function = frame->function;
+    int offset = (int)(ip - function->chunk.code);
+    switch(mode){
+        case DISPATCH_TRACE:
+            traceInstruction(function, offset);
+            return true;
+        case DISPATCH_PROFILE:
+            atomic_fetch_add_explicit(&opcodeCounts[*ip], 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&function->profileCount, 1, memory_order_relaxed);
+            return true;
+        case DISPATCH_STEP:
+            //There is only one terminal to ask, workers just run.
+            if(exec.isWorker) return true;
+            if(stepHook != NULL ? stepHook(stepData, function, offset) : promptStep(NULL, function, offset)) return true;
+            //ip is at the instruction we stopped before, step it past the opcode so the error names its line.
+            frame->ip = ip + 1;
+            runtimeError("Stopped while stepping.");
+            return false;
+        default:
+            return true;
+    }
+}
+
+#define PROFILE_TOP 10
+
+void printProfile(){
+    uint64_t total = 0;
+    for(int i = 0; i < OP_COUNT; i++) total += opcodeCounts[i];
+    if(total == 0) return;
+    printf("== profile ==\n");
+    printf("instructions     %llu\n", (unsigned long long) total);
+
+    //Opcodes from most run to least. There are few enough to just pick the biggest each time.
+    bool shown[OP_COUNT] = {false};
+    for(;;){
+        int best = -1;
+        for(int i = 0; i < OP_COUNT; i++){
+            if(!shown[i] && opcodeCounts[i] > 0 && (best < 0 || opcodeCounts[i] > opcodeCounts[best])) best = i;
+        }
+        if(best < 0) break;
+        shown[best] = true;
+        printf("  %-22s %12llu %5.1f%%\n", opcodeName(best),
+            (unsigned long long) opcodeCounts[best], (100.0 * opcodeCounts[best]) / total);
+    }
+
+    //The busiest functions, kept sorted as we walk every object.
+    ObjFunction* top[PROFILE_TOP];
+    int count = 0;
+    for(Obj* object = vm.objects; object != NULL; object = object->next){
+        if(object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*) object;
+        uint64_t runs = function->profileCount;
+        if(runs == 0) continue;
+        int i = count < PROFILE_TOP ? count++ : PROFILE_TOP;
+        while(i > 0 && top[i - 1]->profileCount < runs){
+            if(i < PROFILE_TOP) top[i] = top[i - 1];
+            i--;
+        }
+        if(i < PROFILE_TOP) top[i] = function;
+    }
+    printf("busiest functions\n");
+    for(int i = 0; i < count; i++){
+        uint64_t runs = top[i]->profileCount;
+        printf("  %-22s %12llu %5.1f%%\n", top[i]->name != NULL ? top[i]->name->chars : "<script>",
+            (unsigned long long) runs, (100.0 * runs) / total);
+    }
+}
+
 static InterpretResult run(){
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+    //Keep the current frame and its ip in locals, the compiler can keep them in registers.
+    //The ip is written back to the frame whenever another frame takes over.
+    CallFrame* frame = &exec.frames[exec.frameCount - 1];
+    uint8_t* ip = frame->ip;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+//Errors read each frame's line from its ip, so ours has to be written back before reporting one.
+#define RUNTIME_ERROR(...) \
+        do {\
+        frame->ip = ip;\
+        runtimeError(__VA_ARGS__);\
+        return INTERPRET_RUNTIME_ERROR;\
+    } while (false)
 //Use a macro to define tedious repeatable chunks of code in C
 // We must unwrap, then rewrap the value
-#define BINARY_OP(op) \
+// Two integers stay integers while the result fits in 64 bits, other numbers are done in doubles.
+// The result goes straight into a's slot. Anything else had better involve a vector.
+#define ARITHMETIC_OP(overflows, op, vectorOp) \
         do {\
-        double b = AS_NUMBER(pop());\
-        double a = AS_NUMBER(pop());\
-        push(NUMBER_VAL((a op b)));\
+        Value b = peek(0);\
+        Value a = peek(1);\
+        if(IS_INT(a) && IS_INT(b)){\
+            int64_t result;\
+            if(!overflows(AS_INT(a), AS_INT(b), &result)){\
+                exec.stackTop--;\
+                exec.stackTop[-1] = INT_VAL(result);\
+                break;\
+            }\
+        }\
+        if(!IS_NUMERIC(a) || !IS_NUMERIC(b)){\
+            frame->ip = ip;\
+            if(!vectorArithmetic(vectorOp)) return INTERPRET_RUNTIME_ERROR;\
+            break;\
+        }\
+        exec.stackTop--;\
+        exec.stackTop[-1] = NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b));\
     } while (false)\
 
-//Definition for local scope to advance instruction pointer.
-    for (;;) {
-        //If we are in DEBUG mode, disassemble the instruction.
-        #ifdef DEBUG_TRACE_EXECUTION
-        //Dump the stack
-        printf("            ");
-        for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
-            printf("[");
-            printValue(*slot);
-            printf("]");
-        }
-        printf("\n");
-        //Dissassemble the chunk
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-        #endif
+#define COMPARISON_OP(op) \
+        do {\
+        Value b = peek(0);\
+        Value a = peek(1);\
+        bool result;\
+        if(IS_INT(a) && IS_INT(b)){\
+            result = AS_INT(a) op AS_INT(b);\
+        } else if(IS_NUMERIC(a) && IS_NUMERIC(b)){\
+            result = AS_DOUBLE(a) op AS_DOUBLE(b);\
+        } else {\
+            RUNTIME_ERROR("Operands must be numbers.");\
+        }\
+        exec.stackTop--;\
+        exec.stackTop[-1] = BOOL_VAL(result);\
+    } while (false)\
+
+//Parallel for workers may read anything shared but not write to it.
+#define WORKER_CANT(message) \
+        do {\
+        if(exec.isWorker){\
+            RUNTIME_ERROR("Can't " message " inside a parallel for.");\
+        }\
+    } while (false)
+
+    //Each opcode's code starts at OPCODE(op) and ends by going straight on to the next instruction with NEXT.
+    //With GCC and Clang that is a jump through the active dispatch table, so each handler ends in an
+    //indirect jump of its own. Elsewhere it is a plain switch in a loop.
+    //The instrumented tables send every opcode through a hook first, which then carries on to the plain
+    //handler. The table is picked when run() starts, and run() starts over at least every fiber slice,
+    //so a mode change takes effect within FIBER_SLICE loops or calls and the plain table pays nothing for it.
+#ifdef COMPUTED_GOTO
+#define OPCODE(op)  op_##op:
+#define NEXT        goto *dispatch[READ_BYTE()]
+    static void* const plainTable[OP_COUNT] = {
+        [OP_ADD] = &&op_OP_ADD,                 [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,           [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_NEGATE] = &&op_OP_NEGATE,           [OP_NOT] = &&op_OP_NOT,
+        [OP_EQUAL] = &&op_OP_EQUAL,             [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,               [OP_UPDATE_LINE] = &&op_OP_UPDATE_LINE,
+        [OP_CONSTANT] = &&op_OP_CONSTANT,       [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,   [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_DEFINE_GLOBAL_NAME] = &&op_OP_DEFINE_GLOBAL_NAME,
+        [OP_GET_GLOBAL_NAME] = &&op_OP_GET_GLOBAL_NAME,
+        [OP_SET_GLOBAL_NAME] = &&op_OP_SET_GLOBAL_NAME,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,     [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY, [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_NIL] = &&op_OP_NIL,                 [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,             [OP_PRINT] = &&op_OP_PRINT,
+        [OP_VECTOR] = &&op_OP_VECTOR,           [OP_INDEX] = &&op_OP_INDEX,
+        [OP_POP] = &&op_OP_POP,                 [OP_DUP] = &&op_OP_DUP,
+        [OP_JUMP] = &&op_OP_JUMP,               [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,               [OP_CALL] = &&op_OP_CALL,
+        [OP_YIELD] = &&op_OP_YIELD,             [OP_PARALLEL_FOR] = &&op_OP_PARALLEL_FOR,
+        [OP_CLASS] = &&op_OP_CLASS,             [OP_METHOD] = &&op_OP_METHOD,
+        [OP_RETURN] = &&op_OP_RETURN,
+    };
+    static void* const traceTable[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&traceDispatch };
+    static void* const profileTable[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&profileDispatch };
+    static void* const stepTable[OP_COUNT] = { [0 ... OP_COUNT - 1] = &&stepDispatch };
+    static void* const* const tables[DISPATCH_MODE_COUNT] = { plainTable, traceTable, profileTable, stepTable };
+    void* const* dispatch = tables[getDispatchMode()];
 
-        uint8_t instruction;    // Byte under the pointer for the bytecode.
+    NEXT;
 
-        switch (instruction = READ_BYTE()){
+//The hooks see the opcode before it runs, then pick the table again so switching off is immediate.
+#define HOOK(mode) \
+        ip--;\
+        if(!instrument(mode, frame, ip)) return INTERPRET_RUNTIME_ERROR;\
+        dispatch = tables[getDispatchMode()];\
+        goto *plainTable[READ_BYTE()];
+traceDispatch:      HOOK(DISPATCH_TRACE)
+profileDispatch:    HOOK(DISPATCH_PROFILE)
+stepDispatch:       HOOK(DISPATCH_STEP)
+#undef HOOK
+
+    {
+#else
+#define OPCODE(op)  case op:
+#define NEXT        continue
+    DispatchMode mode = getDispatchMode();
+    for (;;) {
+        if(mode != DISPATCH_PLAIN){
+            if(!instrument(mode, frame, ip)) return INTERPRET_RUNTIME_ERROR;
+            mode = getDispatchMode();
+        }
+        switch (READ_BYTE()){
+#endif
             //Binary arithmetic operations
-            case OP_ADD:                BINARY_OP(+); break;
-            case OP_SUBTRACT:           BINARY_OP(-); break;
-            case OP_MULTIPLY:           BINARY_OP(*); break;
-            case OP_DIVIDE:             BINARY_OP(/); break;
+            OPCODE(OP_ADD) {
+                //Add is overloaded for strings. Numbers come first, they are the common case.
+                if(IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1))){
+                    ARITHMETIC_OP(ADD_OVERFLOWS, +, VECTOR_ADD);
+                } else if(IS_TEXT(peek(0)) && IS_TEXT(peek(1))){
+                    concatenate();
+                } else if(IS_VECTOR(peek(0)) || IS_VECTOR(peek(1))){
+                    frame->ip = ip;
+                    if(!vectorArithmetic(VECTOR_ADD)) return INTERPRET_RUNTIME_ERROR;
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                }
+                NEXT;
+            }
+            OPCODE(OP_SUBTRACT)           ARITHMETIC_OP(SUB_OVERFLOWS, -, VECTOR_SUBTRACT); NEXT;
+            OPCODE(OP_MULTIPLY)           ARITHMETIC_OP(MUL_OVERFLOWS, *, VECTOR_MULTIPLY); NEXT;
+            OPCODE(OP_DIVIDE) {
+                //Integers only divide to an integer when it comes out exact.
+                if(IS_INT(peek(0)) && IS_INT(peek(1))){
+                    int64_t b = AS_INT(peek(0));
+                    int64_t a = AS_INT(peek(1));
+                    if(b != 0 && !(a == INT64_MIN && b == -1) && a % b == 0){
+                        pop();
+                        exec.stackTop[-1] = INT_VAL(a / b);
+                        NEXT;
+                    }
+                }
+                if(!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))){
+                    frame->ip = ip;
+                    if(!vectorArithmetic(VECTOR_DIVIDE)) return INTERPRET_RUNTIME_ERROR;
+                    NEXT;
+                }
+                double b = AS_DOUBLE(peek(0));
+                double a = AS_DOUBLE(peek(1));
+                pop();
+                pop();
+                push(NUMBER_VAL(a / b));
+                NEXT;
+            }
+            //Comparisons
+            OPCODE(OP_GREATER)            COMPARISON_OP(>); NEXT;
+            OPCODE(OP_LESS)               COMPARISON_OP(<); NEXT;
+            OPCODE(OP_EQUAL) {
+                //Strings compare by pointer, which needs ropes to be interned strings first.
+                flattenAt(0);
+                flattenAt(1);
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(valuesEqual(a, b)));
+                NEXT;
+            }
+            OPCODE(OP_NOT)
+                push(BOOL_VAL(isFalsey(pop())));
+                NEXT;
 
             //Unary operation, negate a variable on the stack
-            case OP_NEGATE: {
+            OPCODE(OP_NEGATE) {
                 //We have to check that the next number is a type that can be negated in terms of primitive.
+                if(IS_INT(peek(0))){
+                    //The one integer with no positive twin.
+                    int64_t value = AS_INT(peek(0));
+                    exec.stackTop[-1] = value == INT64_MIN ? NUMBER_VAL(-(double) value) : INT_VAL(-value);
+                    NEXT;
+                }
+                if(IS_VECTOR(peek(0))){
+                    //The vector stays on the stack while its negation is allocated.
+                    ObjVector* vector = AS_VECTOR(peek(0));
+                    ObjVector* result = newVector(vector->length);
+                    vectorNegate(result->elements, vector->elements, vector->length);
+                    exec.stackTop[-1] = OBJ_VAL(result);
+                    NEXT;
+                }
                 if(!IS_NUMBER(peek(0))){
                     //Print an eror message and return runtimeerrorcode.
-                    runtimeError("Operand must be a number for operation negate");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number for operation negate");
                 }
                 // We must unwrap and then re-wrap the value
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+                NEXT;
             }
             // Update line bytecode
-            case OP_UPDATE_LINE: {
+            OPCODE(OP_UPDATE_LINE) {
                 uint8_t line = READ_BYTE();
-                vm.line = line;
-                break;
+                exec.line = line;
+                NEXT;
             }
             //For a constant bytecode we read the Constant and for now we will print it.
-            case OP_CONSTANT: {
+            OPCODE(OP_CONSTANT) {
                 //printf("OP_CONSTANT");
                 Value constant = READ_CONSTANT();
                 push(constant);
-                break;
+                NEXT;
+            }
+            //Globals. The operand is the slot the compiler gave the name.
+            OPCODE(OP_DEFINE_GLOBAL) {
+                WORKER_CANT("define globals");
+                vm.globalValues.values[READ_BYTE()] = peek(0);
+                pop();
+                NEXT;
+            }
+            OPCODE(OP_GET_GLOBAL) {
+                uint8_t slot = READ_BYTE();
+                Value value = vm.globalValues.values[slot];
+                if(IS_UNDEFINED(value)){
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+                }
+                push(value);
+                NEXT;
+            }
+            OPCODE(OP_SET_GLOBAL) {
+                WORKER_CANT("assign to globals");
+                uint8_t slot = READ_BYTE();
+                //Assignment never creates a global, only var does.
+                if(IS_UNDEFINED(vm.globalValues.values[slot])){
+                    RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
+                }
+                vm.globalValues.values[slot] = peek(0);
+                NEXT;
+            }
+            //Late-bound globals. The operand is the name, which we turn into a slot now.
+            OPCODE(OP_DEFINE_GLOBAL_NAME) {
+                WORKER_CANT("define globals");
+                int slot = resolveGlobal(READ_STRING());
+                vm.globalValues.values[slot] = peek(0);
+                pop();
+                NEXT;
+            }
+            OPCODE(OP_GET_GLOBAL_NAME) {
+                ObjString* name = READ_STRING();
+                Value slot;
+                if(!tableGet(&vm.globalNames, name, &slot) ||
+                   IS_UNDEFINED(vm.globalValues.values[(int) AS_NUMBER(slot)])){
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                push(vm.globalValues.values[(int) AS_NUMBER(slot)]);
+                NEXT;
+            }
+            OPCODE(OP_SET_GLOBAL_NAME) {
+                WORKER_CANT("assign to globals");
+                ObjString* name = READ_STRING();
+                Value slot;
+                if(!tableGet(&vm.globalNames, name, &slot) ||
+                   IS_UNDEFINED(vm.globalValues.values[(int) AS_NUMBER(slot)])){
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                vm.globalValues.values[(int) AS_NUMBER(slot)] = peek(0);
+                NEXT;
+            }
+            //Locals. The operand is the slot in this frame's window of the stack.
+            OPCODE(OP_GET_LOCAL) {
+                uint8_t slot = READ_BYTE();
+                push(frame->slots[slot]);
+                NEXT;
+            }
+            OPCODE(OP_SET_LOCAL) {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = peek(0);
+                NEXT;
+            }
+            //Jumps. The condition is left on the stack for the compiler to pop.
+            //Properties. A cache hit is a shape compare and an indexed load or store.
+            OPCODE(OP_GET_PROPERTY) {
+                ObjString* name = READ_STRING();
+                InlineCache* cache = &frame->function->chunk.caches[READ_SHORT()];
+                if(!IS_INSTANCE(peek(0))){
+                    RUNTIME_ERROR("Only instances have properties.");
+                }
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+
+                ICEntry* entry = icLookup(cache, instance->shape);
+                if(entry != NULL){
+                    if(!exec.isWorker){
+                        cache->hits++;
+                        vm.icHits++;
+                    }
+                    if(entry->offset >= 0){
+                        exec.stackTop[-1] = instance->fields[entry->offset];
+                    } else {
+                        ObjBoundMethod* bound = newBoundMethod(peek(0), (ObjFunction*)entry->target);
+                        exec.stackTop[-1] = OBJ_VAL(bound);
+                    }
+                    NEXT;
+                }
+
+                //Miss. Fields shadow methods.
+                int offset = shapeFieldOffset(instance->shape, name);
+                if(offset >= 0){
+                    icRemember(frame->function, cache, instance->shape, offset, NULL);
+                    exec.stackTop[-1] = instance->fields[offset];
+                    NEXT;
+                }
+                Value method;
+                if(tableGet(&instance->klass->methods, name, &method)){
+                    icRemember(frame->function, cache, instance->shape, -1, AS_OBJ(method));
+                    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_FUNCTION(method));
+                    exec.stackTop[-1] = OBJ_VAL(bound);
+                    NEXT;
+                }
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            }
+            OPCODE(OP_SET_PROPERTY) {
+                WORKER_CANT("set fields");
+                ObjString* name = READ_STRING();
+                InlineCache* cache = &frame->function->chunk.caches[READ_SHORT()];
+                if(!IS_INSTANCE(peek(1))){
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+                ObjInstance* instance = AS_INSTANCE(peek(1));
+                Value value = peek(0);
+
+                ICEntry* entry = icLookup(cache, instance->shape);
+                if(entry != NULL){
+                    cache->hits++;
+                    vm.icHits++;
+                    if(entry->target == NULL){
+                        instance->fields[entry->offset] = value;
+                        gcWriteBarrier((Obj*)instance, value);
+                    } else {
+                        instanceAddField(instance, (ObjShape*)entry->target, value);
+                    }
+                } else {
+                    ObjShape* shape = instance->shape;
+                    int offset = shapeFieldOffset(shape, name);
+                    if(offset >= 0){
+                        icRemember(frame->function, cache, shape, offset, NULL);
+                        instance->fields[offset] = value;
+                        gcWriteBarrier((Obj*)instance, value);
+                    } else {
+                        //New field. Cache the transition so the next instance takes it without a lookup.
+                        ObjShape* next = shapeTransition(shape, name);
+                        icRemember(frame->function, cache, shape, next->fieldCount - 1, (Obj*)next);
+                        instanceAddField(instance, next, value);
+                    }
+                }
+
+                //Leave the value as the result of the assignment.
+                value = pop();
+                pop();
+                push(value);
+                NEXT;
+            }
+            OPCODE(OP_JUMP) {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                NEXT;
+            }
+            OPCODE(OP_JUMP_IF_FALSE) {
+                uint16_t offset = READ_SHORT();
+                if(isFalsey(peek(0))) ip += offset;
+                NEXT;
+            }
+            //Loops and calls are where a fiber can be preempted, every other instruction moves forward.
+            OPCODE(OP_LOOP) {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                if(--exec.budget <= 0){
+                    frame->ip = ip;
+                    return INTERPRET_OK;
+                }
+                NEXT;
+            }
+            OPCODE(OP_CALL) {
+                int argCount = READ_BYTE();
+                frame->ip = ip;
+                if(!callValue(peek(argCount), argCount)){
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &exec.frames[exec.frameCount - 1];
+                ip = frame->ip;
+                if(--exec.budget <= 0){
+                    frame->ip = ip;
+                    return INTERPRET_OK;
+                }
+                NEXT;
             }
-            //If we make it to return without throwing an error we intepreted okay!
-            case OP_RETURN: {
-                //Pop the stack
-                printValue(pop());
-                printf("\n");
+            //The fiber stays RUNNING, the scheduler puts it back in the queue.
+            OPCODE(OP_YIELD)
+                frame->ip = ip;
                 return INTERPRET_OK;
+            OPCODE(OP_PARALLEL_FOR) {
+                Reduction reduction = (Reduction) READ_BYTE();
+                frame->ip = ip;
+                if(!parallelFor(reduction)) return INTERPRET_RUNTIME_ERROR;
+                NEXT;
+            }
+            OPCODE(OP_CLASS)
+                push(OBJ_VAL(newClass(READ_STRING())));
+                NEXT;
+            OPCODE(OP_METHOD) {
+                //The class is under the method on the stack.
+                ObjString* name = READ_STRING();
+                Value method = peek(0);
+                //Once per method per class, so checking what the verifier can't prove costs nothing.
+                if(!IS_FUNCTION(method) || !IS_CLASS(peek(1))){
+                    RUNTIME_ERROR("Methods must be functions added to a class.");
+                }
+                ObjClass* klass = AS_CLASS(peek(1));
+                tableSet(&klass->methods, name, method);
+                gcWriteBarrier((Obj*)klass, method);
+                pop();
+                NEXT;
+            }
+            OPCODE(OP_PRINT) {
+                fprintValue(vm.printStream, pop());
+                fputc('\n', vm.printStream);
+                NEXT;
             }
+            OPCODE(OP_POP)                pop(); NEXT;
+            OPCODE(OP_DUP)                push(peek(0)); NEXT;
+            OPCODE(OP_NIL)                push(NIL_VAL); NEXT;
+            OPCODE(OP_TRUE)               push(BOOL_VAL(true)); NEXT;
+            OPCODE(OP_FALSE)              push(BOOL_VAL(false)); NEXT;
+            //The elements are the top count values, first one deepest.
+            OPCODE(OP_VECTOR) {
+                int count = READ_BYTE();
+                for(int i = 0; i < count; i++){
+                    if(!IS_NUMERIC(peek(i))){
+                        RUNTIME_ERROR("Vector elements must be numbers.");
+                    }
+                }
+                ObjVector* vector = newVector(count);
+                Value* elements = exec.stackTop - count;
+                for(int i = 0; i < count; i++){
+                    vector->elements[i] = AS_DOUBLE(elements[i]);
+                }
+                exec.stackTop = elements;
+                push(OBJ_VAL(vector));
+                NEXT;
+            }
+            OPCODE(OP_INDEX) {
+                if(!IS_VECTOR(peek(1))){
+                    RUNTIME_ERROR("Only vectors can be indexed.");
+                }
+                ObjVector* vector = AS_VECTOR(peek(1));
+                if(!IS_INT(peek(0)) || AS_INT(peek(0)) < 0 || AS_INT(peek(0)) >= vector->length){
+                    RUNTIME_ERROR("Vector index must be an integer from 0 to one less than the length, %d.", vector->length);
+                }
+                double element = vector->elements[AS_INT(peek(0))];
+                exec.stackTop--;
+                exec.stackTop[-1] = NUMBER_VAL(element);
+                NEXT;
+            }
+            //Returning just drops the callee's window off the stack and puts the result where the callee was.
+            OPCODE(OP_RETURN) {
+                Value result = pop();
+                exec.frameCount--;
+                //If we make it out of the fiber's function without throwing an error we intepreted okay!
+                if(exec.frameCount == 0){
+                    pop();
+                    exec.fiber->result = result;
+                    gcWriteBarrier((Obj*)exec.fiber, result);
+                    exec.fiber->state = FIBER_DONE;
+                    return INTERPRET_OK;
+                }
+
+                exec.stackTop = frame->slots;
+                push(result);
+                frame = &exec.frames[exec.frameCount - 1];
+                ip = frame->ip;
+                NEXT;
+            }
+#ifndef COMPUTED_GOTO
+            //Every function we run passed the verifier, so every opcode is one of the above.
             default:
-                printf("Unexpected instruction.");
-                return INTERPRET_COMPILE_ERROR;
+                UNREACHABLE();
         }
+#endif
     }
+#undef OPCODE
+#undef NEXT
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_STRING
+#undef ARITHMETIC_OP
+#undef COMPARISON_OP
+#undef WORKER_CANT
+#undef RUNTIME_ERROR
 }
 
 
 InterpretResult interpret(const char* source){
-    Chunk chunk;
-    startChunk(&chunk);
+    //Compiler takes a source, exports it to a function to feed to VM.
+    ObjFunction* function = compile(source);
+    if(function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function){
+    //The script gets a fiber of its own and runs alongside anything it spawns.
+    push(OBJ_VAL(function));
+    spawnFiber(OBJ_VAL(function), 0, NULL);
+    pop();
+    return runFibers();
+}
 
-    //Compiler takes a source, exports it to a chunk to feed to VM.
-    if(!compile(source, &chunk)){
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+// SCHEDULER
+
+static void enqueueFiber(ObjFiber* fiber){
+    fiber->nextReady = NULL;
+    if(vm.readyTail == NULL){
+        vm.readyHead = fiber;
+    } else {
+        vm.readyTail->nextReady = fiber;
+        gcWriteBarrier((Obj*)vm.readyTail, OBJ_VAL(fiber));
     }
-    
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    vm.readyTail = fiber;
+}
+
+static ObjFiber* dequeueFiber(){
+    ObjFiber* fiber = vm.readyHead;
+    vm.readyHead = fiber->nextReady;
+    if(vm.readyHead == NULL) vm.readyTail = NULL;
+    fiber->nextReady = NULL;
+    return fiber;
+}
 
+// Save the running fiber's registers and load another's. This is the whole context switch.
+static void switchFiber(ObjFiber* fiber){
+    ObjFiber* current = exec.fiber;
+    if(current == fiber) return;
+    current->stackTop = exec.stackTop;
+    current->frameCount = exec.frameCount;
+    //Its stack was a root while it ran, so the collector may have traced it without looking there.
+    gcRescan((Obj*)current);
+
+    exec.fiber = fiber;
+    exec.stack = fiber->stack;
+    exec.stackTop = fiber->stackTop;
+    exec.frames = fiber->frames;
+    exec.frameCount = fiber->frameCount;
+    vm.fiberSwitches++;
+}
+
+/// @brief Set up a fiber that will call callee with the given arguments and queue it.
+/// @return The fiber, or NULL if callee can't be run on one. The reason is left in exec.nativeError.
+ObjFiber* spawnFiber(Value callee, int argCount, Value* args){
+    ObjFunction* function;
+    Value receiver = callee;
+    if(IS_BOUND_METHOD(callee)){
+        function = AS_BOUND_METHOD(callee)->method;
+        receiver = AS_BOUND_METHOD(callee)->receiver;
+    } else if(IS_FUNCTION(callee)){
+        function = AS_FUNCTION(callee);
+    } else {
+        exec.nativeError = "Can only spawn functions.";
+        return NULL;
+    }
+    if(argCount != function->arity){
+        exec.nativeError = "Spawned function got the wrong number of arguments.";
+        return NULL;
+    }
+    if(!ensureCompiled(function)){
+        exec.nativeError = "Spawned function has a compile error.";
+        return NULL;
+    }
+
+    ObjFiber* fiber = newFiber();
+    push(OBJ_VAL(fiber));
+    int capacity = function->maxStack + STACK_SLACK;
+    fiber->stack = GROW_ARRAY(MEM_STACKS, Value, NULL, 0, capacity);
+    fiber->stackCapacity = capacity;
+    fiber->frames = GROW_ARRAY(MEM_STACKS, CallFrame, NULL, 0, GROW_CAPACITY(0));
+    fiber->frameCapacity = GROW_CAPACITY(0);
+    restartFiber(fiber, function, receiver, argCount, args);
+    pop();
+    return fiber;
+}
+
+/// @brief Empty a fiber that is not running or queued, load a call to function into it and queue it.
+/// The fiber's stack must already have room for the function, nothing here allocates.
+void restartFiber(ObjFiber* fiber, ObjFunction* function, Value receiver, int argCount, Value* args){
+    fiber->state = FIBER_READY;
+    fiber->result = NIL_VAL;
+    fiber->stackTop = fiber->stack;
+    fiber->frameCount = 0;
+
+    //Laid out just as a call from run() would leave it.
+    *fiber->stackTop++ = receiver;
+    for(int i = 0; i < argCount; i++){
+        *fiber->stackTop++ = args[i];
+    }
+    CallFrame* frame = &fiber->frames[fiber->frameCount++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = fiber->stack;
+    //Born black if we are marking, and we just filled its stack without a barrier.
+    gcRescan((Obj*)fiber);
+
+    enqueueFiber(fiber);
+}
+
+InterpretResult resumeFiber(ObjFiber* fiber, int budget){
+    if(fiber->state == FIBER_FAILED) return INTERPRET_RUNTIME_ERROR;
+    if(fiber->state != FIBER_READY) return INTERPRET_OK;
+
+    ObjFiber* previous = exec.fiber;
+    switchFiber(fiber);
+    fiber->state = FIBER_RUNNING;
+    exec.budget = budget;
     InterpretResult result = run();
-    freeChunk(&chunk);
-    //compile(source);
+    //Still running means it yielded or ran out of budget.
+    if(fiber->state == FIBER_RUNNING) fiber->state = FIBER_READY;
+    switchFiber(previous);
+    return result;
+}
+
+InterpretResult runFibers(){
+    InterpretResult result = INTERPRET_OK;
+    while(vm.readyHead != NULL){
+        ObjFiber* fiber = dequeueFiber();
+        if(resumeFiber(fiber, FIBER_SLICE) != INTERPRET_OK) result = INTERPRET_RUNTIME_ERROR;
+        if(fiber->state == FIBER_READY) enqueueFiber(fiber);
+    }
     return result;
 }
\ No newline at end of file
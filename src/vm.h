@@ -1,19 +1,79 @@
 #ifndef vm_h
 #define vm_h
 
+#include <pthread.h>
+#include <stdio.h>
+
 #include "Bnuuy_chunk.h"
+#include "Bnuuy_memory.h"
+#include "Bnuuy_object.h"
+#include "Bnuuy_table.h"
 #include "Bnuuy_value.h"
 
-// The stackmax is 256, just because.
-#define STACK_MAX 256
+// Deepest call chain a single fiber can have.
+#define FRAMES_MAX 64
+// Room kept above what the verifier says a frame needs, for values the runtime parks on the stack
+// to keep them from the GC while it allocates.
+#define STACK_SLACK 8
+// A fiber gets this many loop iterations and calls before the scheduler moves on to the next one.
+#define FIBER_SLICE 1000
+
+// EXECUTION CONTEXT
+// The registers run() works with. There is one per thread: the VM's own thread drives its fibers
+// through it, and each parallel for worker gets its own so it can run bytecode alongside.
+typedef struct {
+    // The running fiber's stack and frames. These point into fiber and are saved back to it on a switch.
+    CallFrame* frames;
+    int frameCount;
+    Value* stack;
+    Value* stackTop;        //Points to the start of the empty stack.
+    ObjFiber* fiber;        // The one running now.
+    int budget;             // Loop iterations and calls left in this fiber's slice.
+    const char* nativeError;    // Set by a native to turn its return into a runtime error.
+    int line;               // Set by OP_UPDATE_LINE, for code with no line table to say where it failed.
+    bool isWorker;          // Running a parallel for body. It may read shared state but not change it.
+} ExecContext;
 
 typedef struct {
-    Chunk* chunk;           //Bytecode chunk
-    uint8_t* ip;            //Instruction pointer
-    // STATE
-    Value stack[STACK_MAX]; //Stack of values in the VM state
-    Value* stackTop;        //Points to the start of the empty stack. 
-    uint8_t line;           // A linenumber in byte, max 0XFF lines
+    // FIBERS
+    ObjFiber* rootFiber;    // Where the VM sits between scripts. The compiler and natives use its stack.
+    ObjFiber* readyHead;    // Run queue, oldest first.
+    ObjFiber* readyTail;
+    // HEAP
+    Table strings;          // Every live string, so equal strings are the same object.
+    Obj* objects;           // Head of the list of every heap object.
+    // GLOBALS
+    Table globalNames;      // Name -> slot (as a number). Only the compiler and late-bound lookups use this.
+    ValueArray globalValues;// Indexed by slot. UNDEFINED until the global's var statement runs.
+    ObjString* initString;  // "init", looked up on every class call.
+    // OUTPUT
+    FILE* printStream;      // Where print statements go. stdout unless a host points it somewhere else.
+    FILE* errorStream;      // Where runtime errors are reported. stderr, likewise.
+    pthread_mutex_t sharedLock; // Guards strings and the globals while compile workers run.
+    // GARBAGE COLLECTOR
+    size_t bytesAllocated;  // Everything that went through reallocate().
+    size_t nextGC;          // Start a cycle once bytesAllocated passes this.
+    size_t gcDebt;          // Bytes allocated since the last slice of this cycle.
+    GCPhase gcPhase;
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;        // Marked objects whose references we have not traced yet.
+    Obj* sweepList;         // Objects the sweeper has not visited yet this cycle.
+    uint64_t gcCyclePauseNs;
+    uint64_t gcCycleMaxPauseNs;
+    GCConfig gcConfig;
+    GCStats gcStats;
+    // STATS
+    uint64_t internLookups; // Times we asked the intern table for a string.
+    uint64_t internHits;    // Times the string already existed and nothing was allocated.
+    uint64_t icHits;        // Property accesses answered by an inline cache.
+    uint64_t icMisses;      // Property accesses that had to look the name up.
+    uint64_t fiberSwitches; // Times the VM changed which fiber it was working on.
+    uint64_t functionsCompiled;     // Function bodies turned into code, up front or lazily.
+    uint64_t functionsDeferred;     // Bodies skimmed in lazy mode.
+    uint64_t functionsCompiledLate; // Skimmed bodies that got called and compiled. The rest were never needed.
+    pthread_mutex_t lazyLock;       // One lazy compile at a time, parallel for workers can call at once.
+    MemStats memStats;              // Everything that went through the allocator, see printMemStats().
 } VM;
 
 typedef enum {
@@ -22,15 +82,59 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
+extern VM vm;
+extern _Thread_local ExecContext exec;
+
+// Compile workers share the intern table and the global slots. Anyone else has the VM to themselves,
+// workers only run while the VM's own thread waits on them, so only workers take the lock.
+#define LOCK_SHARED()       do { if(localHeap != NULL) pthread_mutex_lock(&vm.sharedLock); } while(false)
+#define UNLOCK_SHARED()     do { if(localHeap != NULL) pthread_mutex_unlock(&vm.sharedLock); } while(false)
+
 //VM operations
 void initVM();
 void freeVM();
+void printVMStats();                            // What --stats prints, while everything is still live.
+
+// DISPATCH MODES
+// run() has a table of opcode handlers per mode. Plain is the normal one, the others call a hook before
+// every instruction and then carry on as usual. Turning an instrumented mode on takes effect the next time
+// run() starts, which is at least once per fiber slice. Parallel for workers run their whole share in one
+// go and keep the mode they started with.
+typedef enum {
+    DISPATCH_PLAIN,
+    DISPATCH_TRACE,         // Print the stack and each instruction before it runs.
+    DISPATCH_PROFILE,       // Count instructions run, per opcode and per function.
+    DISPATCH_STEP,          // Stop before each instruction and ask the step hook what to do.
+    DISPATCH_MODE_COUNT,    // Not a mode, the number of them.
+} DispatchMode;
+
+// Called before each instruction in step mode with where it is. Return false to stop the script.
+typedef bool (*StepHook)(void* data, ObjFunction* function, int offset);
+
+void setDispatchMode(DispatchMode mode);        // Safe to call from a signal handler.
+DispatchMode getDispatchMode();
+void setStepHook(StepHook hook, void* data);    // NULL puts back the default, a prompt on stdin.
+void installDispatchSignals();                  // SIGUSR1 toggles tracing, SIGUSR2 toggles profiling.
+void printProfile();
+
+//Globals
+int resolveGlobal(ObjString* name);
+int findGlobal(ObjString* name);    // Like resolveGlobal, but -1 instead of a new slot for a name never seen.
+ObjString* globalName(int slot);
+int globalCount();                  // Slots handed out so far, safe to call from a compile worker.
 
 //Interprate code
 InterpretResult interpret(const char* sourceCode);
+InterpretResult interpretFunction(ObjFunction* function);  // Run a script that has already been compiled.
+
+//Fibers
+ObjFiber* spawnFiber(Value callee, int argCount, Value* args);  // A new fiber calling callee, queued to run. NULL on error.
+void restartFiber(ObjFiber* fiber, ObjFunction* function, Value receiver, int argCount, Value* args);  // Reuse a finished fiber.
+InterpretResult resumeFiber(ObjFiber* fiber, int budget);       // Run one fiber until it yields, finishes or uses up budget.
+InterpretResult runFibers();                                    // Take turns between ready fibers until none are left.
 
 // Stack operations
 void push(Value value);
 Value pop();
 
-#endif
\ No newline at end of file
+#endif